@@ -5,71 +5,144 @@
 #include "utils.h"
 #include "searcher.hpp"
 #include <bitset>
+#include <omp.h>
 
 namespace iRangeGraph
 {
     typedef std::pair<float, int> PFI;
 
+    // Adjacency of one construction layer in a single fixed-stride buffer: M (distance, id) slots per point
+    class LayerEdges
+    {
+    public:
+        size_t M{0};
+        std::vector<PFI> slots;
+        std::vector<int> sizes;
+        // set for lists read back from an index file, which carry the ids but not the distances
+        std::vector<char> stale;
+
+        void init(size_t data_nb, size_t M_out)
+        {
+            M = M_out;
+            slots.resize(data_nb * M);
+            sizes.assign(data_nb, 0);
+            stale.assign(data_nb, 0);
+        }
+
+        void clear()
+        {
+            std::fill(sizes.begin(), sizes.end(), 0);
+            std::fill(stale.begin(), stale.end(), 0);
+        }
+
+        PFI *list(int pid)
+        {
+            return slots.data() + (size_t)pid * M;
+        }
+
+        int size(int pid) const
+        {
+            return sizes[pid];
+        }
+    };
+
     template <typename dist_t>
     class iRangeGraph_Build
     {
     public:
         size_t max_threads = 32;
+        // Minimum number of points per construction task
+        int parallel_grain = 64;
         SegmentTree *tree;
         DataLoader *storage;
-        std::vector<std::vector<std::vector<std::pair<float, int>>>> edges;
-        std::vector<std::vector<PFI>> reverse_edges;
+        // Only a layer and the layer of its children are alive at any time, so construction alternates between two
+        // buffers indexed by layer & 1; finished layers are spilled to disk.
+        LayerEdges layer_edges_[2];
         size_t M;
         size_t ef_construction;
 
-        hnswlib::L2Space *space;
+        hnswlib::SpaceInterface<float> *space;
         hnswlib::DISTFUNC<dist_t> fstdistfunc_;
         void *dist_func_param_{nullptr};
-        std::vector<size_t> visitedpool;
-        size_t visited_tag{0};
-        std::mutex tag_mutex;
+        std::unique_ptr<hnswlib::VisitedListPool> visited_list_pool_{nullptr};
 
         std::queue<int> threadidpool;
 
-        iRangeGraph_Build(DataLoader *store, int M_out = 32, int ef_c = 400) : storage(store), M(M_out), ef_construction(ef_c)
+        // Every finished layer is spilled to spill_prefix + layer without distances
+        std::string spill_prefix;
+
+        // Entry points stored per tree node (0 disables them); nodes below entry_min_points points get none
+        int entries_per_node{4};
+        int entry_min_points{64};
+        // Points of a node that the k-means of ComputeEntries runs on
+        int entry_sample{256};
+        NodeEntries node_entries_;
+
+        // Per-thread buffers reused across all searches and pruning calls of the build
+        struct BuildScratch
+        {
+            std::vector<std::pair<PFI, bool>> candidates;
+            std::vector<PFI> return_list;
+            std::vector<bool> return_list_belong_to_lowerlayer_list;
+            std::vector<PFI> search_result;
+        };
+
+        iRangeGraph_Build(DataLoader *store, int M_out = 32, int ef_c = 400, TreeLayout tree_layout = TreeLayout::BALANCED) : storage(store), M(M_out), ef_construction(ef_c)
         {
-            space = new hnswlib::L2Space(storage->Dim);
+            space = CreateSpace(storage->metric, storage->Dim);
             fstdistfunc_ = space->get_dist_func();
             dist_func_param_ = space->get_dist_func_param();
-            tree = new SegmentTree(storage->data_nb);
+            tree = new SegmentTree(storage->data_nb, tree_layout);
             tree->BuildTree(tree->root);
-            edges.resize(storage->data_nb);
-            for (int i = 0; i < storage->data_nb; i++)
-            {
-                edges[i].resize(tree->max_depth + 1);
-            }
-            visitedpool.resize(storage->data_nb);
+            layer_edges_[0].init(storage->data_nb, M);
+            layer_edges_[1].init(storage->data_nb, M);
+            visited_list_pool_ = std::unique_ptr<hnswlib::VisitedListPool>(new hnswlib::VisitedListPool(1, storage->data_nb));
+        }
+
+        static BuildScratch &GetScratch()
+        {
+            static thread_local BuildScratch scratch;
+            return scratch;
         }
 
-        float dis_compute(std::vector<float> &v1, std::vector<float> &v2)
+        LayerEdges &layer_edges(int layer)
         {
-            return fstdistfunc_(v1.data(), v2.data(), dist_func_param_);
+            return layer_edges_[layer & 1];
+        }
+
+        float dis_compute(const float *v1, const float *v2)
+        {
+            IRG_STATS_ADD(BUILD_DISTANCES, 1);
+            return fstdistfunc_(v1, v2, dist_func_param_);
         }
 
         void copyfirstchild(TreeNode *u)
         {
             TreeNode *firstchild = u->childs[0];
+            LayerEdges &lower = layer_edges(firstchild->depth);
+            LayerEdges &higher = layer_edges(u->depth);
             for (int id = firstchild->lbound; id <= firstchild->rbound; id++)
             {
-                int lower_layer = firstchild->depth;
-                int higher_layer = u->depth;
-                edges[id][higher_layer] = edges[id][lower_layer];
+                std::copy(lower.list(id), lower.list(id) + lower.size(id), higher.list(id));
+                higher.sizes[id] = lower.size(id);
+                higher.stale[id] = lower.stale[id];
             }
         }
 
-        std::priority_queue<PFI> search_on_incomplete_graph(TreeNode *u, std::vector<float> &query_point, int ef, int query_k, std::vector<int> enterpoints)
+        void RefreshDistances(LayerEdges &edges, int pid)
         {
-            size_t local_tag;
-            {
-                std::lock_guard<std::mutex> lock(tag_mutex);
-                visited_tag++;
-                local_tag = visited_tag;
-            }
+            PFI *list = edges.list(pid);
+            for (int i = 0; i < edges.size(pid); i++)
+                list[i].first = dis_compute(storage->data_points[pid], storage->data_points[list[i].second]);
+            edges.stale[pid] = 0;
+        }
+
+        std::priority_queue<PFI> search_on_incomplete_graph(TreeNode *u, const float *query_point, int ef, int query_k, const std::vector<int> &enterpoints)
+        {
+            IRG_STATS_PHASE(BUILD_SEARCH);
+            hnswlib::VisitedList *vl = visited_list_pool_->getFreeVisitedList();
+            hnswlib::vl_type *visited_array = vl->mass;
+            hnswlib::vl_type local_tag = vl->curV;
 
             std::priority_queue<PFI, std::vector<PFI>, std::greater<PFI>> pool;
             std::priority_queue<PFI> candidates;
@@ -77,14 +150,14 @@ namespace iRangeGraph
             for (auto pid : enterpoints)
             {
                 float dis = dis_compute(query_point, storage->data_points[pid]);
-                visitedpool[pid] = local_tag;
+                visited_array[pid] = local_tag;
                 pool.emplace(dis, pid);
                 candidates.emplace(dis, pid);
             }
 
             float lowerBound = candidates.top().first;
 
-            int layer = u->depth;
+            LayerEdges &edges = layer_edges(u->depth);
 
             while (!pool.empty())
             {
@@ -93,14 +166,15 @@ namespace iRangeGraph
                     break;
                 pool.pop();
                 int current_pointId = current_pair.second;
-                size_t size = edges[current_pointId][layer].size();
+                size_t size = edges.size(current_pointId);
+                PFI *list = edges.list(current_pointId);
 
                 for (int i = 0; i < size; i++)
                 {
-                    int neighborId = edges[current_pointId][layer][i].second;
-                    if (visitedpool[neighborId] == local_tag)
+                    int neighborId = list[i].second;
+                    if (visited_array[neighborId] == local_tag)
                         continue;
-                    visitedpool[neighborId] = local_tag;
+                    visited_array[neighborId] = local_tag;
                     float dis = dis_compute(query_point, storage->data_points[neighborId]);
                     if (candidates.size() < ef || dis < lowerBound)
                     {
@@ -118,50 +192,50 @@ namespace iRangeGraph
                     }
                 }
             }
+            visited_list_pool_->releaseVisitedList(vl);
 
             while (candidates.size() > query_k)
                 candidates.pop();
             return candidates;
         }
 
-        std::vector<PFI> PruneByHeuristic2(std::vector<PFI> &old_list, std::vector<PFI> &new_list)
+        // Selects at most M neighbors out of old_list + new_list into result (which may alias old_list) and returns
+        // their number. Candidates from old_list are not pruned against each other.
+        int PruneByHeuristic2(const PFI *old_list, int old_size, const PFI *new_list, int new_size, PFI *result)
         {
-            std::priority_queue<PFI, std::vector<PFI>, std::greater<PFI>> queue_closest;
-            std::vector<PFI> return_list;
-            std::vector<bool> return_list_belong_to_lowerlayer_list;
-            for (auto t : old_list)
-                queue_closest.emplace(t);
-            for (auto t : new_list)
-                queue_closest.emplace(t);
+            IRG_STATS_PHASE(BUILD_PRUNE);
+            BuildScratch &scratch = GetScratch();
+            std::vector<std::pair<PFI, bool>> &queue_closest = scratch.candidates;
+            std::vector<PFI> &return_list = scratch.return_list;
+            std::vector<bool> &return_list_belong_to_lowerlayer_list = scratch.return_list_belong_to_lowerlayer_list;
+            queue_closest.clear();
+            return_list.clear();
+            return_list_belong_to_lowerlayer_list.clear();
+
+            for (int i = 0; i < old_size; i++)
+                queue_closest.emplace_back(old_list[i], true);
+            for (int i = 0; i < new_size; i++)
+                queue_closest.emplace_back(new_list[i], false);
+            std::sort(queue_closest.begin(), queue_closest.end(), [](const std::pair<PFI, bool> &a, const std::pair<PFI, bool> &b)
+                      { return a.first < b.first; });
+
             if (queue_closest.size() <= M)
             {
-                while (queue_closest.size())
-                {
-                    return_list.emplace_back(queue_closest.top());
-                    queue_closest.pop();
-                }
-                return return_list;
+                for (int i = 0; i < queue_closest.size(); i++)
+                    result[i] = queue_closest[i].first;
+                return queue_closest.size();
             }
 
-            while (queue_closest.size())
+            for (auto &current : queue_closest)
             {
                 if (return_list.size() >= M)
                     break;
 
-                auto current_pair = queue_closest.top();
+                auto current_pair = current.first;
                 float dist_to_pid = current_pair.first;
-                queue_closest.pop();
+                bool current_old = current.second;
 
                 bool good = true;
-                bool current_old = false;
-                for (auto t : old_list)
-                {
-                    if (t.second == current_pair.second)
-                    {
-                        current_old = true;
-                        break;
-                    }
-                }
                 for (int i = 0; i < return_list.size(); i++)
                 {
                     if (current_old && return_list_belong_to_lowerlayer_list[i])
@@ -180,7 +254,8 @@ namespace iRangeGraph
                     return_list_belong_to_lowerlayer_list.emplace_back(current_old);
                 }
             }
-            return return_list;
+            std::copy(return_list.begin(), return_list.end(), result);
+            return return_list.size();
         }
 
         void process_node(TreeNode *u)
@@ -191,60 +266,220 @@ namespace iRangeGraph
             copyfirstchild(u);
             int merged_point_num = u->childs[0]->rbound - u->childs[0]->lbound + 1;
             unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-            std::default_random_engine e(seed);
-
             for (int i = 1; i < u->childs.size(); i++)
             {
-                std::uniform_int_distribution<int> u_start(0, merged_point_num - 1);
                 TreeNode *cur_child = u->childs[i];
-                for (int pid = cur_child->lbound; pid <= cur_child->rbound; pid++)
+                MergeRange(u, cur_child->lbound, cur_child->rbound, merged_point_num, seed);
+                merged_point_num += cur_child->rbound - cur_child->lbound + 1;
+            }
+        }
+
+        // Inserts the points [lbound, rbound] of a child of u into the layer of u, whose first merged_point_num points
+        // (from u->lbound on) are already merged: every inserted point searches the merged part and keeps the pruned
+        // union of that result and its child-layer list, then the merged points take the reverse edges.
+        void MergeRange(TreeNode *u, int lbound, int rbound, int merged_point_num, unsigned seed)
+        {
+            LayerEdges &edges = layer_edges(u->depth);
+            LayerEdges &child_edges = layer_edges(u->depth + 1);
+            std::uniform_int_distribution<int> u_start(0, merged_point_num - 1);
+            // Inserted points only search the already merged part, whose lists this loop never writes, so they are
+            // independent tasks that idle threads can steal.
+#pragma omp taskloop if (rbound - lbound >= parallel_grain) grainsize(parallel_grain) shared(edges, child_edges)
+            for (int pid = lbound; pid <= rbound; pid++)
+            {
+                IRG_STATS_ADD(BUILD_POINTS, 1);
+                std::default_random_engine e(seed + pid);
+                // the entry points of the children merged so far, else three random merged points
+                std::vector<int> enterpoints;
+                if (!node_entries_.empty())
+                {
+                    for (auto child : u->childs)
+                    {
+                        if (child->rbound < u->lbound + merged_point_num)
+                            enterpoints.insert(enterpoints.end(), node_entries_.begin(child), node_entries_.end(child));
+                    }
+                }
+                if (enterpoints.empty())
                 {
-                    std::vector<int> enterpoints;
                     for (int i = 0; i < std::min(3, merged_point_num); i++)
                     {
                         int enterpid = u_start(e) + u->lbound;
                         enterpoints.emplace_back(enterpid);
                     }
+                }
+
+                auto search_result = search_on_incomplete_graph(u, storage->data_points[pid], ef_construction, ef_construction, enterpoints);
+                std::vector<PFI> &new_list = GetScratch().search_result;
+                new_list.clear();
+                while (search_result.size())
+                {
+                    new_list.emplace_back(search_result.top());
+                    search_result.pop();
+                }
+                edges.sizes[pid] = PruneByHeuristic2(child_edges.list(pid), child_edges.size(pid), new_list.data(), new_list.size(), edges.list(pid));
+            }
 
-                    auto search_result = search_on_incomplete_graph(u, storage->data_points[pid], ef_construction, ef_construction, enterpoints);
-                    while (search_result.size())
+            // reverse edges into the merged part, grouped by target in one contiguous array
+            std::vector<int> reverse_offsets(merged_point_num + 1, 0);
+            std::vector<PFI> reverse_edges;
+            {
+                IRG_STATS_PHASE(BUILD_REVERSE);
+                for (int pid = lbound; pid <= rbound; pid++)
+                {
+                    for (int k = 0; k < edges.size(pid); k++)
                     {
-                        edges[pid][u->depth].emplace_back(search_result.top());
-                        search_result.pop();
+                        int neighborId = edges.list(pid)[k].second;
+                        if (neighborId < lbound)
+                            reverse_offsets[neighborId - u->lbound + 1]++;
                     }
-                    edges[pid][u->depth] = PruneByHeuristic2(edges[pid][cur_child->depth], edges[pid][u->depth]);
                 }
-
                 for (int j = 0; j < merged_point_num; j++)
+                    reverse_offsets[j + 1] += reverse_offsets[j];
+                reverse_edges.resize(reverse_offsets[merged_point_num]);
+                std::vector<int> cursor(reverse_offsets.begin(), reverse_offsets.end() - 1);
+                for (int pid = lbound; pid <= rbound; pid++)
                 {
-                    int pid = u->lbound + j;
-                    reverse_edges[pid].clear();
+                    for (int k = 0; k < edges.size(pid); k++)
+                    {
+                        auto neighbor_pair = edges.list(pid)[k];
+                        int neighborId = neighbor_pair.second;
+                        if (neighborId < lbound)
+                            reverse_edges[cursor[neighborId - u->lbound]++] = PFI(neighbor_pair.first, pid);
+                    }
                 }
+            }
 
-                for (int pid = cur_child->lbound; pid <= cur_child->rbound; pid++)
+#pragma omp taskloop if (merged_point_num >= parallel_grain) grainsize(parallel_grain) shared(edges, reverse_offsets, reverse_edges)
+            for (int j = 0; j < merged_point_num; j++)
+            {
+                int pid = u->lbound + j;
+                int reverse_size = reverse_offsets[j + 1] - reverse_offsets[j];
+                // lists are kept sorted by distance, so without new candidates pruning would return the list as is
+                if (reverse_size == 0)
+                    continue;
+                if (edges.stale[pid])
+                    RefreshDistances(edges, pid);
+                edges.sizes[pid] = PruneByHeuristic2(edges.list(pid), edges.size(pid), reverse_edges.data() + reverse_offsets[j], reverse_size, edges.list(pid));
+            }
+        }
+
+        // Picks up to entries_per_node entry points for every tree node of at least entry_min_points points: a few
+        // Lloyd iterations of k-means on a sample of the node, each centroid then mapped to its nearest sampled point,
+        // so that the entries spread over the clusters of the node. With one entry this is an approximate medoid.
+        void ComputeEntries()
+        {
+            node_entries_ = NodeEntries();
+            if (entries_per_node <= 0)
+                return;
+            timeval t1, t2;
+            gettimeofday(&t1, NULL);
+            size_t dim = storage->Dim;
+            std::vector<std::vector<int>> per_node(tree->treenodes.size());
+#pragma omp parallel for schedule(dynamic, 1) num_threads(max_threads)
+            for (int n = 0; n < tree->treenodes.size(); n++)
+            {
+                TreeNode *u = tree->treenodes[n];
+                int size = u->rbound - u->lbound + 1;
+                if (size < entry_min_points)
+                    continue;
+                std::default_random_engine e(u->node_id);
+                std::vector<int> sample;
+                if (size <= entry_sample)
+                {
+                    for (int pid = u->lbound; pid <= u->rbound; pid++)
+                        sample.emplace_back(pid);
+                }
+                else
                 {
-                    for (auto neighbor_pair : edges[pid][u->depth])
+                    std::uniform_int_distribution<int> u_pick(u->lbound, u->rbound);
+                    for (int i = 0; i < entry_sample; i++)
+                        sample.emplace_back(u_pick(e));
+                }
+                int k = std::min<int>(entries_per_node, sample.size());
+                std::vector<float> centroids(k * dim);
+                for (int c = 0; c < k; c++)
+                    std::memcpy(centroids.data() + c * dim, storage->data_points[sample[(size_t)c * sample.size() / k]], dim * sizeof(float));
+
+                std::vector<int> assign(sample.size());
+                auto nearest_centroid = [&](const float *v)
+                {
+                    int best = 0;
+                    float best_dis = std::numeric_limits<float>::max();
+                    for (int c = 0; c < k; c++)
                     {
-                        int neighborId = neighbor_pair.second;
-                        if (neighborId < cur_child->lbound)
+                        float dis = fstdistfunc_(v, centroids.data() + c * dim, dist_func_param_);
+                        if (dis < best_dis)
                         {
-                            reverse_edges[neighborId].emplace_back(neighbor_pair.first, pid);
+                            best_dis = dis;
+                            best = c;
                         }
                     }
+                    return best;
+                };
+                for (int iter = 0; iter < 5 && k > 1; iter++)
+                {
+                    for (size_t i = 0; i < sample.size(); i++)
+                        assign[i] = nearest_centroid(storage->data_points[sample[i]]);
+                    std::vector<int> members(k, 0);
+                    std::fill(centroids.begin(), centroids.end(), 0);
+                    for (size_t i = 0; i < sample.size(); i++)
+                    {
+                        const float *v = storage->data_points[sample[i]];
+                        float *centroid = centroids.data() + assign[i] * dim;
+                        for (size_t d = 0; d < dim; d++)
+                            centroid[d] += v[d];
+                        members[assign[i]]++;
+                    }
+                    for (int c = 0; c < k; c++)
+                    {
+                        // an empty cluster restarts at a sampled point
+                        if (members[c] == 0)
+                        {
+                            std::memcpy(centroids.data() + c * dim, storage->data_points[sample[e() % sample.size()]], dim * sizeof(float));
+                            continue;
+                        }
+                        for (size_t d = 0; d < dim; d++)
+                            centroids[c * dim + d] /= members[c];
+                    }
                 }
-
-                for (int j = 0; j < merged_point_num; j++)
+                if (k == 1)
                 {
-                    int pid = u->lbound + j;
-                    edges[pid][u->depth] = PruneByHeuristic2(edges[pid][u->depth], reverse_edges[pid]);
+                    std::fill(centroids.begin(), centroids.end(), 0);
+                    for (int pid : sample)
+                    {
+                        for (size_t d = 0; d < dim; d++)
+                            centroids[d] += storage->data_points[pid][d] / sample.size();
+                    }
                 }
 
-                merged_point_num += cur_child->rbound - cur_child->lbound + 1;
+                std::vector<int> &entries = per_node[n];
+                for (int c = 0; c < k; c++)
+                {
+                    int best = sample[0];
+                    float best_dis = std::numeric_limits<float>::max();
+                    for (int pid : sample)
+                    {
+                        float dis = fstdistfunc_(storage->data_points[pid], centroids.data() + c * dim, dist_func_param_);
+                        if (dis < best_dis)
+                        {
+                            best_dis = dis;
+                            best = pid;
+                        }
+                    }
+                    if (std::find(entries.begin(), entries.end(), best) == entries.end())
+                        entries.emplace_back(best);
+                }
             }
+            node_entries_.Assign(per_node);
+            gettimeofday(&t2, NULL);
+            std::cout << "entry points: " << node_entries_.ids.size() << " for " << tree->treenodes.size() << " nodes in " << GetTime(t1, t2) << "s" << std::endl;
         }
 
         void buildindex()
         {
+            if (spill_prefix == "")
+                throw Exception("spill_prefix is not set");
+            ComputeEntries();
             std::vector<std::vector<TreeNode *>> level_nodes;
             level_nodes.resize(tree->max_depth + 1);
             for (auto node : tree->treenodes)
@@ -254,43 +489,51 @@ namespace iRangeGraph
             for (int layer = tree->max_depth; layer >= 0; layer--)
             {
                 std::cout << "building for layer " << layer << std::endl;
-                std::vector<std::thread> threads;
+                layer_edges(layer).clear();
 
+                // One task per node; process_node splits large nodes further, so the few wide nodes near the root
+                // still keep every thread of the pool busy.
+#pragma omp parallel num_threads(max_threads)
+#pragma omp single
                 for (int i = 0; i < level_nodes[layer].size(); i++)
                 {
-                    if (threads.size() >= max_threads)
-                    {
-                        for (auto &thread : threads)
-                        {
-                            if (thread.joinable())
-                            {
-                                thread.join();
-                            }
-                        }
-                        threads.clear();
-                    }
                     TreeNode *u = level_nodes[layer][i];
-                    threads.emplace_back(std::thread(&iRangeGraph_Build<dist_t>::process_node, this, u));
-                }
-                for (auto &thread : threads)
-                {
-                    if (thread.joinable())
-                    {
-                        thread.join();
-                    }
+#pragma omp task firstprivate(u)
+                    process_node(u);
                 }
 
-                threads.clear();
+                // edges of layer+1 are final once every node of this layer has merged its children
+                if (layer + 1 <= tree->max_depth)
+                    FinishLayer(layer + 1);
             }
+            FinishLayer(0);
+        }
+
+        std::string SpillPath(int layer)
+        {
+            return spill_prefix + std::to_string(layer);
+        }
+
+        void FinishLayer(int layer)
+        {
+            BufferedWriter spillfile(SpillPath(layer));
+            LayerEdges &edges = layer_edges(layer);
+            for (int pid = 0; pid < storage->data_nb; pid++)
+            {
+                int size = edges.size(pid);
+                PFI *list = edges.list(pid);
+                spillfile.write(&size, sizeof(int));
+                for (int i = 0; i < size; i++)
+                    spillfile.write(&list[i].second, sizeof(int));
+            }
+            spillfile.close();
         }
 
         void buildandsave(std::string indexpath)
         {
             CheckPath(indexpath);
-            std::ofstream indexfile(indexpath, std::ios::out | std::ios::binary);
-            if (!indexfile.is_open())
-                throw Exception("cannot open " + indexpath);
-            reverse_edges.resize(storage->data_nb);
+            BufferedWriter indexfile(indexpath);
+            spill_prefix = indexpath + ".layer";
             timeval t1, t2;
             gettimeofday(&t1, NULL);
             buildindex();
@@ -298,23 +541,167 @@ namespace iRangeGraph
             double construction_time = GetTime(t1, t2);
 
             std::cout << "construction time:" << construction_time << "s" << std::endl;
+            IRG_STATS_PRINT(std::cout);
+
+            WriteIndex(indexfile);
+        }
 
+        // Merges the per-layer spill files into the point-major index layout and removes them
+        void WriteIndex(BufferedWriter &indexfile)
+        {
+            std::vector<std::unique_ptr<BufferedReader>> spillfiles;
+            for (int layer = 0; layer <= tree->max_depth; layer++)
+                spillfiles.emplace_back(new BufferedReader(SpillPath(layer)));
+            WriteIndexHeader(indexfile, storage->metric, tree->layout, storage->data_nb, node_entries_.MaxPerNode());
+            std::vector<int> list(M);
             for (int pid = 0; pid < storage->data_nb; pid++)
             {
                 for (int layer = 0; layer <= tree->max_depth; layer++)
                 {
-                    int size = edges[pid][layer].size();
-                    indexfile.write((char *)&size, sizeof(int));
-                    for (int i = 0; i < size; i++)
+                    int size;
+                    spillfiles[layer]->read(&size, sizeof(int));
+                    if (size > list.size())
+                        list.resize(size);
+                    spillfiles[layer]->read(list.data(), size * sizeof(int));
+                    indexfile.write(&size, sizeof(int));
+                    indexfile.write(list.data(), size * sizeof(int));
+                }
+            }
+            if (!node_entries_.empty())
+                node_entries_.Write(indexfile);
+            spillfiles.clear();
+            for (int layer = 0; layer <= tree->max_depth; layer++)
+                std::filesystem::remove(SpillPath(layer));
+
+            indexfile.close();
+            std::cout << "save index done" << std::endl;
+        }
+
+        // Extends an index built with TreeLayout::ALIGNED over the first points of storage to all of them. Nodes that
+        // hold only old points keep their lists, new nodes are built as usual, and each right-spine node (old and new
+        // points) inserts its new points into its existing lists with the same merge as process_node. When the new
+        // points outgrow the old capacity, the old tree becomes the first subtree of new roots, shifting its layers
+        // down. indexpath may be oldindexpath: the old index is fully read before the new one is written.
+        void appendandsave(std::string oldindexpath, std::string indexpath)
+        {
+            if (tree->layout != TreeLayout::ALIGNED)
+                throw Exception("appending requires the aligned tree layout");
+            CheckPath(indexpath);
+            std::unique_ptr<BufferedReader> oldfile(new BufferedReader(oldindexpath));
+            IndexFileHeader header = ReadIndexHeader(oldfile->infile, storage->metric, oldindexpath);
+            if ((TreeLayout)header.tree_layout != TreeLayout::ALIGNED || header.data_nb == 0)
+                throw Exception(oldindexpath + " was not built with the aligned tree layout");
+            size_t old_nb = header.data_nb;
+            if (old_nb >= storage->data_nb)
+                throw Exception("no new points to append: " + oldindexpath + " already indexes " + std::to_string(old_nb) + " points");
+
+            SegmentTree oldtree(old_nb, TreeLayout::ALIGNED);
+            int shift = 0;
+            for (size_t capacity = oldtree.capacity; capacity < tree->capacity; capacity *= tree->ways_)
+                shift++;
+            int old_max_depth = tree->max_depth - shift;
+            spill_prefix = indexpath + ".layer";
+            std::string old_prefix = indexpath + ".old";
+
+            timeval t1, t2;
+            gettimeofday(&t1, NULL);
+            // spine nodes now cover more points, so all entries are chosen again
+            ComputeEntries();
+            // split the point-major old index into one file per layer so that layers can be read back bottom-up
+            {
+                std::vector<std::unique_ptr<BufferedWriter>> layerfiles;
+                for (int layer = 0; layer <= old_max_depth; layer++)
+                    layerfiles.emplace_back(new BufferedWriter(old_prefix + std::to_string(layer), 4 << 20));
+                std::vector<int> list(M);
+                for (size_t pid = 0; pid < old_nb; pid++)
+                {
+                    for (int layer = 0; layer <= old_max_depth; layer++)
                     {
-                        int neighborId = edges[pid][layer][i].second;
-                        indexfile.write((char *)&neighborId, sizeof(int));
+                        int size;
+                        oldfile->read(&size, sizeof(int));
+                        if (size > M)
+                            throw Exception(oldindexpath + " holds lists longer than M");
+                        oldfile->read(list.data(), size * sizeof(int));
+                        layerfiles[layer]->write(&size, sizeof(int));
+                        layerfiles[layer]->write(list.data(), size * sizeof(int));
                     }
                 }
             }
+            oldfile.reset();
 
-            std::cout << "save index done" << std::endl;
-            indexfile.close();
+            std::vector<std::vector<TreeNode *>> level_nodes(tree->max_depth + 1);
+            for (auto node : tree->treenodes)
+                level_nodes[node->depth].emplace_back(node);
+            for (int layer = tree->max_depth; layer >= 0; layer--)
+            {
+                std::cout << "appending for layer " << layer << std::endl;
+                LayerEdges &edges = layer_edges(layer);
+                edges.clear();
+                bool has_old_layer = layer >= shift;
+                if (has_old_layer)
+                {
+                    std::string path = old_prefix + std::to_string(layer - shift);
+                    {
+                        BufferedReader layerfile(path);
+                        std::vector<int> list(M);
+                        for (size_t pid = 0; pid < old_nb; pid++)
+                        {
+                            int size;
+                            layerfile.read(&size, sizeof(int));
+                            layerfile.read(list.data(), size * sizeof(int));
+                            for (int i = 0; i < size; i++)
+                                edges.list(pid)[i] = PFI(0, list[i]);
+                            edges.sizes[pid] = size;
+                            edges.stale[pid] = 1;
+                        }
+                    }
+                    std::filesystem::remove(path);
+                }
+
+#pragma omp parallel num_threads(max_threads)
+#pragma omp single
+                for (int i = 0; i < level_nodes[layer].size(); i++)
+                {
+                    TreeNode *u = level_nodes[layer][i];
+                    int old_count = std::max(0, std::min((int)old_nb, u->rbound + 1) - u->lbound);
+                    if (old_count == u->rbound - u->lbound + 1)
+                        continue;
+#pragma omp task firstprivate(u, old_count)
+                    {
+                        if (old_count == 0 || !has_old_layer)
+                            process_node(u);
+                        else
+                            append_node(u, old_count);
+                    }
+                }
+
+                if (layer + 1 <= tree->max_depth)
+                    FinishLayer(layer + 1);
+            }
+            FinishLayer(0);
+            gettimeofday(&t2, NULL);
+            std::cout << "append time:" << GetTime(t1, t2) << "s for " << storage->data_nb - old_nb << " points" << std::endl;
+            IRG_STATS_PRINT(std::cout);
+
+            BufferedWriter indexfile(indexpath);
+            WriteIndex(indexfile);
+        }
+
+        // Right-spine node of an append: its first old_count points keep the lists read from the old index, and the
+        // new points of every child are merged in after them
+        void append_node(TreeNode *u, int old_count)
+        {
+            int merged_point_num = old_count;
+            int old_end = u->lbound + old_count;
+            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            for (auto child : u->childs)
+            {
+                int lbound = std::max(child->lbound, old_end);
+                if (lbound > child->rbound)
+                    continue;
+                MergeRange(u, lbound, child->rbound, merged_point_num, seed);
+                merged_point_num += child->rbound - lbound + 1;
+            }
         }
     };
 
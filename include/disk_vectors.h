@@ -0,0 +1,392 @@
+#pragma once
+
+#include "utils.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace iRangeGraph
+{
+    // Aligned vector file: one header page, then row i at ALIGNED_VECTOR_HEADER_BYTES + i * row_bytes, zero padded to
+    // row_bytes and the file to a whole page. row_bytes is a power of two below a sector and a multiple of the sector
+    // above, so every row lies in whole sectors and can be read with O_DIRECT, i.e. without the page cache.
+    constexpr uint32_t ALIGNED_VECTOR_MAGIC = 0x56415249;
+    constexpr uint32_t ALIGNED_VECTOR_VERSION = 1;
+    constexpr size_t ALIGNED_VECTOR_HEADER_BYTES = 4096;
+    constexpr size_t DISK_SECTOR_BYTES = 512;
+
+    struct AlignedVectorHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t nb;
+        uint64_t dim;
+        uint64_t row_bytes;
+        // rows were normalized for cosine
+        uint32_t normalized;
+    };
+
+    // One io_uring per thread, set up through the raw system calls. Reads of a batch are all queued before a single
+    // io_uring_enter waits for them. available() is false when the kernel refuses io_uring; callers then use pread.
+    class IoRing
+    {
+    public:
+        static IoRing &Local()
+        {
+            static thread_local IoRing ring;
+            return ring;
+        }
+
+        bool available() const { return ring_fd_ >= 0 && !broken_; }
+
+        // Reads len[i] bytes at off[i] of fd into dst[i] for all i < n; false if any read failed or came back short
+        bool ReadAll(int fd, char *const *dst, const size_t *len, const off_t *off, size_t n)
+        {
+            size_t submitted = 0, completed = 0;
+            bool ok = true;
+            while (completed < n)
+            {
+                unsigned tail = *sq_tail_;
+                unsigned queued = 0;
+                while (submitted < n && submitted - completed < entries_)
+                {
+                    unsigned index = tail & *sq_mask_;
+                    io_uring_sqe *sqe = &sqes_[index];
+                    std::memset(sqe, 0, sizeof(*sqe));
+                    sqe->opcode = IORING_OP_READ;
+                    sqe->fd = fd;
+                    sqe->addr = (uint64_t)dst[submitted];
+                    sqe->len = len[submitted];
+                    sqe->off = off[submitted];
+                    sqe->user_data = submitted;
+                    sq_array_[index] = index;
+                    tail++;
+                    queued++;
+                    submitted++;
+                }
+                __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+                unsigned inflight = submitted - completed;
+                if (syscall(__NR_io_uring_enter, ring_fd_, queued, inflight, IORING_ENTER_GETEVENTS, nullptr, 0) < 0)
+                {
+                    // reads may still be queued, so the ring is not reused
+                    broken_ = true;
+                    return false;
+                }
+
+                unsigned head = *cq_head_;
+                unsigned ready = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+                for (; head != ready; head++)
+                {
+                    io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+                    if (cqe->res < 0 || (size_t)cqe->res != len[cqe->user_data])
+                        ok = false;
+                    completed++;
+                }
+                __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            }
+            return ok;
+        }
+
+        ~IoRing()
+        {
+            if (sqes_ != nullptr)
+                munmap(sqes_, sqes_bytes_);
+            if (cq_ring_ != nullptr && cq_ring_ != sq_ring_)
+                munmap(cq_ring_, cq_ring_bytes_);
+            if (sq_ring_ != nullptr)
+                munmap(sq_ring_, sq_ring_bytes_);
+            if (ring_fd_ >= 0)
+                close(ring_fd_);
+        }
+
+    private:
+        int ring_fd_{-1};
+        bool broken_{false};
+        unsigned entries_{0};
+        void *sq_ring_{nullptr}, *cq_ring_{nullptr};
+        io_uring_sqe *sqes_{nullptr};
+        size_t sq_ring_bytes_{0}, cq_ring_bytes_{0}, sqes_bytes_{0};
+        unsigned *sq_tail_{nullptr}, *sq_mask_{nullptr}, *sq_array_{nullptr};
+        unsigned *cq_head_{nullptr}, *cq_tail_{nullptr}, *cq_mask_{nullptr};
+        io_uring_cqe *cqes_{nullptr};
+
+        IoRing(unsigned depth = 64)
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            int fd = syscall(__NR_io_uring_setup, depth, &params);
+            if (fd < 0)
+                return;
+            sq_ring_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_ring_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap)
+                sq_ring_bytes_ = cq_ring_bytes_ = std::max(sq_ring_bytes_, cq_ring_bytes_);
+            sqes_bytes_ = params.sq_entries * sizeof(io_uring_sqe);
+
+            void *sq = mmap(nullptr, sq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            void *cq = single_mmap ? sq : mmap(nullptr, cq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            void *sqes = mmap(nullptr, sqes_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+            {
+                if (sqes != MAP_FAILED)
+                    munmap(sqes, sqes_bytes_);
+                if (cq != MAP_FAILED && cq != sq)
+                    munmap(cq, cq_ring_bytes_);
+                if (sq != MAP_FAILED)
+                    munmap(sq, sq_ring_bytes_);
+                close(fd);
+                return;
+            }
+            sq_ring_ = sq;
+            cq_ring_ = cq;
+            sqes_ = (io_uring_sqe *)sqes;
+            char *sqp = (char *)sq, *cqp = (char *)cq;
+            sq_tail_ = (unsigned *)(sqp + params.sq_off.tail);
+            sq_mask_ = (unsigned *)(sqp + params.sq_off.ring_mask);
+            sq_array_ = (unsigned *)(sqp + params.sq_off.array);
+            cq_head_ = (unsigned *)(cqp + params.cq_off.head);
+            cq_tail_ = (unsigned *)(cqp + params.cq_off.tail);
+            cq_mask_ = (unsigned *)(cqp + params.cq_off.ring_mask);
+            cqes_ = (io_uring_cqe *)(cqp + params.cq_off.cqes);
+            entries_ = params.sq_entries;
+            ring_fd_ = fd;
+        }
+    };
+
+    // Read-only access to an aligned vector file without keeping it in memory
+    class DiskVectors
+    {
+    public:
+        size_t nb{0}, dim{0}, row_bytes{0};
+        bool normalized{false};
+        // Rows closer than this are fetched by one read, which also returns the gap between them
+        size_t coalesce_bytes{4096};
+
+        DiskVectors() {}
+        DiskVectors(const DiskVectors &) = delete;
+        DiskVectors &operator=(const DiskVectors &) = delete;
+        ~DiskVectors()
+        {
+            if (fd_ >= 0)
+                close(fd_);
+        }
+
+        static size_t RowBytes(size_t dim)
+        {
+            size_t bytes = dim * sizeof(float);
+            if (bytes >= DISK_SECTOR_BYTES)
+                return (bytes + DISK_SECTOR_BYTES - 1) / DISK_SECTOR_BYTES * DISK_SECTOR_BYTES;
+            size_t row = sizeof(float);
+            while (row < bytes)
+                row <<= 1;
+            return row;
+        }
+
+        // Converts a .bin vector file, one slice of rows at a time; cosine rows are normalized on the way
+        static void Write(std::string binfilename, std::string filename, Metric metric)
+        {
+            std::ifstream binfile(binfilename, std::ios::in | std::ios::binary);
+            if (!binfile.is_open())
+                throw Exception("cannot open " + binfilename);
+            int bin_header[2];
+            if (!binfile.read((char *)bin_header, sizeof(bin_header)) || bin_header[0] < 0 || bin_header[1] <= 0)
+                throw Exception(binfilename + " is not a vector file");
+            binfile.close();
+            size_t total = bin_header[0], dim = bin_header[1], row_bytes = RowBytes(dim);
+            VectorSet chunk;
+
+            CheckPath(filename);
+            BufferedWriter outfile(filename);
+            std::vector<char> page(ALIGNED_VECTOR_HEADER_BYTES, 0);
+            AlignedVectorHeader *header = (AlignedVectorHeader *)page.data();
+            header->magic = ALIGNED_VECTOR_MAGIC;
+            header->version = ALIGNED_VECTOR_VERSION;
+            header->nb = total;
+            header->dim = dim;
+            header->row_bytes = row_bytes;
+            header->normalized = metric == Metric::COSINE;
+            outfile.write(page.data(), page.size());
+
+            size_t rows_per_chunk = std::max<size_t>(1, (256 << 20) / row_bytes);
+            std::vector<char> row(row_bytes, 0);
+            for (size_t first = 0; first < total; first += rows_per_chunk)
+            {
+                chunk.Load(binfilename, metric, first, rows_per_chunk);
+                for (size_t i = 0; i < chunk.size(); i++)
+                {
+                    std::memcpy(row.data(), chunk[i], dim * sizeof(float));
+                    outfile.write(row.data(), row_bytes);
+                }
+            }
+            size_t tail = (total * row_bytes) % ALIGNED_VECTOR_HEADER_BYTES;
+            if (tail != 0)
+            {
+                std::vector<char> padding(ALIGNED_VECTOR_HEADER_BYTES - tail, 0);
+                outfile.write(padding.data(), padding.size());
+            }
+            outfile.close();
+        }
+
+        void Open(std::string filename)
+        {
+            filename_ = filename;
+            fd_ = open(filename.c_str(), O_RDONLY | O_DIRECT);
+            direct_ = fd_ >= 0;
+            // file systems without O_DIRECT (e.g., tmpfs) are read through the page cache
+            if (fd_ < 0)
+                fd_ = open(filename.c_str(), O_RDONLY);
+            if (fd_ < 0)
+                throw Exception("cannot open " + filename);
+            char *page = AlignedBuffer(0, ALIGNED_VECTOR_HEADER_BYTES);
+            AlignedVectorHeader *header = (AlignedVectorHeader *)page;
+            if (pread(fd_, page, ALIGNED_VECTOR_HEADER_BYTES, 0) != ALIGNED_VECTOR_HEADER_BYTES || header->magic != ALIGNED_VECTOR_MAGIC)
+                throw Exception(filename + " is not an aligned vector file");
+            if (header->version != ALIGNED_VECTOR_VERSION)
+                throw Exception("unsupported aligned vector file version in " + filename);
+            nb = header->nb;
+            dim = header->dim;
+            row_bytes = header->row_bytes;
+            normalized = header->normalized;
+            if (row_bytes != RowBytes(dim))
+                throw Exception("row size of " + filename + " does not match its dimension");
+            struct stat st;
+            if (fstat(fd_, &st) != 0 || (size_t)st.st_size < ALIGNED_VECTOR_HEADER_BYTES + nb * row_bytes)
+                throw Exception(filename + " is truncated");
+        }
+
+        // Copies rows [first, first + count) to dst, count * dim floats; one large sequential read per call
+        void ReadRows(size_t first, size_t count, float *dst) const
+        {
+            off_t begin = RowOffset(first) / DISK_SECTOR_BYTES * DISK_SECTOR_BYTES;
+            off_t end = (RowOffset(first + count) + ALIGNED_VECTOR_HEADER_BYTES - 1) / ALIGNED_VECTOR_HEADER_BYTES * ALIGNED_VECTOR_HEADER_BYTES;
+            char *buffer = AlignedBuffer(1, end - begin);
+            size_t done = 0;
+            while (done < (size_t)(end - begin))
+            {
+                ssize_t n = pread(fd_, buffer + done, end - begin - done, begin + done);
+                if (n <= 0)
+                    break;
+                done += n;
+            }
+            if (done < (size_t)(RowOffset(first + count) - begin))
+                throw Exception("failed to read " + filename_);
+            for (size_t i = 0; i < count; i++)
+                std::memcpy(dst + i * dim, buffer + RowOffset(first + i) - begin, dim * sizeof(float));
+        }
+
+        // Fetches the rows of ids[0..n) and calls visit(i, row of ids[i]). Rows are read in file order as sector
+        // aligned extents, neighbors within coalesce_bytes share one extent, and all extents of a call are in flight
+        // at once. Returns the number of reads issued.
+        template <typename Visit>
+        size_t Gather(const int *ids, size_t n, Visit visit) const
+        {
+            if (n == 0)
+                return 0;
+            GatherScratch &scratch = Scratch();
+            scratch.order.resize(n);
+            for (size_t i = 0; i < n; i++)
+                scratch.order[i] = i;
+            std::sort(scratch.order.begin(), scratch.order.end(), [&](size_t a, size_t b)
+                      { return ids[a] < ids[b]; });
+
+            // group the sorted rows into extents and record where each row lands in the buffer
+            scratch.dst.clear();
+            scratch.len.clear();
+            scratch.off.clear();
+            scratch.row_pos.resize(n);
+            off_t extent_begin = 0, extent_end = 0;
+            size_t total = 0;
+            for (size_t k = 0; k < n; k++)
+            {
+                off_t row = RowOffset(ids[scratch.order[k]]);
+                off_t begin = row / DISK_SECTOR_BYTES * DISK_SECTOR_BYTES;
+                off_t end = (row + row_bytes + DISK_SECTOR_BYTES - 1) / DISK_SECTOR_BYTES * DISK_SECTOR_BYTES;
+                if (k == 0 || begin > extent_end + (off_t)coalesce_bytes)
+                {
+                    if (k != 0)
+                    {
+                        scratch.off.emplace_back(extent_begin);
+                        scratch.len.emplace_back(extent_end - extent_begin);
+                        total += extent_end - extent_begin;
+                    }
+                    extent_begin = begin;
+                }
+                extent_end = std::max(extent_end, end);
+                scratch.row_pos[k] = total + (row - extent_begin);
+            }
+            scratch.off.emplace_back(extent_begin);
+            scratch.len.emplace_back(extent_end - extent_begin);
+            total += extent_end - extent_begin;
+
+            char *buffer = AlignedBuffer(2, total);
+            size_t pos = 0;
+            for (size_t e = 0; e < scratch.len.size(); e++)
+            {
+                scratch.dst.emplace_back(buffer + pos);
+                pos += scratch.len[e];
+            }
+            ReadExtents(scratch.dst.data(), scratch.len.data(), scratch.off.data(), scratch.len.size());
+            for (size_t k = 0; k < n; k++)
+                visit(scratch.order[k], (const float *)(buffer + scratch.row_pos[k]));
+            return scratch.len.size();
+        }
+
+    private:
+        int fd_{-1};
+        bool direct_{false};
+        std::string filename_;
+
+        struct GatherScratch
+        {
+            std::vector<size_t> order, row_pos, len;
+            std::vector<off_t> off;
+            std::vector<char *> dst;
+        };
+
+        static GatherScratch &Scratch()
+        {
+            static thread_local GatherScratch scratch;
+            return scratch;
+        }
+
+        // Per-thread page-aligned buffers that grow on demand; slot separates buffers used at the same time
+        static char *AlignedBuffer(int slot, size_t bytes)
+        {
+            struct Buffer
+            {
+                char *data{nullptr};
+                size_t capacity{0};
+                ~Buffer() { free(data); }
+            };
+            static thread_local Buffer buffers[3];
+            Buffer &buffer = buffers[slot];
+            if (buffer.capacity < bytes)
+            {
+                free(buffer.data);
+                buffer.capacity = (bytes + ALIGNED_VECTOR_HEADER_BYTES - 1) / ALIGNED_VECTOR_HEADER_BYTES * ALIGNED_VECTOR_HEADER_BYTES;
+                buffer.data = (char *)std::aligned_alloc(ALIGNED_VECTOR_HEADER_BYTES, buffer.capacity);
+                if (buffer.data == nullptr)
+                    throw std::runtime_error("Not enough memory");
+            }
+            return buffer.data;
+        }
+
+        off_t RowOffset(size_t i) const
+        {
+            return ALIGNED_VECTOR_HEADER_BYTES + i * row_bytes;
+        }
+
+        void ReadExtents(char *const *dst, const size_t *len, const off_t *off, size_t n) const
+        {
+            IoRing &ring = IoRing::Local();
+            if (ring.available() && ring.ReadAll(fd_, dst, len, off, n))
+                return;
+            for (size_t e = 0; e < n; e++)
+            {
+                if (pread(fd_, dst[e], len[e], off[e]) != (ssize_t)len[e])
+                    throw Exception("failed to read " + filename_);
+            }
+        }
+    };
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace half
+{
+    // IEEE 754 binary16 and bfloat16 vector elements. Conversions from float round to nearest even; binary16
+    // saturates to infinity beyond 65504 and keeps subnormals, bfloat16 keeps the float exponent range.
+
+    inline uint32_t float_bits(float f)
+    {
+        uint32_t u;
+        memcpy(&u, &f, sizeof(u));
+        return u;
+    }
+
+    inline float bits_float(uint32_t u)
+    {
+        float f;
+        memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+
+    inline float bf16_to_float(uint16_t h)
+    {
+        return bits_float((uint32_t)h << 16);
+    }
+
+    inline uint16_t float_to_bf16(float f)
+    {
+        uint32_t u = float_bits(f);
+        if ((u & 0x7fffffff) > 0x7f800000)
+            return (uint16_t)((u >> 16) | 0x40);
+        u += 0x7fff + ((u >> 16) & 1);
+        return (uint16_t)(u >> 16);
+    }
+
+    inline float fp16_to_float(uint16_t h)
+    {
+        uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+        uint32_t exponent = (h >> 10) & 0x1f;
+        uint32_t mantissa = h & 0x3ff;
+        if (exponent == 0x1f)
+            return bits_float(sign | 0x7f800000 | (mantissa << 13));
+        if (exponent != 0)
+            return bits_float(sign | ((exponent + 112) << 23) | (mantissa << 13));
+        // subnormal: mantissa * 2^-24
+        float value = (float)mantissa * bits_float(0x33800000);
+        return sign ? -value : value;
+    }
+
+    inline uint16_t float_to_fp16(float f)
+    {
+        uint32_t u = float_bits(f);
+        uint16_t sign = (uint16_t)((u >> 16) & 0x8000);
+        uint32_t magnitude = u & 0x7fffffff;
+        if (magnitude > 0x7f800000)
+            return sign | 0x7e00;
+        // 65520 and above round to infinity
+        if (magnitude >= 0x477ff000)
+            return sign | 0x7c00;
+        if (magnitude < 0x38800000)
+        {
+            // subnormal or zero: adding 0.5 lets the float unit round the mantissa to nearest even
+            float value = bits_float(magnitude) + 0.5f;
+            return sign | (uint16_t)(float_bits(value) - 0x3f000000);
+        }
+        uint32_t rounded = magnitude + 0xfff + ((magnitude >> 13) & 1) - (112u << 23);
+        return sign | (uint16_t)(rounded >> 13);
+    }
+
+    inline void float_to_fp16(const float *src, uint16_t *dst, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = float_to_fp16(src[i]);
+    }
+
+    inline void float_to_bf16(const float *src, uint16_t *dst, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = float_to_bf16(src[i]);
+    }
+
+    inline void fp16_to_float(const uint16_t *src, float *dst, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = fp16_to_float(src[i]);
+    }
+
+    inline void bf16_to_float(const uint16_t *src, float *dst, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = bf16_to_float(src[i]);
+    }
+}
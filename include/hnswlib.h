@@ -170,6 +170,20 @@ static void readBinaryPOD(std::istream &in, T &podRef) {
 template<typename MTYPE>
 using DISTFUNC = MTYPE(*)(const void *, const void *, const void *);
 
+// Distances from one query to four vectors at once: (query, vectors[4], param, out[4])
+template<typename MTYPE>
+using DISTFUNC4 = void(*)(const void *, const void *const *, const void *, MTYPE *);
+
+#if defined(USE_AVX)
+static inline float
+HorizontalSumAVX(__m256 v) {
+    __m128 sumh = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 tmp1 = _mm_add_ps(sumh, _mm_movehl_ps(sumh, sumh));
+    __m128 tmp2 = _mm_add_ps(tmp1, _mm_movehdup_ps(tmp1));
+    return _mm_cvtss_f32(tmp2);
+}
+#endif
+
 template<typename MTYPE>
 class SpaceInterface {
  public:
@@ -180,6 +194,14 @@ class SpaceInterface {
 
     virtual void *get_dist_func_param() = 0;
 
+    // nullptr when the space has no batched kernel for this build or CPU
+    virtual DISTFUNC4<MTYPE> get_dist_func_batch4() { return nullptr; }
+
+    // Distance between a float32 query and a vector stored with 16-bit elements (see half.hpp); the parameter is
+    // get_dist_func_param(). nullptr when the space has none.
+    virtual DISTFUNC<MTYPE> get_dist_func_fp16() { return nullptr; }
+    virtual DISTFUNC<MTYPE> get_dist_func_bf16() { return nullptr; }
+
     virtual ~SpaceInterface() {}
 };
 
@@ -4,10 +4,135 @@
 #include "utils.h"
 #include "searcher.hpp"
 #include "memory.hpp"
+#include "quantizer.hpp"
+#include "disk_vectors.h"
 #include <bitset>
+#include <numeric>
+#include <omp.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace iRangeGraph
 {
+    // Flat index file: one header page followed by the final data_memory_ image (links per layer plus vector for
+    // every point), so that a searcher can mmap it directly and processes on one host share the page cache.
+    constexpr uint32_t FLAT_INDEX_MAGIC = 0x46475249;
+    // version 2 adds the metric and version 3 the tree layout; older files carry zero there, i.e. L2 and BALANCED.
+    // Version 4 appends the node entry points after the image, in the index file format, when entries_per_node > 0.
+    constexpr uint32_t FLAT_INDEX_VERSION = 4;
+    constexpr size_t FLAT_INDEX_HEADER_BYTES = 4096;
+
+    struct FlatIndexHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t max_elements;
+        uint64_t dim;
+        uint64_t M_out;
+        uint64_t max_depth;
+        uint64_t size_links_per_layer;
+        uint64_t size_links_per_element;
+        uint64_t size_data_per_element;
+        uint64_t data_size;
+        uint32_t metric;
+        uint32_t tree_layout;
+        uint32_t entries_per_node;
+    };
+
+    // Slots a point placed by ReorderBlocks is scored against
+    constexpr int REORDER_WINDOW = 8;
+
+    // How vectors are kept inline in data_memory_. With SQ8 the graph is traversed on 8-bit codes and the final
+    // candidates are re-ranked on the float32 vectors, which stay memory-mapped from the data file. SQ8_DISK keeps
+    // the same codes but leaves the float32 vectors in an aligned vector file (DiskVectors) that is read with O_DIRECT
+    // for re-ranking only, so neither the process nor the page cache holds them. FP16 and BF16 keep every vector
+    // with 16-bit elements, half the bytes per hop of FP32; distances widen them against the float32 query and the
+    // results are not re-ranked.
+    enum class VectorStorage : uint32_t
+    {
+        FP32 = 0,
+        SQ8 = 1,
+        SQ8_DISK = 2,
+        FP16 = 3,
+        BF16 = 4
+    };
+
+    // --vector_storage of the search tools; SQ8 has its own options since it needs a data or aligned vector file
+    inline VectorStorage ParseVectorStorage(const std::string &name)
+    {
+        if (name == "fp32")
+            return VectorStorage::FP32;
+        if (name == "fp16")
+            return VectorStorage::FP16;
+        if (name == "bf16")
+            return VectorStorage::BF16;
+        throw Exception("unknown vector storage " + name + ", expected fp32, fp16 or bf16");
+    }
+
+    // How the per-layer neighbor lists are kept. DENSE reserves M_out slots for every layer of every point next to its
+    // vector. COMPACT stores each distinct list of a point once (consecutive layers often repeat the list of the child
+    // they were copied from) and keeps a 16-bit word offset per layer; vectors then sit in their own contiguous array.
+    enum class LinkStorage : uint32_t
+    {
+        DENSE = 0,
+        COMPACT = 1
+    };
+
+    // Per-query ef chosen from the range selectivity. For each range fraction 2^0 ... 2^-9 swept by search(), the table
+    // holds the smallest ef that reached the target recall; a query takes the entry of the nearest fraction.
+    class EfPolicy
+    {
+    public:
+        static constexpr int kFractions = 10;
+        std::vector<int> ef_by_fraction;
+
+        // Reads <resultprefix>0.csv ... 9.csv as written by search(), one "ef,recall,qps,dco,hop" row per ef. A fraction
+        // that never reached the target falls back to the largest ef of its sweep.
+        void Calibrate(std::string resultprefix, float target_recall)
+        {
+            ef_by_fraction.assign(kFractions, 0);
+            for (int suffix = 0; suffix < kFractions; suffix++)
+            {
+                std::string path = resultprefix + std::to_string(suffix) + ".csv";
+                std::ifstream infile(path);
+                if (!infile.is_open())
+                    throw Exception("cannot open " + path);
+                int best = -1, largest = 0;
+                std::string line;
+                while (std::getline(infile, line))
+                {
+                    int ef;
+                    float recall;
+                    if (sscanf(line.c_str(), "%d,%f", &ef, &recall) != 2)
+                        throw Exception("malformed row in " + path);
+                    largest = std::max(largest, ef);
+                    if (recall >= target_recall && (best < 0 || ef < best))
+                        best = ef;
+                }
+                if (largest == 0)
+                    throw Exception(path + " is empty");
+                ef_by_fraction[suffix] = best < 0 ? largest : best;
+            }
+        }
+
+        int GetEf(int ql, int qr, size_t data_nb) const
+        {
+            double len = std::max(1, qr - ql + 1);
+            int fraction = (int)std::lround(std::log2(data_nb / len));
+            fraction = std::min(std::max(fraction, 0), kFractions - 1);
+            return ef_by_fraction[fraction];
+        }
+    };
+
+    // Candidate queue of TopDown_nodeentries_search. HEAP keeps a min-heap of candidates and a max-heap of results;
+    // LINEAR_POOL keeps the ef best points in one sorted array (searcher::LinearPool) and expands them in order.
+    enum class SearchEngine
+    {
+        HEAP,
+        LINEAR_POOL
+    };
+
     template <typename dist_t>
     class iRangeGraph_Search
     {
@@ -27,17 +152,76 @@ namespace iRangeGraph
         size_t offsetData_{0};
 
         char *data_memory_{nullptr};
+        // Pages and NUMA placement of data_memory_ when it is allocated here (not mapped from a flat index file)
+        memory::Placement placement_;
+        memory::PageBuffer data_pages_;
+        // REPLICATE: the copy of data_memory_ on each NUMA node, replica_memory_[0] == data_memory_; empty otherwise
+        std::vector<memory::PageBuffer> replicas_;
+        std::vector<char *> replica_memory_;
+        // After ReorderBlocks, internal ids are storage slots: logical_[slot] is the sorted id kept in a slot and
+        // slot_[pid] the slot of sorted id pid. Both are empty while points are stored in sorted order.
+        std::vector<tableint> logical_;
+        std::vector<tableint> slot_;
 
-        hnswlib::L2Space *space;
+        LinkStorage link_storage_{LinkStorage::DENSE};
+        // COMPACT: the lists of point pid start at word link_offsets_[pid] of link_pool_, and the list of a layer at
+        // layer_slots_[pid * (max_depth + 1) + layer] words further; each list is a count followed by the ids
+        std::vector<tableint> link_pool_;
+        std::vector<size_t> link_offsets_;
+        std::vector<uint16_t> layer_slots_;
+        // COMPACT under REPLICATE: one buffer per NUMA node holding copies of link_offsets_, link_pool_ and
+        // layer_slots_ in that order, read through get_linklist on the node of the calling thread; empty otherwise
+        std::vector<memory::PageBuffer> link_replicas_;
+        // Non-null when data_memory_ points into a read-only mapping of a flat index file
+        char *mapped_file_{nullptr};
+        size_t mapped_size_{0};
+
+        hnswlib::SpaceInterface<float> *space;
         hnswlib::DISTFUNC<dist_t> fstdistfunc_;
         void *dist_func_param_{nullptr};
+        // Scores four vectors per call in ComputeDistances; nullptr when data_memory_ holds codes or without SIMD
+        hnswlib::DISTFUNC4<dist_t> batchdistfunc_{nullptr};
+
+        VectorStorage vector_storage_{VectorStorage::FP32};
+        quantizer::SQ8Quantizer sq8_;
+        // Full-precision distance and vectors used for re-ranking when data_memory_ holds codes
+        hnswlib::DISTFUNC<dist_t> exactdistfunc_;
+        void *exact_dist_func_param_{nullptr};
+        char *raw_file_{nullptr};
+        size_t raw_size_{0};
+        const float *raw_data_{nullptr};
+        // SQ8_DISK: the float32 vectors
+        DiskVectors disk_vectors_;
 
         size_t metric_distance_computations{0};
         size_t metric_hops{0};
 
         int prefetch_lines{0};
+        // Number of neighbor vectors kept in flight ahead of the distance computation
+        int prefetch_ahead{8};
+
+        SearchEngine search_engine{SearchEngine::HEAP};
+        // Stop a query after this many consecutive expansions that add nothing to its ef best; 0 disables
+        int patience{0};
+        // Ranges of at most this many points are answered by an exact scan instead of the graph; 0 disables
+        int scan_threshold{0};
+
+        // Entry points of the tree nodes, in sorted ids, when the index file has them
+        NodeEntries node_entries_;
+        // Seed with node_entries_ when present; false draws one random point per covering node
+        bool use_node_entries{true};
+
+        // Epoch-tagged visited lists, borrowed per query so that setup costs O(1) instead of O(N)
+        std::unique_ptr<hnswlib::VisitedListPool> visited_list_pool_{nullptr};
+
+        // Covers of recently queried ranges (see EnableCoverCache); nullptr collects every cover anew
+        std::unique_ptr<RangeCoverCache> cover_cache;
+        // search_batch answers queries of nested ranges together: up to interleave_width heap walks over the same part
+        // of the graph advance in turn (see search_batch_grouped and InterleavedHeapSearch)
+        bool group_ranges{false};
+        int interleave_width{4};
 
-        iRangeGraph_Search(std::string vectorfilename, std::string edgefilename, DataLoader *store, int M) : storage(store)
+        iRangeGraph_Search(std::string vectorfilename, std::string edgefilename, DataLoader *store, int M, VectorStorage vector_storage = VectorStorage::FP32, LinkStorage link_storage = LinkStorage::DENSE, memory::Placement placement = memory::Placement()) : storage(store), placement_(placement), link_storage_(link_storage), vector_storage_(vector_storage)
         {
             std::ifstream vectorfile(vectorfilename, std::ios::in | std::ios::binary);
             if (!vectorfile.is_open())
@@ -46,33 +230,77 @@ namespace iRangeGraph
             if (!edgefile.is_open())
                 throw Exception("cannot open " + edgefilename);
 
-            vectorfile.read((char *)&max_elements_, sizeof(int));
-            vectorfile.read((char *)&dim_, sizeof(int));
+            IndexFileHeader index_header = ReadIndexHeader(edgefile, storage->metric, edgefilename);
+            if (vector_storage_ == VectorStorage::SQ8 && storage->metric == Metric::COSINE)
+                throw Exception("SQ8 storage re-ranks on the unnormalized data file and does not support cosine");
+            if (vector_storage_ == VectorStorage::SQ8 && storage->dtype != VectorDtype::F32)
+                throw Exception("SQ8 storage re-ranks on the memory-mapped data file, which has to hold float32 vectors");
 
-            tree = new SegmentTree(max_elements_);
-            tree->BuildTree(tree->root);
-
-            space = new hnswlib::L2Space(dim_);
-            fstdistfunc_ = space->get_dist_func();
-            dist_func_param_ = space->get_dist_func_param();
-            M_out = M;
-
-            data_size_ = (dim_ + 7) / 8 * 8 * sizeof(float);
-            size_links_per_layer_ = M_out * sizeof(tableint) + sizeof(linklistsizeint);
-            size_links_per_element_ = (size_links_per_layer_ * (tree->max_depth + 1) + 31) / 32 * 32;
-            size_data_per_element_ = size_links_per_element_ + data_size_;
-            offsetData_ = size_links_per_element_;
-            prefetch_lines = data_size_ >> 4;
+            // with SQ8_DISK, vectorfilename is the aligned vector file
+            int data_nb, dim;
+            if (vector_storage_ == VectorStorage::SQ8_DISK)
+            {
+                disk_vectors_.Open(vectorfilename);
+                if (disk_vectors_.normalized != (storage->metric == Metric::COSINE))
+                    throw Exception(vectorfilename + (disk_vectors_.normalized ? " holds normalized vectors, which only cosine search uses" : " holds unnormalized vectors; convert it with --metric cosine"));
+                data_nb = disk_vectors_.nb;
+                dim = disk_vectors_.dim;
+            }
+            else
+            {
+                vectorfile.read((char *)&data_nb, sizeof(int));
+                vectorfile.read((char *)&dim, sizeof(int));
+                if (std::filesystem::file_size(vectorfilename) != 2 * sizeof(int) + (size_t)data_nb * dim * DtypeSize(storage->dtype))
+                    throw Exception(vectorfilename + " does not hold " + std::to_string(data_nb) + " vectors of " + std::to_string(dim) + " " + std::to_string(8 * DtypeSize(storage->dtype)) + "-bit elements; check --dtype");
+            }
+            if (index_header.data_nb != 0 && index_header.data_nb != data_nb)
+                throw Exception(edgefilename + " indexes " + std::to_string(index_header.data_nb) + " points but " + vectorfilename + " holds " + std::to_string(data_nb));
+            InitLayout(data_nb, dim, M, (TreeLayout)index_header.tree_layout);
+            if (link_storage_ == LinkStorage::COMPACT)
+            {
+                // data_memory_ holds only the vectors
+                size_links_per_element_ = 0;
+                size_data_per_element_ = data_size_;
+                offsetData_ = 0;
+                link_offsets_.resize(max_elements_);
+                layer_slots_.resize(max_elements_ * (tree->max_depth + 1));
+            }
 
-            data_memory_ = (char *)memory::align_mm<1 << 21>(max_elements_ * size_data_per_element_);
+            data_pages_ = memory::alloc_pages(max_elements_ * size_data_per_element_, placement_.pages, placement_.numa);
+            data_memory_ = data_pages_.ptr;
             if (data_memory_ == nullptr)
                 throw std::runtime_error("Not enough memory");
 
+            if (vector_storage_ == VectorStorage::SQ8)
+            {
+                MapRawVectors(vectorfilename);
+                sq8_.train(raw_data_, max_elements_, dim_);
+                madvise(raw_file_, raw_size_, MADV_RANDOM);
+                fstdistfunc_ = storage->metric == Metric::L2 ? quantizer::SQ8L2Sqr : quantizer::SQ8InnerProductDistance;
+                dist_func_param_ = &sq8_;
+            }
+            else if (vector_storage_ == VectorStorage::SQ8_DISK)
+            {
+                EncodeFromDisk();
+                fstdistfunc_ = storage->metric == Metric::L2 ? quantizer::SQ8L2Sqr : quantizer::SQ8InnerProductDistance;
+                dist_func_param_ = &sq8_;
+            }
+            else if (vector_storage_ == VectorStorage::FP16)
+                fstdistfunc_ = space->get_dist_func_fp16();
+            else if (vector_storage_ == VectorStorage::BF16)
+                fstdistfunc_ = space->get_dist_func_bf16();
+
+            std::vector<tableint> list(M_out + 1);
+            // one row of the data file, and the same row widened to float32
+            std::vector<char> file_row(dim_ * DtypeSize(storage->dtype));
+            std::vector<float> row(dim_);
             for (int pid = 0; pid < max_elements_; pid++)
             {
+                if (link_storage_ == LinkStorage::COMPACT)
+                    link_offsets_[pid] = link_pool_.size();
                 for (int layer = 0; layer <= tree->max_depth; layer++)
                 {
-                    linklistsizeint *data = get_linklist(pid, layer);
+                    linklistsizeint *data = link_storage_ == LinkStorage::COMPACT ? list.data() : get_linklist(pid, layer);
                     edgefile.read((char *)data, sizeof(tableint));
                     int size = getListCount(data);
                     if (size > M_out)
@@ -82,32 +310,530 @@ namespace iRangeGraph
                         char *current_neighbor_ = (char *)(data + 1 + i);
                         edgefile.read(current_neighbor_, sizeof(tableint));
                     }
+                    if (link_storage_ == LinkStorage::COMPACT)
+                        layer_slots_[(size_t)pid * (tree->max_depth + 1) + layer] = InternList(pid, list.data());
                 }
 
                 char *data = getDataByInternalId(pid);
-                // vectorfile.read(data, data_size_);
-                vectorfile.read(data, dim_ * sizeof(float));
+                if (vector_storage_ == VectorStorage::SQ8)
+                    sq8_.encode(getRawDataByInternalId(pid), (uint8_t *)data);
+                else if (vector_storage_ != VectorStorage::SQ8_DISK)
+                {
+                    vectorfile.read(file_row.data(), file_row.size());
+                    float *vec = vector_storage_ == VectorStorage::FP32 ? (float *)data : row.data();
+                    DecodeVector(file_row.data(), storage->dtype, vec, dim_);
+                    if (storage->metric == Metric::COSINE)
+                        NormalizeVector(vec, dim_);
+                    if (vector_storage_ == VectorStorage::FP16)
+                        half::float_to_fp16(vec, (uint16_t *)data, dim_);
+                    else if (vector_storage_ == VectorStorage::BF16)
+                        half::float_to_bf16(vec, (uint16_t *)data, dim_);
+                }
             }
 
+            if (index_header.entries_per_node > 0)
+                node_entries_.Read(edgefile, tree->treenodes.size(), max_elements_, edgefilename);
             edgefile.close();
             vectorfile.close();
+            if (link_storage_ == LinkStorage::COMPACT)
+            {
+                link_pool_.shrink_to_fit();
+                size_t dense_bytes = max_elements_ * (tree->max_depth + 1) * size_links_per_layer_;
+                size_t compact_bytes = link_pool_.size() * sizeof(tableint) + link_offsets_.size() * sizeof(size_t) + layer_slots_.size() * sizeof(uint16_t);
+                std::cout << "compact links: " << compact_bytes / (1 << 20) << " MB instead of " << dense_bytes / (1 << 20) << " MB" << std::endl;
+            }
+            if (placement_.numa == memory::NumaPolicy::REPLICATE)
+                Replicate();
+            if (vector_storage_ == VectorStorage::SQ8_DISK)
+                std::cout << "vectors on disk: " << max_elements_ * disk_vectors_.row_bytes / (1 << 20) << " MB, codes in memory: " << max_elements_ * data_size_ / (1 << 20) << " MB" << std::endl;
             std::cout << "load index finished ..." << std::endl;
         }
 
+        // Zero-copy loading of a file written by SaveFlatIndex. populate pre-faults the whole mapping (MAP_POPULATE);
+        // otherwise pages are faulted in on demand with a random-access hint.
+        iRangeGraph_Search(std::string flatindexfilename, DataLoader *store, bool populate = false) : storage(store)
+        {
+            int fd = open(flatindexfilename.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw Exception("cannot open " + flatindexfilename);
+            FlatIndexHeader header;
+            if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != FLAT_INDEX_MAGIC)
+            {
+                close(fd);
+                throw Exception(flatindexfilename + " is not a flat index file");
+            }
+            if (header.version < 1 || header.version > FLAT_INDEX_VERSION)
+            {
+                close(fd);
+                throw Exception("unsupported flat index version in " + flatindexfilename);
+            }
+            if ((Metric)header.metric != storage->metric)
+            {
+                close(fd);
+                throw Exception(flatindexfilename + " was built with metric " + MetricName((Metric)header.metric) + " but " + MetricName(storage->metric) + " was requested");
+            }
+
+            InitLayout(header.max_elements, header.dim, header.M_out, (TreeLayout)header.tree_layout);
+            if (header.max_depth != tree->max_depth || header.size_links_per_layer != size_links_per_layer_ || header.size_links_per_element != size_links_per_element_ || header.size_data_per_element != size_data_per_element_ || header.data_size != data_size_)
+            {
+                close(fd);
+                throw Exception("layout of " + flatindexfilename + " does not match this build");
+            }
+
+            struct stat st;
+            fstat(fd, &st);
+            mapped_size_ = FLAT_INDEX_HEADER_BYTES + max_elements_ * size_data_per_element_;
+            if ((size_t)st.st_size < mapped_size_)
+            {
+                close(fd);
+                throw Exception(flatindexfilename + " is truncated");
+            }
+
+            int flags = MAP_SHARED;
+            if (populate)
+                flags |= MAP_POPULATE;
+            void *p = mmap(nullptr, mapped_size_, PROT_READ, flags, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED)
+                throw Exception("cannot mmap " + flatindexfilename);
+            if (!populate)
+                madvise(p, mapped_size_, MADV_RANDOM);
+
+            mapped_file_ = (char *)p;
+            data_memory_ = mapped_file_ + FLAT_INDEX_HEADER_BYTES;
+            if (header.version >= 4 && header.entries_per_node > 0)
+            {
+                std::ifstream entryfile(flatindexfilename, std::ios::in | std::ios::binary);
+                entryfile.seekg(mapped_size_);
+                node_entries_.Read(entryfile, tree->treenodes.size(), max_elements_, flatindexfilename);
+            }
+            std::cout << "map index finished ..." << std::endl;
+        }
+
         ~iRangeGraph_Search()
         {
-            free(data_memory_);
+            if (mapped_file_ != nullptr)
+                munmap(mapped_file_, mapped_size_);
+            else
+                memory::free_pages(data_pages_);
+            for (size_t slot = 1; slot < replicas_.size(); slot++)
+                memory::free_pages(replicas_[slot]);
+            for (auto &links : link_replicas_)
+                memory::free_pages(links);
+            mapped_file_ = nullptr;
             data_memory_ = nullptr;
+            if (raw_file_ != nullptr)
+                munmap(raw_file_, raw_size_);
+            raw_file_ = nullptr;
+        }
+
+        // Returns the word offset, relative to the first list of pid, of a list equal to list (count, ids...), appending
+        // it to link_pool_ unless this point already stores it
+        uint16_t InternList(int pid, const tableint *list)
+        {
+            size_t begin = link_offsets_[pid];
+            size_t words = list[0] + 1;
+            for (size_t offset = begin; offset < link_pool_.size(); offset += link_pool_[offset] + 1)
+            {
+                if (link_pool_[offset] == list[0] && std::equal(list + 1, list + words, link_pool_.begin() + offset + 1))
+                    return offset - begin;
+            }
+            size_t offset = link_pool_.size() - begin;
+            if (offset > UINT16_MAX)
+                throw Exception("too many distinct neighbor lists for one point");
+            link_pool_.insert(link_pool_.end(), list, list + words);
+            return offset;
+        }
+
+        // Trains and fills the SQ8 codes in two sequential passes over the aligned vector file
+        void EncodeFromDisk()
+        {
+            size_t rows_per_chunk = std::max<size_t>(1, (64 << 20) / (dim_ * sizeof(float)));
+            std::vector<float> chunk(rows_per_chunk * dim_);
+            sq8_.begin_training(dim_);
+            for (size_t first = 0; first < max_elements_; first += rows_per_chunk)
+            {
+                size_t count = std::min(rows_per_chunk, max_elements_ - first);
+                disk_vectors_.ReadRows(first, count, chunk.data());
+                sq8_.observe(chunk.data(), count);
+            }
+            sq8_.finish_training();
+            for (size_t first = 0; first < max_elements_; first += rows_per_chunk)
+            {
+                size_t count = std::min(rows_per_chunk, max_elements_ - first);
+                disk_vectors_.ReadRows(first, count, chunk.data());
+                for (size_t i = 0; i < count; i++)
+                    sq8_.encode(chunk.data() + i * dim_, (uint8_t *)getDataByInternalId(first + i));
+            }
+        }
+
+        // Maps the .bin data file read-only; raw vectors are only touched for training and re-ranking
+        void MapRawVectors(std::string vectorfilename)
+        {
+            int fd = open(vectorfilename.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw Exception("cannot open " + vectorfilename);
+            raw_size_ = 2 * sizeof(int) + max_elements_ * dim_ * sizeof(float);
+            void *p = mmap(nullptr, raw_size_, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED)
+                throw Exception("cannot mmap " + vectorfilename);
+            raw_file_ = (char *)p;
+            raw_data_ = (const float *)(raw_file_ + 2 * sizeof(int));
+        }
+
+        void InitLayout(size_t data_nb, size_t dim, size_t M, TreeLayout tree_layout)
+        {
+            max_elements_ = data_nb;
+            dim_ = dim;
+
+            tree = new SegmentTree(max_elements_, tree_layout);
+            tree->BuildTree(tree->root);
+
+            space = CreateSpace(storage->metric, dim_);
+            fstdistfunc_ = space->get_dist_func();
+            dist_func_param_ = space->get_dist_func_param();
+            exactdistfunc_ = fstdistfunc_;
+            exact_dist_func_param_ = dist_func_param_;
+            if (vector_storage_ == VectorStorage::FP32)
+                batchdistfunc_ = space->get_dist_func_batch4();
+            M_out = M;
+
+            if (vector_storage_ == VectorStorage::FP32)
+                data_size_ = (dim_ + 7) / 8 * 8 * sizeof(float);
+            else if (vector_storage_ == VectorStorage::FP16 || vector_storage_ == VectorStorage::BF16)
+                data_size_ = (dim_ + 15) / 16 * 16 * sizeof(uint16_t);
+            else
+                data_size_ = (dim_ + 31) / 32 * 32;
+            size_links_per_layer_ = M_out * sizeof(tableint) + sizeof(linklistsizeint);
+            size_links_per_element_ = (size_links_per_layer_ * (tree->max_depth + 1) + 31) / 32 * 32;
+            size_data_per_element_ = size_links_per_element_ + data_size_;
+            offsetData_ = size_links_per_element_;
+            prefetch_lines = data_size_ >> 4;
+            visited_list_pool_ = std::unique_ptr<hnswlib::VisitedListPool>(new hnswlib::VisitedListPool(1, max_elements_));
+        }
+
+        // Writes the in-memory layout as a flat index file that can later be loaded with mmap
+        void SaveFlatIndex(std::string filename) const
+        {
+            if (vector_storage_ != VectorStorage::FP32)
+                throw Exception("flat index files only support float32 vector storage");
+            if (link_storage_ != LinkStorage::DENSE)
+                throw Exception("flat index files store the dense link layout");
+            if (!logical_.empty())
+                throw Exception("flat index files store points in sorted order; save before reordering");
+            CheckPath(filename);
+            std::ofstream outfile(filename, std::ios::out | std::ios::binary);
+            if (!outfile.is_open())
+                throw Exception("cannot open " + filename);
+
+            std::vector<char> page(FLAT_INDEX_HEADER_BYTES, 0);
+            FlatIndexHeader *header = (FlatIndexHeader *)page.data();
+            header->magic = FLAT_INDEX_MAGIC;
+            header->version = FLAT_INDEX_VERSION;
+            header->max_elements = max_elements_;
+            header->dim = dim_;
+            header->M_out = M_out;
+            header->max_depth = tree->max_depth;
+            header->size_links_per_layer = size_links_per_layer_;
+            header->size_links_per_element = size_links_per_element_;
+            header->size_data_per_element = size_data_per_element_;
+            header->data_size = data_size_;
+            header->metric = (uint32_t)storage->metric;
+            header->tree_layout = (uint32_t)tree->layout;
+            header->entries_per_node = node_entries_.MaxPerNode();
+
+            outfile.write(page.data(), page.size());
+            outfile.write(data_memory_, max_elements_ * size_data_per_element_);
+            if (!node_entries_.empty())
+                node_entries_.Write(outfile);
+            if (!outfile)
+                throw Exception("failed to write " + filename);
+            outfile.close();
+        }
+
+        size_t CompactLinkBytes() const
+        {
+            return link_offsets_.size() * sizeof(size_t) + link_pool_.size() * sizeof(tableint) + layer_slots_.size() * sizeof(uint16_t);
+        }
+
+        // Lays out link_offsets_, link_pool_ and layer_slots_ in buffer as get_linklist reads them from a replica
+        void CopyCompactLinks(char *buffer) const
+        {
+            tableint *pool = (tableint *)std::copy(link_offsets_.begin(), link_offsets_.end(), (size_t *)buffer);
+            uint16_t *slots = (uint16_t *)std::copy(link_pool_.begin(), link_pool_.end(), pool);
+            std::copy(layer_slots_.begin(), layer_slots_.end(), slots);
+        }
+
+        // Copies data_memory_ to every other NUMA node, and compact links to every node, so that each node reads
+        // links and vectors from its own memory
+        void Replicate()
+        {
+            const std::vector<int> &nodes = memory::numa_nodes();
+            if (nodes.size() < 2)
+            {
+                std::cout << "one NUMA node, index is not replicated" << std::endl;
+                return;
+            }
+            replicas_.assign(1, data_pages_);
+            replica_memory_.assign(1, data_memory_);
+            size_t bytes = max_elements_ * size_data_per_element_;
+            for (size_t slot = 1; slot < nodes.size(); slot++)
+            {
+                memory::PageBuffer copy = memory::alloc_pages(bytes, placement_.pages, memory::NumaPolicy::REPLICATE, slot);
+                if (copy.ptr == nullptr)
+                    throw std::runtime_error("Not enough memory");
+                std::memcpy(copy.ptr, data_memory_, bytes);
+                replicas_.emplace_back(copy);
+                replica_memory_.emplace_back(copy.ptr);
+            }
+            if (link_storage_ == LinkStorage::COMPACT)
+            {
+                size_t link_bytes = CompactLinkBytes();
+                for (size_t slot = 0; slot < nodes.size(); slot++)
+                {
+                    memory::PageBuffer links = memory::alloc_pages(link_bytes, placement_.pages, memory::NumaPolicy::REPLICATE, slot);
+                    if (links.ptr == nullptr)
+                        throw std::runtime_error("Not enough memory");
+                    CopyCompactLinks(links.ptr);
+                    link_replicas_.emplace_back(links);
+                }
+                bytes += link_bytes;
+            }
+            std::cout << "index replicated on " << nodes.size() << " NUMA nodes, " << bytes / (1 << 20) << " MB each" << std::endl;
+        }
+
+        // Reorders the points inside every block, i.e. every tree node of at most block_size points, by the edges that
+        // stay within the block, so that points fetched together by a hop sit in nearby slots and share pages and cache
+        // lines. A block keeps its id span, so ranges and tree nodes are unchanged; results are still reported in sorted
+        // ids.
+        void ReorderBlocks(int block_size, int threads = 1)
+        {
+            if (mapped_file_ != nullptr)
+                throw Exception("a memory-mapped flat index cannot be reordered");
+            if (!logical_.empty())
+                throw Exception("the index is already reordered");
+            if (block_size < 2)
+                throw Exception("reorder block size should be at least 2");
+
+            std::vector<TreeNode *> blocks;
+            std::vector<TreeNode *> stack(1, tree->root);
+            while (stack.size())
+            {
+                TreeNode *u = stack.back();
+                stack.pop_back();
+                if (u->rbound - u->lbound + 1 <= block_size || u->childs.empty())
+                    blocks.emplace_back(u);
+                else
+                    stack.insert(stack.end(), u->childs.begin(), u->childs.end());
+            }
+
+            logical_.resize(max_elements_);
+            slot_.resize(max_elements_);
+            size_t near_before = 0, near_after = 0, block_pairs = 0;
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads) reduction(+ : near_before, near_after, block_pairs)
+            for (int b = 0; b < blocks.size(); b++)
+            {
+                int l = blocks[b]->lbound, n = blocks[b]->rbound - l + 1;
+                // edges of the block's own and lower layers stay within the block's sub-spans, which the sorted order
+                // already keeps close; only the layers of larger ancestor nodes are ordered for
+                std::vector<std::vector<int>> out(n), in(n), adj(n);
+                for (int i = 0; i < n; i++)
+                {
+                    for (int layer = 0; layer < blocks[b]->depth; layer++)
+                    {
+                        linklistsizeint *list = get_linklist(l + i, layer);
+                        for (int j = 1; j <= getListCount(list); j++)
+                        {
+                            int v = (int)list[j] - l;
+                            if (v >= 0 && v < n && v != i)
+                                out[i].emplace_back(v);
+                        }
+                    }
+                    std::sort(out[i].begin(), out[i].end());
+                    out[i].erase(std::unique(out[i].begin(), out[i].end()), out[i].end());
+                    for (int v : out[i])
+                    {
+                        in[v].emplace_back(i);
+                        adj[i].emplace_back(v);
+                        adj[v].emplace_back(i);
+                    }
+                }
+
+                // Greedy window ordering (as in Gorder): the next point is the one with most edges to, and most shared
+                // in-block in-neighbors with, the last REORDER_WINDOW points placed, since the neighbors of an expanded
+                // point are fetched together. Ties and unrelated points keep the sorted order.
+                std::vector<int> score(n, 0), order;
+                order.reserve(n);
+                std::vector<bool> placed(n, false);
+                std::priority_queue<std::pair<int, int>> heap;
+                auto update = [&](int v, int delta)
+                {
+                    auto bump = [&](int x)
+                    {
+                        if (placed[x])
+                            return;
+                        score[x] += delta;
+                        heap.emplace(score[x], -x);
+                    };
+                    for (int x : adj[v])
+                        bump(x);
+                    for (int u : in[v])
+                    {
+                        for (int x : out[u])
+                            bump(x);
+                    }
+                };
+                int next_sorted = 0;
+                while (order.size() < n)
+                {
+                    int v = -1;
+                    while (heap.size() && v < 0)
+                    {
+                        int x = -heap.top().second;
+                        if (!placed[x] && heap.top().first == score[x] && score[x] > 0)
+                            v = x;
+                        heap.pop();
+                    }
+                    if (v < 0)
+                    {
+                        while (placed[next_sorted])
+                            next_sorted++;
+                        v = next_sorted;
+                    }
+                    placed[v] = true;
+                    order.emplace_back(v);
+                    update(v, 1);
+                    if (order.size() > REORDER_WINDOW)
+                        update(order[order.size() - 1 - REORDER_WINDOW], -1);
+                }
+
+                std::vector<int> position(n);
+                for (int k = 0; k < n; k++)
+                {
+                    logical_[l + k] = l + order[k];
+                    slot_[l + order[k]] = l + k;
+                    position[order[k]] = k;
+                }
+                // pairs fetched together: an edge, or two neighbors on one list
+                auto count_pair = [&](int x, int y)
+                {
+                    block_pairs++;
+                    near_before += std::abs(x - y) <= REORDER_WINDOW;
+                    near_after += std::abs(position[x] - position[y]) <= REORDER_WINDOW;
+                };
+                for (int i = 0; i < n; i++)
+                {
+                    for (size_t j = 0; j < out[i].size(); j++)
+                    {
+                        count_pair(i, out[i][j]);
+                        for (size_t k = j + 1; k < out[i].size(); k++)
+                            count_pair(out[i][j], out[i][k]);
+                    }
+                }
+            }
+
+            size_t bytes = max_elements_ * size_data_per_element_;
+            memory::PageBuffer pages = memory::alloc_pages(bytes, placement_.pages, placement_.numa);
+            if (pages.ptr == nullptr)
+                throw std::runtime_error("Not enough memory");
+#pragma omp parallel for schedule(static) num_threads(threads)
+            for (size_t slot = 0; slot < max_elements_; slot++)
+            {
+                char *row = pages.ptr + slot * size_data_per_element_;
+                std::memcpy(row, data_memory_ + (size_t)logical_[slot] * size_data_per_element_, size_data_per_element_);
+                if (link_storage_ != LinkStorage::DENSE)
+                    continue;
+                for (int layer = 0; layer <= tree->max_depth; layer++)
+                {
+                    linklistsizeint *list = (linklistsizeint *)(row + layer * size_links_per_layer_);
+                    for (int j = 1; j <= getListCount(list); j++)
+                        list[j] = slot_[list[j]];
+                }
+            }
+            memory::free_pages(data_pages_);
+            data_pages_ = pages;
+            data_memory_ = pages.ptr;
+
+            if (link_storage_ == LinkStorage::COMPACT)
+            {
+                for (size_t offset = 0; offset < link_pool_.size(); offset += link_pool_[offset] + 1)
+                {
+                    for (size_t j = 1; j <= link_pool_[offset]; j++)
+                        link_pool_[offset + j] = slot_[link_pool_[offset + j]];
+                }
+                std::vector<size_t> offsets(max_elements_);
+                std::vector<uint16_t> layer_slots(layer_slots_.size());
+                size_t layers = tree->max_depth + 1;
+                for (size_t slot = 0; slot < max_elements_; slot++)
+                {
+                    offsets[slot] = link_offsets_[logical_[slot]];
+                    std::copy(layer_slots_.begin() + logical_[slot] * layers, layer_slots_.begin() + (logical_[slot] + 1) * layers, layer_slots.begin() + slot * layers);
+                }
+                link_offsets_.swap(offsets);
+                layer_slots_.swap(layer_slots);
+            }
+
+            if (!replica_memory_.empty())
+            {
+                replicas_[0] = data_pages_;
+                replica_memory_[0] = data_memory_;
+                for (size_t slot = 1; slot < replicas_.size(); slot++)
+                    std::memcpy(replicas_[slot].ptr, data_memory_, bytes);
+            }
+            for (auto &links : link_replicas_)
+                CopyCompactLinks(links.ptr);
+
+            size_t pairs = std::max<size_t>(1, block_pairs);
+            std::cout << "reordered " << blocks.size() << " blocks of at most " << block_size << " points, in-block pairs fetched together within " << REORDER_WINDOW << " slots: " << 100.0 * near_before / pairs << "% -> " << 100.0 * near_after / pairs << "%" << std::endl;
+        }
+
+        // Replica slot a search thread should pin to with memory::NodePin; -1 when the index is not replicated
+        int ReplicaSlot(int thread) const
+        {
+            return replica_memory_.empty() ? -1 : thread % (int)replica_memory_.size();
+        }
+
+        // data_memory_, or the replica on the node the calling thread is pinned to
+        inline char *LocalMemory() const
+        {
+            return replica_memory_.empty() ? data_memory_ : replica_memory_[memory::current_node()];
         }
 
         inline char *getDataByInternalId(tableint internal_id) const
         {
-            return (data_memory_ + internal_id * size_data_per_element_ + offsetData_);
+            return (LocalMemory() + internal_id * size_data_per_element_ + offsetData_);
+        }
+
+        inline const float *getRawDataByInternalId(tableint internal_id) const
+        {
+            return raw_data_ + (size_t)SortedId(internal_id) * dim_;
+        }
+
+        // Position of an internal id in the attribute order, in which ranges, tree nodes and results are expressed
+        inline int SortedId(tableint internal_id) const
+        {
+            return logical_.empty() ? internal_id : logical_[internal_id];
+        }
+
+        inline tableint InternalId(int sorted_id) const
+        {
+            return slot_.empty() ? sorted_id : slot_[sorted_id];
         }
 
         linklistsizeint *get_linklist(tableint internal_id, int layer) const
         {
-            return (linklistsizeint *)(data_memory_ + internal_id * size_data_per_element_ + layer * size_links_per_layer_);
+            if (link_storage_ == LinkStorage::COMPACT)
+            {
+                size_t slot = (size_t)internal_id * (tree->max_depth + 1) + layer;
+                if (link_replicas_.empty())
+                    return (linklistsizeint *)(link_pool_.data() + link_offsets_[internal_id] + layer_slots_[slot]);
+                const size_t *offsets = (const size_t *)link_replicas_[memory::current_node()].ptr;
+                const tableint *pool = (const tableint *)(offsets + link_offsets_.size());
+                const uint16_t *slots = (const uint16_t *)(pool + link_pool_.size());
+                return (linklistsizeint *)(pool + offsets[internal_id] + slots[slot]);
+            }
+            return (linklistsizeint *)(LocalMemory() + internal_id * size_data_per_element_ + layer * size_links_per_layer_);
         }
 
         int getListCount(linklistsizeint *ptr) const
@@ -115,144 +841,611 @@ namespace iRangeGraph
             return *((int *)ptr);
         }
 
-        int GetOverLap(int l, int r, int ql, int qr)
+        int GetOverLap(int l, int r, int ql, int qr) const
         {
             int L = std::max(l, ql);
             int R = std::min(r, qr);
             return R - L + 1;
         }
 
-        std::vector<tableint> SelectEdge(int pid, int ql, int qr, int edge_limit, searcher::Bitset<uint64_t> &visited_set)
+        // Walks the layers precomputed for the covering node of pid and keeps unvisited neighbors inside the range
+        std::vector<tableint> SelectEdge(SearchContext &ctx, const RangeCover &cover, int pid, int edge_limit, hnswlib::vl_type *visited_array, hnswlib::vl_type visited_array_tag) const
         {
-            TreeNode *cur_node = nullptr, *nxt_node = tree->root;
+            IRG_STATS_PHASE(SELECT_EDGE);
+            int ql = cover.ql, qr = cover.qr;
             std::vector<tableint> selected_edges;
             selected_edges.reserve(edge_limit);
-            do
+            int c = cover.find(SortedId(pid));
+            for (const int *layer = cover.layers_begin(c); layer != cover.layers_end(c); ++layer)
             {
-                cur_node = nxt_node;
-                bool contain = false;
-                do
-                {
-                    contain = false;
-                    if (cur_node->childs.size() == 0)
-                        nxt_node = nullptr;
-                    else
-                    {
-                        for (int i = 0; i < cur_node->childs.size(); ++i)
-                        {
-                            if (cur_node->childs[i]->lbound <= pid && cur_node->childs[i]->rbound >= pid)
-                            {
-                                nxt_node = cur_node->childs[i];
-                                break;
-                            }
-                        }
-                        if (GetOverLap(cur_node->lbound, cur_node->rbound, ql, qr) == GetOverLap(nxt_node->lbound, nxt_node->rbound, ql, qr))
-                        {
-                            cur_node = nxt_node;
-                            contain = true;
-                        }
-                    }
-                } while (contain);
-
-                int *data = (int *)get_linklist(pid, cur_node->depth);
+                int *data = (int *)get_linklist(pid, *layer);
+                ++ctx.metric_layers;
                 size_t size = getListCount((linklistsizeint *)data);
+                IRG_STATS_ADD(NEIGHBORS_SCANNED, size);
 
                 for (size_t j = 1; j <= size; ++j)
                 {
                     int neighborId = *(data + j);
-                    if (neighborId < ql || neighborId > qr)
+                    int sortedId = SortedId(neighborId);
+                    if (sortedId < ql || sortedId > qr)
+                    {
+                        IRG_STATS_ADD(OUT_OF_RANGE, 1);
                         continue;
-                    // if (visitedpool[neighborId] == visited_tag)
-                    //     continue;
-                    if (visited_set.get(neighborId))
+                    }
+                    if (visited_array[neighborId] == visited_array_tag)
+                    {
+                        IRG_STATS_ADD(ALREADY_VISITED, 1);
                         continue;
+                    }
                     selected_edges.emplace_back(neighborId);
                     if (selected_edges.size() == edge_limit)
                         return selected_edges;
                 }
-
-            } while (cur_node->lbound < ql || cur_node->rbound > qr);
+            }
 
             return selected_edges;
         }
 
-        std::priority_queue<PFI> TopDown_nodeentries_search(std::vector<TreeNode *> &filterednodes, const void *query_data, int ef, int query_k, int QL, int QR, int edge_limit)
+        void EnableCoverCache(size_t capacity)
         {
-            // To fix the starting points for different 'ef' parameter, set seed to a fixed number, e.g., seed =0
-            // unsigned seed = 0;
-            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-            std::default_random_engine e(seed);
+            cover_cache.reset(new RangeCoverCache(tree, capacity));
+        }
 
-            std::priority_queue<PFI, std::vector<PFI>, std::greater<PFI>> candidate_set;
+        // Cover of [ql, qr] from cover_cache when enabled, otherwise collected into scratch; hold keeps a cached cover
+        // alive while it is in use
+        const RangeCover &Cover(int ql, int qr, RangeCover &scratch, std::shared_ptr<const RangeCover> &hold) const
+        {
+            if (cover_cache == nullptr)
+            {
+                tree->range_cover(ql, qr, scratch);
+                return scratch;
+            }
+            hold = cover_cache->Get(ql, qr);
+            return *hold;
+        }
+
+        // Re-entrant search: all mutable state lives in ctx, so any number of threads can share one index
+        std::priority_queue<PFI> TopDown_nodeentries_search(SearchContext &ctx, const RangeCover &cover, const void *query_data, int ef, int query_k, int edge_limit) const
+        {
+            IRG_STATS_ADD(QUERIES, 1);
+            IRG_STATS_PERF_SCOPE();
             std::priority_queue<PFI> top_candidates;
-            searcher::Bitset<uint64_t> visited_set(max_elements_);
+            if (cover.qr - cover.ql + 1 <= scan_threshold)
+                top_candidates = ScanRange(ctx, cover.ql, cover.qr, query_data, std::max(ef, query_k));
+            else if (search_engine == SearchEngine::LINEAR_POOL)
+                top_candidates = LinearPoolSearch(ctx, cover, query_data, ef, edge_limit);
+            else
+                top_candidates = HeapSearch(ctx, cover, query_data, ef, edge_limit);
+            FinishSearch(ctx, top_candidates, query_data, query_k);
+            return top_candidates;
+        }
+
+        // Re-ranks codes, keeps the query_k best and translates them to sorted ids
+        void FinishSearch(SearchContext &ctx, std::priority_queue<PFI> &top_candidates, const void *query_data, int query_k) const
+        {
+            if (vector_storage_ == VectorStorage::SQ8 || vector_storage_ == VectorStorage::SQ8_DISK)
+                RerankExact(ctx, top_candidates, query_data);
 
-            for (auto u : filterednodes)
+            while (top_candidates.size() > query_k)
+                top_candidates.pop();
+            if (!logical_.empty())
             {
-                std::uniform_int_distribution<int> u_start(u->lbound, u->rbound);
-                int pid = u_start(e);
-                visited_set.set(pid);
-                char *ep_data = getDataByInternalId(pid);
-                float dis = fstdistfunc_(query_data, ep_data, dist_func_param_);
-                candidate_set.emplace(dis, pid);
-                top_candidates.emplace(dis, pid);
+                std::priority_queue<PFI> sorted_candidates;
+                for (; top_candidates.size(); top_candidates.pop())
+                    sorted_candidates.emplace(top_candidates.top().first, logical_[top_candidates.top().second]);
+                std::swap(top_candidates, sorted_candidates);
             }
+        }
+
+        std::priority_queue<PFI> HeapSearch(SearchContext &ctx, const RangeCover &cover, const void *query_data, int ef, int edge_limit) const
+        {
+            std::priority_queue<PFI, std::vector<PFI>, std::greater<PFI>> candidate_set;
+            std::priority_queue<PFI> top_candidates;
+            ctx.visited->reset();
+            hnswlib::vl_type *visited_array = ctx.visited->mass;
+            hnswlib::vl_type visited_array_tag = ctx.visited->curV;
+
+            SeedCover(ctx, cover, query_data, visited_array, visited_array_tag, [&](float dis, int pid)
+                      {
+                          candidate_set.emplace(dis, pid);
+                          top_candidates.emplace(dis, pid); });
+            while (top_candidates.size() > ef)
+                top_candidates.pop();
 
             float lowerBound = top_candidates.top().first;
+            ctx.dists.resize(edge_limit);
+            float *dists = ctx.dists.data();
+            int stalled = 0;
 
             while (!candidate_set.empty())
             {
                 auto current_point_pair = candidate_set.top();
-                ++metric_hops;
+                ++ctx.metric_hops;
                 if (current_point_pair.first > lowerBound)
                 {
                     break;
                 }
                 candidate_set.pop();
                 int current_pid = current_point_pair.second;
-                auto selected_edges = SelectEdge(current_pid, QL, QR, edge_limit, visited_set);
-                int num_edges = selected_edges.size();
-                for (int i = 0; i < std::min(num_edges, 3); ++i)
+                auto selected_edges = SelectEdge(ctx, cover, current_pid, edge_limit, visited_array, visited_array_tag);
+                int num_edges = MarkVisited(selected_edges, visited_array, visited_array_tag);
+                ComputeDistances(query_data, selected_edges.data(), num_edges, dists);
+                ctx.metric_distance_computations += num_edges;
+                ctx.metric_visited += num_edges;
+                bool improved = false;
                 {
-                    memory::mem_prefetch_L1(getDataByInternalId(selected_edges[i]), this->prefetch_lines);
+                    IRG_STATS_PHASE(QUEUE);
+                    for (int i = 0; i < num_edges; ++i)
+                    {
+                        int neighbor_id = selected_edges[i];
+                        float dis = dists[i];
+
+                        if (top_candidates.size() < ef)
+                        {
+                            candidate_set.emplace(dis, neighbor_id);
+                            top_candidates.emplace(dis, neighbor_id);
+                            lowerBound = top_candidates.top().first;
+                            improved = true;
+                            IRG_STATS_ADD(QUEUE_INSERTS, 1);
+                        }
+                        else if (dis < lowerBound)
+                        {
+                            candidate_set.emplace(dis, neighbor_id);
+                            top_candidates.emplace(dis, neighbor_id);
+                            top_candidates.pop();
+                            lowerBound = top_candidates.top().first;
+                            improved = true;
+                            IRG_STATS_ADD(QUEUE_INSERTS, 1);
+                        }
+                    }
                 }
-                for (int i = 0; i < num_edges; ++i)
-                {
-                    int neighbor_id = selected_edges[i];
+                stalled = improved ? 0 : stalled + 1;
+                if (patience > 0 && stalled >= patience)
+                    break;
+            }
+            return top_candidates;
+        }
 
-                    if (visited_set.get(neighbor_id))
-                        continue;
-                    visited_set.set(neighbor_id);
-                    char *neighbor_data = getDataByInternalId(neighbor_id);
-                    float dis = fstdistfunc_(query_data, neighbor_data, dist_func_param_);
-                    ++metric_distance_computations;
+        // HeapSearch of several queries, walk w over *covers[w] with ef efs[w]. The walks take one expansion each in
+        // turn, and after its expansion a walk prefetches the first list its next candidate will read, which then
+        // arrives while the other walks run instead of stalling the next expansion.
+        std::vector<std::priority_queue<PFI>> InterleavedHeapSearch(SearchContext &ctx, const std::vector<const RangeCover *> &covers, const std::vector<const void *> &queries, const std::vector<int> &efs, int edge_limit) const
+        {
+            struct Walk
+            {
+                const void *query_data;
+                const RangeCover *cover;
+                int ef;
+                hnswlib::VisitedList *visited;
+                std::priority_queue<PFI, std::vector<PFI>, std::greater<PFI>> candidate_set;
+                std::priority_queue<PFI> top_candidates;
+                float lowerBound;
+                int stalled{0};
+                bool done{false};
+            };
+            std::vector<Walk> walks(queries.size());
+            for (size_t w = 0; w < walks.size(); w++)
+            {
+                Walk &walk = walks[w];
+                walk.query_data = queries[w];
+                walk.cover = covers[w];
+                walk.ef = efs[w];
+                walk.visited = visited_list_pool_->getFreeVisitedList();
+                SeedCover(ctx, *walk.cover, walk.query_data, walk.visited->mass, walk.visited->curV, [&](float dis, int pid)
+                          {
+                              walk.candidate_set.emplace(dis, pid);
+                              walk.top_candidates.emplace(dis, pid); });
+                while (walk.top_candidates.size() > walk.ef)
+                    walk.top_candidates.pop();
+                walk.lowerBound = walk.top_candidates.top().first;
+            }
 
-                    if (top_candidates.size() < ef)
+            ctx.dists.resize(edge_limit);
+            float *dists = ctx.dists.data();
+            size_t active = walks.size();
+            while (active > 0)
+            {
+                for (Walk &walk : walks)
+                {
+                    if (walk.done)
+                        continue;
+                    if (walk.candidate_set.empty() || walk.candidate_set.top().first > walk.lowerBound)
                     {
-                        candidate_set.emplace(dis, neighbor_id);
-                        top_candidates.emplace(dis, neighbor_id);
-                        lowerBound = top_candidates.top().first;
+                        // HeapSearch counts the expansion that stops it as a hop
+                        ctx.metric_hops += !walk.candidate_set.empty();
+                        walk.done = true;
+                        active--;
+                        continue;
                     }
-                    else if (dis < lowerBound)
+                    ++ctx.metric_hops;
+                    int current_pid = walk.candidate_set.top().second;
+                    walk.candidate_set.pop();
+                    hnswlib::vl_type *visited_array = walk.visited->mass;
+                    hnswlib::vl_type visited_array_tag = walk.visited->curV;
+                    auto selected_edges = SelectEdge(ctx, *walk.cover, current_pid, edge_limit, visited_array, visited_array_tag);
+                    int num_edges = MarkVisited(selected_edges, visited_array, visited_array_tag);
+                    ComputeDistances(walk.query_data, selected_edges.data(), num_edges, dists);
+                    ctx.metric_distance_computations += num_edges;
+                    ctx.metric_visited += num_edges;
+                    bool improved = false;
                     {
-                        candidate_set.emplace(dis, neighbor_id);
-                        top_candidates.emplace(dis, neighbor_id);
-                        top_candidates.pop();
-                        lowerBound = top_candidates.top().first;
+                        IRG_STATS_PHASE(QUEUE);
+                        for (int i = 0; i < num_edges; ++i)
+                        {
+                            if (walk.top_candidates.size() >= walk.ef && dists[i] >= walk.lowerBound)
+                                continue;
+                            walk.candidate_set.emplace(dists[i], selected_edges[i]);
+                            walk.top_candidates.emplace(dists[i], selected_edges[i]);
+                            if (walk.top_candidates.size() > walk.ef)
+                                walk.top_candidates.pop();
+                            walk.lowerBound = walk.top_candidates.top().first;
+                            improved = true;
+                            IRG_STATS_ADD(QUEUE_INSERTS, 1);
+                        }
+                    }
+                    walk.stalled = improved ? 0 : walk.stalled + 1;
+                    if (patience > 0 && walk.stalled >= patience)
+                    {
+                        walk.done = true;
+                        active--;
+                        continue;
+                    }
+                    if (!walk.candidate_set.empty())
+                    {
+                        int next = walk.candidate_set.top().second;
+                        memory::prefetch_L1(get_linklist(next, *walk.cover->layers_begin(walk.cover->find(SortedId(next)))));
                     }
                 }
             }
-            while (top_candidates.size() > query_k)
-                top_candidates.pop();
+
+            std::vector<std::priority_queue<PFI>> results(walks.size());
+            for (size_t w = 0; w < walks.size(); w++)
+            {
+                visited_list_pool_->releaseVisitedList(walks[w].visited);
+                std::swap(results[w], walks[w].top_candidates);
+            }
+            return results;
+        }
+
+        // Scores the entry points of every covering node, or one random point of a node without entries, and hands each
+        // to seed(distance, id). Precomputed entries start the search near the query's cluster within the node instead
+        // of wherever the random point falls, which saves the first hops of wide ranges.
+        template <typename Seed>
+        void SeedCover(SearchContext &ctx, const RangeCover &cover, const void *query_data, hnswlib::vl_type *visited_array, hnswlib::vl_type visited_array_tag, Seed seed) const
+        {
+            IRG_STATS_PHASE(SEED);
+            size_t seeded = 0;
+            auto visit = [&](int pid)
+            {
+                if (visited_array[pid] == visited_array_tag)
+                    return;
+                visited_array[pid] = visited_array_tag;
+                seed(fstdistfunc_(query_data, getDataByInternalId(pid), dist_func_param_), pid);
+                seeded++;
+            };
+            for (auto u : cover.nodes)
+            {
+                if (use_node_entries && !node_entries_.empty() && node_entries_.begin(u) != node_entries_.end(u))
+                {
+                    for (const int *entry = node_entries_.begin(u); entry != node_entries_.end(u); ++entry)
+                        visit(InternalId(*entry));
+                    continue;
+                }
+                std::uniform_int_distribution<int> u_start(u->lbound, u->rbound);
+                visit(InternalId(u_start(ctx.e)));
+            }
+            ctx.metric_visited += seeded;
+            ctx.metric_distance_computations += seeded;
+        }
+
+        // Same traversal as HeapSearch on a bounded sorted array: inserting into the ef best is a binary search and a
+        // memmove in one cache-resident buffer, and the next candidate to expand is known early enough to prefetch
+        // its links while the current neighbors are scored.
+        std::priority_queue<PFI> LinearPoolSearch(SearchContext &ctx, const RangeCover &cover, const void *query_data, int ef, int edge_limit) const
+        {
+            searcher::LinearPool &pool = ctx.linear_pool;
+            ctx.visited->reset();
+            hnswlib::vl_type *visited_array = ctx.visited->mass;
+            hnswlib::vl_type visited_array_tag = ctx.visited->curV;
+
+            // every covering node contributes an entry point, as in HeapSearch
+            pool.reset(std::max(ef, (int)cover.nodes.size()));
+            SeedCover(ctx, cover, query_data, visited_array, visited_array_tag, [&](float dis, int pid)
+                      { pool.insert(pid, dis); });
+
+            ctx.dists.resize(edge_limit);
+            float *dists = ctx.dists.data();
+            int stalled = 0;
+            while (pool.has_next())
+            {
+                ++ctx.metric_hops;
+                int current_pid = pool.pop();
+                if (pool.has_next())
+                {
+                    int next = pool.next_id();
+                    memory::prefetch_L1(get_linklist(next, *cover.layers_begin(cover.find(SortedId(next)))));
+                }
+                auto selected_edges = SelectEdge(ctx, cover, current_pid, edge_limit, visited_array, visited_array_tag);
+                int num_edges = MarkVisited(selected_edges, visited_array, visited_array_tag);
+                ComputeDistances(query_data, selected_edges.data(), num_edges, dists);
+                ctx.metric_distance_computations += num_edges;
+                ctx.metric_visited += num_edges;
+                bool improved = false;
+                {
+                    IRG_STATS_PHASE(QUEUE);
+                    for (int i = 0; i < num_edges; ++i)
+                        improved |= pool.insert(selected_edges[i], dists[i]);
+                }
+                stalled = improved ? 0 : stalled + 1;
+                if (patience > 0 && stalled >= patience)
+                    break;
+            }
+
+            std::priority_queue<PFI> top_candidates;
+            for (int i = 0; i < pool.get_size(); i++)
+                top_candidates.emplace(pool.dist(i), pool.id(i));
+            return top_candidates;
+        }
+
+        // The points of a range are contiguous in the sorted id space, so a narrow range is read in address order and
+        // scored four at a time; keeps the ef best so that SQ8 codes can still be re-ranked
+        std::priority_queue<PFI> ScanRange(SearchContext &ctx, int ql, int qr, const void *query_data, int ef) const
+        {
+            IRG_STATS_PHASE(DISTANCE);
+            std::priority_queue<PFI> top_candidates;
+            auto offer = [&](float dis, int pid)
+            {
+                if (top_candidates.size() < ef)
+                    top_candidates.emplace(dis, pid);
+                else if (dis < top_candidates.top().first)
+                {
+                    top_candidates.emplace(dis, pid);
+                    top_candidates.pop();
+                }
+            };
+
+            int pid = ql;
+            if (batchdistfunc_ != nullptr)
+            {
+                float dists[4];
+                for (; pid + 3 <= qr; pid += 4)
+                {
+                    const tableint ids[4] = {InternalId(pid), InternalId(pid + 1), InternalId(pid + 2), InternalId(pid + 3)};
+                    const void *vecs[4] = {getDataByInternalId(ids[0]), getDataByInternalId(ids[1]), getDataByInternalId(ids[2]), getDataByInternalId(ids[3])};
+                    batchdistfunc_(query_data, vecs, dist_func_param_, dists);
+                    for (int j = 0; j < 4; j++)
+                        offer(dists[j], ids[j]);
+                }
+            }
+            for (; pid <= qr; pid++)
+                offer(fstdistfunc_(query_data, getDataByInternalId(InternalId(pid)), dist_func_param_), InternalId(pid));
+            ctx.metric_distance_computations += qr - ql + 1;
+            ctx.metric_visited += qr - ql + 1;
             return top_candidates;
         }
 
-        void search(std::vector<int> &SearchEF, std::string saveprefix, int edge_limit)
+        // Marks the selected neighbors visited and compacts away repeats (a point can be a neighbor on several layers);
+        // returns how many distinct ids remain at the front of selected_edges
+        int MarkVisited(std::vector<tableint> &selected_edges, hnswlib::vl_type *visited_array, hnswlib::vl_type visited_array_tag) const
+        {
+            IRG_STATS_PHASE(SELECT_EDGE);
+            int num_edges = 0;
+            for (tableint neighbor_id : selected_edges)
+            {
+                if (visited_array[neighbor_id] == visited_array_tag)
+                    continue;
+                visited_array[neighbor_id] = visited_array_tag;
+                selected_edges[num_edges++] = neighbor_id;
+            }
+            return num_edges;
+        }
+
+        // Scores ids[0, n) against the query into dists. Vectors are prefetched prefetch_ahead ids ahead through the
+        // whole list, and scored four at a time when the space has a batched kernel.
+        void ComputeDistances(const void *query_data, const tableint *ids, int n, float *dists) const
+        {
+            IRG_STATS_PHASE(DISTANCE);
+            int ahead = std::min(n, prefetch_ahead);
+            for (int i = 0; i < ahead; ++i)
+                memory::mem_prefetch_L1(getDataByInternalId(ids[i]), this->prefetch_lines);
+            int prefetched = ahead;
+            int i = 0;
+            if (batchdistfunc_ != nullptr)
+            {
+                for (; i + 4 <= n; i += 4)
+                {
+                    for (; prefetched < std::min(n, i + 4 + prefetch_ahead); ++prefetched)
+                        memory::mem_prefetch_L1(getDataByInternalId(ids[prefetched]), this->prefetch_lines);
+                    const void *vecs[4] = {getDataByInternalId(ids[i]), getDataByInternalId(ids[i + 1]), getDataByInternalId(ids[i + 2]), getDataByInternalId(ids[i + 3])};
+                    batchdistfunc_(query_data, vecs, dist_func_param_, dists + i);
+                }
+            }
+            for (; i < n; ++i)
+            {
+                if (prefetched < n)
+                    memory::mem_prefetch_L1(getDataByInternalId(ids[prefetched++]), this->prefetch_lines);
+                dists[i] = fstdistfunc_(query_data, getDataByInternalId(ids[i]), dist_func_param_);
+            }
+        }
+
+        // Replaces the approximate distances of the final candidates with exact ones on the float32 vectors
+        void RerankExact(SearchContext &ctx, std::priority_queue<PFI> &top_candidates, const void *query_data) const
+        {
+            IRG_STATS_PHASE(RERANK);
+            std::priority_queue<PFI> exact_candidates;
+            if (vector_storage_ == VectorStorage::SQ8_DISK)
+            {
+                // one batch of reads for all candidates; the file is in sorted order
+                std::vector<int> ids;
+                ids.reserve(top_candidates.size());
+                for (; top_candidates.size(); top_candidates.pop())
+                    ids.emplace_back(SortedId(top_candidates.top().second));
+                size_t reads = disk_vectors_.Gather(ids.data(), ids.size(), [&](size_t i, const float *vec)
+                                                    { exact_candidates.emplace(exactdistfunc_(query_data, vec, exact_dist_func_param_), InternalId(ids[i])); });
+                IRG_STATS_ADD(DISK_READS, reads);
+                ctx.metric_disk_reads += reads;
+                ctx.metric_distance_computations += ids.size();
+                std::swap(top_candidates, exact_candidates);
+                return;
+            }
+            while (top_candidates.size())
+            {
+                int pid = top_candidates.top().second;
+                top_candidates.pop();
+                float dis = exactdistfunc_(query_data, getRawDataByInternalId(pid), exact_dist_func_param_);
+                ++ctx.metric_distance_computations;
+                exact_candidates.emplace(dis, pid);
+            }
+            std::swap(top_candidates, exact_candidates);
+        }
+
+        std::priority_queue<PFI> TopDown_nodeentries_search(const void *query_data, int ef, int query_k, int QL, int QR, int edge_limit)
+        {
+            SearchContext ctx(visited_list_pool_.get());
+            RangeCover cover;
+            tree->range_cover(QL, QR, cover);
+            std::priority_queue<PFI> res = TopDown_nodeentries_search(ctx, cover, query_data, ef, query_k, edge_limit);
+            metric_distance_computations += ctx.metric_distance_computations;
+            metric_hops += ctx.metric_hops;
+            return res;
+        }
+
+        // Answers queries[i] over ranges[i] on 'threads' cores. Scheduling is dynamic because the cost of a query
+        // varies by orders of magnitude with its range fraction. With an ef_policy, ef is chosen per query from it.
+        std::vector<std::priority_queue<PFI>> search_batch(const VectorSet &queries, const std::vector<std::pair<int, int>> &ranges, int ef, int query_k, int edge_limit, int threads, const EfPolicy *ef_policy = nullptr)
+        {
+            if (queries.size() != ranges.size())
+                throw Exception("number of query ranges does not match number of queries");
+            if (group_ranges)
+                return search_batch_grouped(queries, ranges, ef, query_k, edge_limit, threads, ef_policy);
+            std::vector<std::priority_queue<PFI>> results(queries.size());
+            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            size_t distance_computations = 0, hops = 0;
+
+#pragma omp parallel num_threads(threads) reduction(+ : distance_computations, hops)
+            {
+                memory::NodePin pin(ReplicaSlot(omp_get_thread_num()));
+                SearchContext ctx(visited_list_pool_.get(), seed + omp_get_thread_num());
+                RangeCover scratch;
+                std::shared_ptr<const RangeCover> hold;
+#pragma omp for schedule(dynamic, 1)
+                for (int i = 0; i < queries.size(); i++)
+                {
+                    const RangeCover &cover = Cover(ranges[i].first, ranges[i].second, scratch, hold);
+                    int query_ef = ef_policy != nullptr ? ef_policy->GetEf(ranges[i].first, ranges[i].second, max_elements_) : ef;
+                    results[i] = TopDown_nodeentries_search(ctx, cover, queries[i], query_ef, query_k, edge_limit);
+                }
+                distance_computations += ctx.metric_distance_computations;
+                hops += ctx.metric_hops;
+            }
+
+            metric_distance_computations += distance_computations;
+            metric_hops += hops;
+            return results;
+        }
+
+        // search_batch with group_ranges: queries whose ranges nest run together. Sorted by (ql, -qr), a range that
+        // does not pass the largest qr seen so far lies inside the range that opened its group, so each group is a
+        // contiguous run of the sorted batch, e.g. the windows of one dashboard ending at the same time. A group is cut
+        // into chunks of at most interleave_width queries, scheduled dynamically so that one wide enclosing range does
+        // not serialize the batch. Heap searches of a chunk walk interleaved over the same part of the graph; repeated
+        // ranges share their cover and ef, and the other engines and range scans answer their queries one by one.
+        std::vector<std::priority_queue<PFI>> search_batch_grouped(const VectorSet &queries, const std::vector<std::pair<int, int>> &ranges, int ef, int query_k, int edge_limit, int threads, const EfPolicy *ef_policy)
+        {
+            std::vector<int> order(queries.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&](int a, int b)
+                      {
+                          if (ranges[a].first != ranges[b].first)
+                              return ranges[a].first < ranges[b].first;
+                          if (ranges[a].second != ranges[b].second)
+                              return ranges[a].second > ranges[b].second;
+                          return a < b; });
+            int width = std::max(1, interleave_width);
+            // chunk c holds order[chunk_begin[c], chunk_begin[c + 1]), all inside the range that opened its group
+            std::vector<int> chunk_begin;
+            int group_qr = 0;
+            for (int k = 0; k < order.size(); k++)
+            {
+                bool opens_group = k == 0 || ranges[order[k]].second > group_qr;
+                if (opens_group)
+                    group_qr = ranges[order[k]].second;
+                if (opens_group || k - chunk_begin.back() == width)
+                    chunk_begin.emplace_back(k);
+            }
+            chunk_begin.emplace_back(order.size());
+
+            std::vector<std::priority_queue<PFI>> results(queries.size());
+            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            size_t distance_computations = 0, hops = 0;
+
+#pragma omp parallel num_threads(threads) reduction(+ : distance_computations, hops)
+            {
+                memory::NodePin pin(ReplicaSlot(omp_get_thread_num()));
+                SearchContext ctx(visited_list_pool_.get(), seed + omp_get_thread_num());
+                std::vector<RangeCover> scratch(width);
+                std::vector<std::shared_ptr<const RangeCover>> hold(width);
+                std::vector<const RangeCover *> walk_covers;
+                std::vector<const void *> walk_queries;
+                std::vector<int> walk_efs, walk_ids;
+#pragma omp for schedule(dynamic, 1)
+                for (int c = 0; c < (int)chunk_begin.size() - 1; c++)
+                {
+                    walk_covers.clear();
+                    walk_queries.clear();
+                    walk_efs.clear();
+                    walk_ids.clear();
+                    const RangeCover *cover = nullptr;
+                    int query_ef = ef;
+                    for (int k = chunk_begin[c]; k < chunk_begin[c + 1]; k++)
+                    {
+                        int qid = order[k];
+                        std::pair<int, int> range = ranges[qid];
+                        if (k == chunk_begin[c] || range != ranges[order[k - 1]])
+                        {
+                            int slot = k - chunk_begin[c];
+                            cover = &Cover(range.first, range.second, scratch[slot], hold[slot]);
+                            query_ef = ef_policy != nullptr ? ef_policy->GetEf(range.first, range.second, max_elements_) : ef;
+                        }
+                        bool interleave = width > 1 && search_engine == SearchEngine::HEAP && range.second - range.first + 1 > scan_threshold;
+                        if (!interleave)
+                        {
+                            results[qid] = TopDown_nodeentries_search(ctx, *cover, queries[qid], query_ef, query_k, edge_limit);
+                            continue;
+                        }
+                        walk_covers.emplace_back(cover);
+                        walk_queries.emplace_back(queries[qid]);
+                        walk_efs.emplace_back(query_ef);
+                        walk_ids.emplace_back(qid);
+                    }
+                    if (walk_ids.size() == 1)
+                        results[walk_ids[0]] = TopDown_nodeentries_search(ctx, *walk_covers[0], walk_queries[0], walk_efs[0], query_k, edge_limit);
+                    if (walk_ids.size() <= 1)
+                        continue;
+                    IRG_STATS_ADD(QUERIES, walk_ids.size());
+                    std::vector<std::priority_queue<PFI>> walked = InterleavedHeapSearch(ctx, walk_covers, walk_queries, walk_efs, edge_limit);
+                    for (size_t w = 0; w < walk_ids.size(); w++)
+                    {
+                        FinishSearch(ctx, walked[w], walk_queries[w], query_k);
+                        std::swap(results[walk_ids[w]], walked[w]);
+                    }
+                }
+                distance_computations += ctx.metric_distance_computations;
+                hops += ctx.metric_hops;
+            }
+
+            metric_distance_computations += distance_computations;
+            metric_hops += hops;
+            return results;
+        }
+
+        void search(std::vector<int> &SearchEF, std::string saveprefix, int edge_limit, int threads = 1)
         {
             for (auto range : storage->query_range)
             {
                 int suffix = range.first;
                 std::vector<std::vector<int>> &gt = storage->groundtruth[suffix];
+                std::vector<std::pair<int, int>> ranges(range.second.begin(), range.second.begin() + storage->query_nb);
                 std::string savepath = saveprefix + std::to_string(suffix) + ".csv";
                 CheckPath(savepath);
                 std::ofstream outfile(savepath);
@@ -268,23 +1461,19 @@ namespace iRangeGraph
                 for (auto ef : SearchEF)
                 {
                     int tp = 0;
-                    float searchtime = 0;
 
                     metric_hops = 0;
                     metric_distance_computations = 0;
 
+                    timeval t1, t2;
+                    gettimeofday(&t1, NULL);
+                    std::vector<std::priority_queue<PFI>> results = search_batch(storage->query_points, ranges, ef, storage->query_K, edge_limit, threads);
+                    gettimeofday(&t2, NULL);
+                    float searchtime = GetTime(t1, t2);
+
                     for (int i = 0; i < storage->query_nb; i++)
                     {
-                        auto rp = range.second[i];
-                        int ql = rp.first, qr = rp.second;
-
-                        timeval t1, t2;
-                        gettimeofday(&t1, NULL);
-                        std::vector<TreeNode *> filterednodes = tree->range_filter(tree->root, ql, qr);
-                        std::priority_queue<PFI> res = TopDown_nodeentries_search(filterednodes, storage->query_points[i].data(), ef, storage->query_K, ql, qr, edge_limit);
-                        gettimeofday(&t2, NULL);
-                        auto duration = GetTime(t1, t2);
-                        searchtime += duration;
+                        std::priority_queue<PFI> &res = results[i];
                         std::map<int, int> record;
                         while (res.size())
                         {
@@ -8,6 +8,79 @@ namespace iRangeGraph_multi
     typedef std::pair<float, int> PFI;
     typedef std::pair<float, std::pair<int, int>> PFII;
 
+    // Runs every query of every domain of storage at each ef and writes one "ef,recall,qps,dco,hop" line per ef to
+    // saveprefix + domain + ".csv". answer(ctx, cover, qid, ef, attr_constraints) returns the results of query qid.
+    template <typename Answer>
+    void SearchAndSave(DataLoader *storage, hnswlib::VisitedListPool *visited_pool, std::vector<int> &SearchEF, std::string saveprefix, Answer answer)
+    {
+        for (auto range : storage->query_range)
+        {
+            std::string domain = range.first;
+            std::vector<std::vector<int>> &gt = storage->ground_truth[domain];
+            std::string savepath = saveprefix + domain + ".csv";
+            CheckPath(savepath);
+
+            std::ofstream outfile(savepath);
+            if (!outfile.is_open())
+            {
+                throw Exception("cannot open " + savepath);
+            }
+
+            std::vector<int> HOP;
+            std::vector<int> DCO;
+            std::vector<float> QPS;
+            std::vector<float> RECALL;
+
+            for (auto ef : SearchEF)
+            {
+                int tp = 0;
+                float searchtime = 0;
+
+                iRangeGraph::SearchContext ctx(visited_pool);
+                iRangeGraph::RangeCover cover;
+
+                for (int i = 0; i < storage->query_nb; i++)
+                {
+                    auto cons = range.second[i];
+
+                    timeval t1, t2;
+                    gettimeofday(&t1, NULL);
+                    auto res = answer(ctx, cover, i, ef, cons.attr_constraints);
+                    gettimeofday(&t2, NULL);
+                    searchtime += GetTime(t1, t2);
+
+                    std::map<int, int> record;
+                    while (res.size())
+                    {
+                        auto x = res.top().second;
+                        res.pop();
+                        if (record.count(x))
+                            throw Exception("repetitive search results");
+                        record[x] = 1;
+                        if (std::find(gt[i].begin(), gt[i].end(), x) != gt[i].end())
+                            tp++;
+                    }
+                }
+
+                float recall = 1.0 * tp / storage->query_nb / storage->query_K;
+                float qps = storage->query_nb / searchtime;
+                float dco = ctx.metric_distance_computations * 1.0 / storage->query_nb;
+                float hop = ctx.metric_hops * 1.0 / storage->query_nb;
+
+                HOP.emplace_back(hop);
+                DCO.emplace_back(dco);
+                QPS.emplace_back(qps);
+                RECALL.emplace_back(recall);
+            }
+
+            for (int i = 0; i < RECALL.size(); i++)
+            {
+                outfile << SearchEF[i] << "," << RECALL[i] << "," << QPS[i] << "," << DCO[i] << "," << HOP[i] << std::endl;
+            }
+            outfile.close();
+        }
+    }
+
     template <typename dist_t>
     class iRangeGraph_Search_Multi
     {
@@ -29,36 +102,56 @@ namespace iRangeGraph_multi
         size_t offsetData_{0};
 
         char *data_memory_{nullptr};
+        memory::PageBuffer data_pages_;
 
-        hnswlib::L2Space *space;
+        hnswlib::SpaceInterface<float> *space;
         hnswlib::DISTFUNC<dist_t> fstdistfunc_;
         void *dist_func_param_{nullptr};
 
         size_t metric_distance_computations{0};
         size_t metric_hops{0};
 
-        std::vector<int> visitedpool;
-        size_t visited_tag{0};
+        std::unique_ptr<hnswlib::VisitedListPool> visited_list_pool_{nullptr};
 
         // purepost = True -> p=1   purepost =  False -> 0<=p<=1
         bool purepost{true};
 
-        iRangeGraph_Search_Multi(std::string edgefilename, DataLoader *store, int M) : storage(store)
+        // First-attribute ranges of at most this many points are answered by an exact scan; 0 disables
+        int scan_threshold{0};
+
+        // Attributes CheckInQueryRange has to test. The sorted attribute is left out: every pid in [ql, qr] satisfies it.
+        std::vector<int> filter_attrs_;
+        // Row pid holds the filter_attrs_ values of sorted point pid, so a check is one contiguous load
+        std::vector<int> attr_values_;
+        // The sort the index was loaded with, kept here because storage may be re-sorted by another attribute:
+        // sorted point pid is point original_id_[pid] and has sorted_values_[pid] as its sorted_attr_ value
+        int sorted_attr_{-1};
+        std::vector<int> original_id_;
+        std::vector<int> sorted_values_;
+
+        // placement chooses the pages and NUMA interleaving of data_memory_; per-node replicas need the threaded search
+        // of iRangeGraph_Search and are not supported here
+        iRangeGraph_Search_Multi(std::string edgefilename, DataLoader *store, int M, memory::Placement placement = memory::Placement()) : storage(store)
         {
+            if (placement.numa == memory::NumaPolicy::REPLICATE)
+                throw Exception("the multi-attribute searcher does not replicate its index per NUMA node");
             std::ifstream edgefile(edgefilename, std::ios::in | std::ios::binary);
             if (!edgefile.is_open())
                 throw Exception("cannot open " + edgefilename);
 
             max_elements_ = storage->data_nb;
             dim_ = storage->Dim;
-            tree = new iRangeGraph::SegmentTree(max_elements_);
+            iRangeGraph::IndexFileHeader index_header = iRangeGraph::ReadIndexHeader(edgefile, storage->metric, edgefilename);
+            if (index_header.data_nb != 0 && index_header.data_nb != max_elements_)
+                throw Exception(edgefilename + " indexes " + std::to_string(index_header.data_nb) + " points but " + std::to_string(max_elements_) + " were loaded");
+            tree = new iRangeGraph::SegmentTree(max_elements_, (iRangeGraph::TreeLayout)index_header.tree_layout);
             tree->BuildTree(tree->root);
 
-            space = new hnswlib::L2Space(dim_);
+            space = iRangeGraph::CreateSpace(storage->metric, dim_);
             fstdistfunc_ = space->get_dist_func();
             dist_func_param_ = space->get_dist_func_param();
             M_out = M;
-            visitedpool.resize(max_elements_);
+            visited_list_pool_ = std::unique_ptr<hnswlib::VisitedListPool>(new hnswlib::VisitedListPool(1, max_elements_));
 
             data_size_ = dim_ * sizeof(float);
             size_links_per_layer_ = M_out * sizeof(tableint) + sizeof(linklistsizeint);
@@ -66,7 +159,8 @@ namespace iRangeGraph_multi
             size_data_per_element_ = size_links_per_element_ + data_size_;
             offsetData_ = size_links_per_element_;
 
-            data_memory_ = (char *)malloc(max_elements_ * size_data_per_element_);
+            data_pages_ = memory::alloc_pages(max_elements_ * size_data_per_element_, placement.pages, placement.numa);
+            data_memory_ = data_pages_.ptr;
             if (data_memory_ == nullptr)
                 throw std::runtime_error("Not enough memory");
 
@@ -88,14 +182,57 @@ namespace iRangeGraph_multi
 
                 size_t size_in_bytes = dim_ * sizeof(float);
                 char *data = getDataByInternalId(pid);
-                std::memcpy(data, reinterpret_cast<char *>(storage->data_points[pid].data()), size_in_bytes);
+                std::memcpy(data, reinterpret_cast<const char *>(storage->data_points[pid]), size_in_bytes);
             }
             edgefile.close();
+            PackAttributes();
+        }
+
+        void PackAttributes()
+        {
+            if (storage->original_id.size() != max_elements_)
+                throw Exception("data points should be sorted by an attribute before loading the index");
+            sorted_attr_ = storage->sorted_attr;
+            original_id_ = storage->original_id;
+            filter_attrs_.clear();
+            for (int i = 0; i < storage->attr_nb; i++)
+            {
+                if (i != sorted_attr_)
+                    filter_attrs_.push_back(i);
+            }
+            size_t row = filter_attrs_.size();
+            attr_values_.resize(max_elements_ * row);
+            sorted_values_.resize(max_elements_);
+            for (size_t pid = 0; pid < max_elements_; pid++)
+            {
+                const std::vector<int> &values = storage->attributes[original_id_[pid]];
+                for (size_t i = 0; i < row; i++)
+                    attr_values_[pid * row + i] = values[filter_attrs_[i]];
+                sorted_values_[pid] = values[sorted_attr_];
+            }
+        }
+
+        // Sorted ids whose sorted_attr_ value lies in bound; empty when first > second
+        std::pair<int, int> MapRange(const std::pair<int, int> &bound) const
+        {
+            int ql = std::lower_bound(sorted_values_.begin(), sorted_values_.end(), bound.first) - sorted_values_.begin();
+            int qr = std::upper_bound(sorted_values_.begin(), sorted_values_.end(), bound.second) - sorted_values_.begin() - 1;
+            return {ql, qr};
+        }
+
+        // Maps the sorted attribute constraint of queryrange to its id range and searches it
+        std::priority_queue<PFI> Query(iRangeGraph::SearchContext &ctx, iRangeGraph::RangeCover &cover, const void *query_data, int ef, int query_k, int edge_limit, const std::vector<std::pair<int, int>> &queryrange) const
+        {
+            std::pair<int, int> range = MapRange(queryrange[sorted_attr_]);
+            if (range.first > range.second)
+                return std::priority_queue<PFI>();
+            tree->range_cover(range.first, range.second, cover);
+            return TopDown_search(ctx, query_data, ef, query_k, edge_limit, queryrange, cover);
         }
 
         ~iRangeGraph_Search_Multi()
         {
-            free(data_memory_);
+            memory::free_pages(data_pages_);
             data_memory_ = nullptr;
         }
 
@@ -109,13 +246,14 @@ namespace iRangeGraph_multi
             }
         }
 
-        int ProbFunc(int x)
+        int ProbFunc(int x, std::default_random_engine &e) const
         {
             if (purepost)
                 return 1;
             if (x >= MaxStep)
                 return 0;
-            double randNum = (double)rand() / RAND_MAX;
+            std::uniform_real_distribution<double> u_prob(0, 1);
+            double randNum = u_prob(e);
             return randNum < probability[x] ? 1 : 0;
         }
 
@@ -134,69 +272,58 @@ namespace iRangeGraph_multi
             return *((int *)ptr);
         }
 
-        int GetOverLap(int l, int r, int ql, int qr)
+        int GetOverLap(int l, int r, int ql, int qr) const
         {
             int L = std::max(l, ql);
             int R = std::min(r, qr);
             return R - L + 1;
         }
 
-        inline bool CheckInQueryRange(int pid, std::vector<std::pair<int, int>> &queryrange)
+        inline float Distance(const void *query_data, tableint pid) const
         {
-            int originalId = storage->original_id[pid];
-            for (int i = 0; i < storage->attr_nb; i++)
+            IRG_STATS_PHASE(DISTANCE);
+            return fstdistfunc_(query_data, getDataByInternalId(pid), dist_func_param_);
+        }
+
+        inline bool CheckInQueryRange(int pid, const std::vector<std::pair<int, int>> &queryrange) const
+        {
+            size_t row = filter_attrs_.size();
+            const int *values = attr_values_.data() + pid * row;
+            for (size_t i = 0; i < row; i++)
             {
-                int val = storage->attributes[originalId][i];
-                if (val < queryrange[i].first || val > queryrange[i].second)
+                const std::pair<int, int> &bound = queryrange[filter_attrs_[i]];
+                if (values[i] < bound.first || values[i] > bound.second)
                     return false;
             }
             return true;
         }
 
-        std::vector<std::pair<tableint, bool>> SelectEdge(int pid, int ql, int qr, int edge_limit, std::vector<std::pair<int, int>> &queryrange, int current_step)
+        std::vector<std::pair<tableint, bool>> SelectEdge(iRangeGraph::SearchContext &ctx, const iRangeGraph::RangeCover &cover, int pid, int edge_limit, const std::vector<std::pair<int, int>> &queryrange, int current_step) const
         {
-            iRangeGraph::TreeNode *cur_node = nullptr, *nxt_node = tree->root;
+            IRG_STATS_PHASE(SELECT_EDGE);
+            int ql = cover.ql, qr = cover.qr;
             std::vector<std::pair<tableint, bool>> selected_edges;
-            do
+            int c = cover.find(pid);
+            for (const int *layer = cover.layers_begin(c); layer != cover.layers_end(c); ++layer)
             {
-                cur_node = nxt_node;
-                bool contain = false;
-                do
-                {
-                    contain = false;
-                    if (cur_node->childs.size() == 0)
-                        nxt_node = nullptr;
-                    else
-                    {
-                        for (int i = 0; i < cur_node->childs.size(); i++)
-                        {
-                            if (cur_node->childs[i]->lbound <= pid && cur_node->childs[i]->rbound >= pid)
-                            {
-                                nxt_node = cur_node->childs[i];
-                                break;
-                            }
-                        }
-                        if (GetOverLap(cur_node->lbound, cur_node->rbound, ql, qr) == GetOverLap(nxt_node->lbound, nxt_node->rbound, ql, qr))
-                        {
-                            cur_node = nxt_node;
-                            contain = true;
-                        }
-                    }
-                } while (contain);
-
-                int *data = (int *)get_linklist(pid, cur_node->depth);
+                ++ctx.metric_layers;
+                int *data = (int *)get_linklist(pid, *layer);
                 size_t size = getListCount((linklistsizeint *)data);
+                IRG_STATS_ADD(NEIGHBORS_SCANNED, size);
 
                 for (size_t j = 1; j <= size; j++)
                 {
                     int neighborId = *(data + j);
                     if (neighborId < ql || neighborId > qr)
+                    {
+                        IRG_STATS_ADD(OUT_OF_RANGE, 1);
                         continue;
+                    }
                     int prob = 1;
                     int next_step = current_step + 1;
                     bool inrange = CheckInQueryRange(neighborId, queryrange);
                     if (!inrange)
-                        prob = ProbFunc(next_step);
+                        prob = ProbFunc(next_step, ctx.e);
                     if (!prob)
                         continue;
 
@@ -204,38 +331,72 @@ namespace iRangeGraph_multi
                     if (selected_edges.size() == edge_limit)
                         return selected_edges;
                 }
-
-            } while (cur_node->lbound < ql || cur_node->rbound > qr);
+            }
             return selected_edges;
         }
 
-        std::priority_queue<PFI> TopDown_search(const void *query_data, int ef, int query_k, int QL, int QR, int edge_limit, std::vector<std::pair<int, int>> queryrange, std::vector<iRangeGraph::TreeNode *> &filterednodes)
+        // Exact answer for a narrow first-attribute range: scans [ql, qr] in address order and scores only the points
+        // that also satisfy the other attribute constraints
+        std::priority_queue<PFI> ScanRange(iRangeGraph::SearchContext &ctx, const void *query_data, int query_k, int ql, int qr, const std::vector<std::pair<int, int>> &queryrange) const
         {
-            visited_tag++;
-            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-            std::default_random_engine e(seed);
+            IRG_STATS_PHASE(DISTANCE);
+            std::priority_queue<PFI> top_candidates;
+            for (int pid = ql; pid <= qr; pid++)
+            {
+                if (!CheckInQueryRange(pid, queryrange))
+                    continue;
+                float dis = fstdistfunc_(query_data, getDataByInternalId(pid), dist_func_param_);
+                ctx.metric_distance_computations++;
+                ctx.metric_visited++;
+                if (top_candidates.size() < query_k)
+                    top_candidates.emplace(dis, original_id_[pid]);
+                else if (dis < top_candidates.top().first)
+                {
+                    top_candidates.emplace(dis, original_id_[pid]);
+                    top_candidates.pop();
+                }
+            }
+            return top_candidates;
+        }
+
+        // Re-entrant search: all mutable state lives in ctx, so any number of threads can share one index
+        std::priority_queue<PFI> TopDown_search(iRangeGraph::SearchContext &ctx, const void *query_data, int ef, int query_k, int edge_limit, const std::vector<std::pair<int, int>> &queryrange, const iRangeGraph::RangeCover &cover) const
+        {
+            IRG_STATS_ADD(QUERIES, 1);
+            IRG_STATS_PERF_SCOPE();
+            if (cover.qr - cover.ql + 1 <= scan_threshold)
+                return ScanRange(ctx, query_data, query_k, cover.ql, cover.qr, queryrange);
+
+            std::default_random_engine &e = ctx.e;
+            ctx.visited->reset();
+            hnswlib::vl_type *visited_array = ctx.visited->mass;
+            hnswlib::vl_type visited_array_tag = ctx.visited->curV;
 
             std::priority_queue<PFII, std::vector<PFII>, std::greater<PFII>> candidate_set;
             std::priority_queue<PFI> top_candidates;
 
-            for (auto u : filterednodes)
             {
-                std::uniform_int_distribution<int> u_start(u->lbound, u->rbound);
-                int pid = u_start(e);
-                visitedpool[pid] = visited_tag;
-                char *ep_data = getDataByInternalId(pid);
-                float dis = fstdistfunc_(query_data, ep_data, dist_func_param_);
-                candidate_set.emplace(std::make_pair(dis, std::make_pair(pid, -1)));
-                if (CheckInQueryRange(pid, queryrange))
-                    top_candidates.emplace(dis, storage->original_id[pid]);
+                IRG_STATS_PHASE(SEED);
+                for (auto u : cover.nodes)
+                {
+                    std::uniform_int_distribution<int> u_start(u->lbound, u->rbound);
+                    int pid = u_start(e);
+                    visited_array[pid] = visited_array_tag;
+                    char *ep_data = getDataByInternalId(pid);
+                    float dis = fstdistfunc_(query_data, ep_data, dist_func_param_);
+                    candidate_set.emplace(std::make_pair(dis, std::make_pair(pid, -1)));
+                    if (CheckInQueryRange(pid, queryrange))
+                        top_candidates.emplace(dis, original_id_[pid]);
+                }
             }
+            ctx.metric_visited += cover.nodes.size();
 
             float lowerBound = std::numeric_limits<float>::max();
 
             while (!candidate_set.empty())
             {
                 auto current_point_pair = candidate_set.top();
-                metric_hops++;
+                ctx.metric_hops++;
                 if (current_point_pair.first > lowerBound)
                 {
                     break;
@@ -243,7 +404,7 @@ namespace iRangeGraph_multi
                 candidate_set.pop();
                 int current_pid = current_point_pair.second.first;
                 int current_step = current_point_pair.second.second;
-                auto selected_edges = SelectEdge(current_pid, QL, QR, edge_limit, queryrange, current_step);
+                auto selected_edges = SelectEdge(ctx, cover, current_pid, edge_limit, queryrange, current_step);
 
                 while (selected_edges.size())
                 {
@@ -252,19 +413,24 @@ namespace iRangeGraph_multi
                     int neighbor_id = neighbor_pair.first;
                     bool inrange = neighbor_pair.second;
 
-                    if (visitedpool[neighbor_id] == visited_tag)
+                    if (visited_array[neighbor_id] == visited_array_tag)
+                    {
+                        IRG_STATS_ADD(ALREADY_VISITED, 1);
                         continue;
-                    visitedpool[neighbor_id] = visited_tag;
-                    char *neighbor_data = getDataByInternalId(neighbor_id);
-                    float dis = fstdistfunc_(query_data, neighbor_data, dist_func_param_);
-                    metric_distance_computations++;
+                    }
+                    visited_array[neighbor_id] = visited_array_tag;
+                    float dis = Distance(query_data, neighbor_id);
+                    ctx.metric_distance_computations++;
+                    ctx.metric_visited++;
 
                     if (top_candidates.size() < ef || dis < lowerBound)
                     {
+                        IRG_STATS_PHASE(QUEUE);
+                        IRG_STATS_ADD(QUEUE_INSERTS, 1);
                         int next_step = current_step + 1;
                         if (inrange)
                         {
-                            top_candidates.emplace(dis, storage->original_id[neighbor_id]);
+                            top_candidates.emplace(dis, original_id_[neighbor_id]);
                             next_step = -1;
                         }
                         candidate_set.emplace(std::make_pair(dis, std::make_pair(neighbor_id, next_step)));
@@ -282,77 +448,91 @@ namespace iRangeGraph_multi
             return top_candidates;
         }
 
-        void search(std::vector<int> &SearchEF, std::string saveprefix, int edge_limit = 32)
+        std::priority_queue<PFI> TopDown_search(const void *query_data, int ef, int query_k, int QL, int QR, int edge_limit, std::vector<std::pair<int, int>> queryrange)
         {
-            for (auto range : storage->query_range)
-            {
-                std::string domain = range.first;
-                std::vector<std::vector<int>> &gt = storage->ground_truth[domain];
-                std::string savepath = saveprefix + domain + ".csv";
-                CheckPath(savepath);
-
-                std::ofstream outfile(savepath);
-                if (!outfile.is_open())
-                {
-                    throw Exception("cannot open " + savepath);
-                }
-
-                std::vector<int> HOP;
-                std::vector<int> DCO;
-                std::vector<float> QPS;
-                std::vector<float> RECALL;
+            iRangeGraph::SearchContext ctx(visited_list_pool_.get());
+            iRangeGraph::RangeCover cover;
+            tree->range_cover(QL, QR, cover);
+            std::priority_queue<PFI> res = TopDown_search(ctx, query_data, ef, query_k, edge_limit, queryrange, cover);
+            metric_distance_computations += ctx.metric_distance_computations;
+            metric_hops += ctx.metric_hops;
+            return res;
+        }
 
-                for (auto ef : SearchEF)
-                {
-                    int tp = 0;
-                    float searchtime = 0;
+        void search(std::vector<int> &SearchEF, std::string saveprefix, int edge_limit = 32)
+        {
+            SearchAndSave(storage, visited_list_pool_.get(), SearchEF, saveprefix, [&](iRangeGraph::SearchContext &ctx, iRangeGraph::RangeCover &cover, int qid, int ef, const std::vector<std::pair<int, int>> &queryrange)
+                          { return Query(ctx, cover, storage->query_points[qid], ef, storage->query_K, edge_limit, queryrange); });
+        }
+    };
 
-                    metric_hops = 0;
-                    metric_distance_computations = 0;
+    // One iRangeGraph_Search_Multi per attribute, each over the points sorted by that attribute (see buildindex_multi).
+    // A query is routed to the index whose attribute constraint holds the fewest points, so the traversal stays inside
+    // the most selective range and the remaining constraints filter a larger share of in-range points. Every index
+    // keeps its own copy of the vectors.
+    template <typename dist_t>
+    class iRangeGraph_Search_MultiTree
+    {
+    public:
+        DataLoader *storage;
+        std::vector<std::unique_ptr<iRangeGraph_Search_Multi<dist_t>>> indexes;
+        // Queries answered by each index over all search calls
+        std::vector<size_t> routed;
 
-                    for (int i = 0; i < storage->query_nb; i++)
-                    {
-                        auto cons = range.second[i];
-                        int ql = storage->mapped_queryrange[domain][i].first;
-                        int qr = storage->mapped_queryrange[domain][i].second;
-
-                        timeval t1, t2;
-                        gettimeofday(&t1, NULL);
-                        auto filterednodes = tree->range_filter(tree->root, ql, qr);
-                        auto res = TopDown_search(storage->query_points[i].data(), ef, storage->query_K, ql, qr, edge_limit, cons.attr_constraints, filterednodes);
-                        gettimeofday(&t2, NULL);
-                        searchtime += GetTime(t1, t2);
-
-                        std::map<int, int> record;
-                        while (res.size())
-                        {
-                            auto x = res.top().second;
-                            res.pop();
-                            if (record.count(x))
-                                throw Exception("repetitive search results");
-                            record[x] = 1;
-                            if (std::find(gt[i].begin(), gt[i].end(), x) != gt[i].end())
-                                tp++;
-                        }
-                    }
+        // Sorts storage by every attribute in turn and loads MultiIndexPath(index_prefix, aid) for it
+        iRangeGraph_Search_MultiTree(std::string index_prefix, DataLoader *store, int M, memory::Placement placement = memory::Placement()) : storage(store)
+        {
+            for (int aid = 0; aid < storage->attr_nb; aid++)
+            {
+                storage->Sort_by_Attr(aid);
+                indexes.emplace_back(new iRangeGraph_Search_Multi<dist_t>(MultiIndexPath(index_prefix, aid), storage, M, placement));
+            }
+            routed.assign(indexes.size(), 0);
+        }
 
-                    float recall = 1.0 * tp / storage->query_nb / storage->query_K;
-                    float qps = storage->query_nb / searchtime;
-                    float dco = metric_distance_computations * 1.0 / storage->query_nb;
-                    float hop = metric_hops * 1.0 / storage->query_nb;
+        void setprob()
+        {
+            for (auto &index : indexes)
+                index->setprob();
+        }
 
-                    HOP.emplace_back(hop);
-                    DCO.emplace_back(dco);
-                    QPS.emplace_back(qps);
-                    RECALL.emplace_back(recall);
-                }
+        void set_scan_threshold(int scan_threshold)
+        {
+            for (auto &index : indexes)
+                index->scan_threshold = scan_threshold;
+        }
 
-                for (int i = 0; i < RECALL.size(); i++)
+        // Index whose attribute constraint of queryrange covers the fewest points
+        int Route(const std::vector<std::pair<int, int>> &queryrange) const
+        {
+            int best = 0;
+            int best_size = std::numeric_limits<int>::max();
+            for (int aid = 0; aid < indexes.size(); aid++)
+            {
+                std::pair<int, int> range = indexes[aid]->MapRange(queryrange[aid]);
+                int size = range.second - range.first + 1;
+                if (size < best_size)
                 {
-                    outfile << SearchEF[i] << "," << RECALL[i] << "," << QPS[i] << "," << DCO[i] << "," << HOP[i] << std::endl;
+                    best = aid;
+                    best_size = size;
                 }
-                outfile.close();
             }
+            return best;
+        }
+
+        std::priority_queue<PFI> Query(iRangeGraph::SearchContext &ctx, iRangeGraph::RangeCover &cover, const void *query_data, int ef, int query_k, int edge_limit, const std::vector<std::pair<int, int>> &queryrange)
+        {
+            int aid = Route(queryrange);
+            routed[aid]++;
+            return indexes[aid]->Query(ctx, cover, query_data, ef, query_k, edge_limit, queryrange);
+        }
+
+        void search(std::vector<int> &SearchEF, std::string saveprefix, int edge_limit = 32)
+        {
+            SearchAndSave(storage, indexes[0]->visited_list_pool_.get(), SearchEF, saveprefix, [&](iRangeGraph::SearchContext &ctx, iRangeGraph::RangeCover &cover, int qid, int ef, const std::vector<std::pair<int, int>> &queryrange)
+                          { return Query(ctx, cover, storage->query_points[qid], ef, storage->query_K, edge_limit, queryrange); });
+            for (int aid = 0; aid < routed.size(); aid++)
+                std::cout << "queries routed to attribute " << aid << ": " << routed[aid] << std::endl;
         }
     };
 }
\ No newline at end of file
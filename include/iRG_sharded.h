@@ -0,0 +1,279 @@
+#pragma once
+
+#include "construction.h"
+#include "iRG_search.h"
+
+namespace iRangeGraph
+{
+    // Range sharding: the sorted ids are cut into contiguous shards, each an ordinary index over its own slice of the
+    // data, so a query only involves the shards its range overlaps. The manifest prefix + "manifest.txt" lists the
+    // shard boundaries; shard s keeps its vectors in prefix + "shard<s>.bin" and its index in prefix + "shard<s>.index".
+    class ShardManifest
+    {
+    public:
+        std::string prefix;
+        Metric metric{Metric::L2};
+        // shard s holds the global ids [bounds[s], bounds[s + 1])
+        std::vector<int> bounds{0};
+
+        int shards() const { return bounds.size() - 1; }
+        std::string ManifestPath() const { return prefix + "manifest.txt"; }
+        std::string DataPath(int s) const { return prefix + "shard" + std::to_string(s) + ".bin"; }
+        std::string IndexPath(int s) const { return prefix + "shard" + std::to_string(s) + ".index"; }
+
+        // Cuts data_nb points into num_shards slices whose sizes differ by at most one
+        void Split(int data_nb, int num_shards)
+        {
+            if (num_shards <= 0 || num_shards > data_nb)
+                throw Exception("number of shards should be between 1 and the number of points");
+            bounds.assign(1, 0);
+            for (int s = 1; s <= num_shards; s++)
+                bounds.emplace_back((long long)data_nb * s / num_shards);
+        }
+
+        // Shards overlapping [ql, qr], as a half-open interval of shard numbers
+        std::pair<int, int> Overlapping(int ql, int qr) const
+        {
+            int first = std::upper_bound(bounds.begin(), bounds.end(), ql) - bounds.begin() - 1;
+            int last = std::upper_bound(bounds.begin(), bounds.end(), qr) - bounds.begin() - 1;
+            return std::make_pair(std::max(first, 0), std::min(last, shards() - 1) + 1);
+        }
+
+        void Save() const
+        {
+            CheckPath(ManifestPath());
+            std::ofstream outfile(ManifestPath());
+            if (!outfile.is_open())
+                throw Exception("cannot open " + ManifestPath());
+            outfile << shards() << " " << MetricName(metric) << std::endl;
+            for (int s = 0; s < shards(); s++)
+                outfile << bounds[s] << " " << bounds[s + 1] << std::endl;
+        }
+
+        void Load(std::string manifestprefix)
+        {
+            prefix = manifestprefix;
+            std::ifstream infile(ManifestPath());
+            if (!infile.is_open())
+                throw Exception("cannot open " + ManifestPath());
+            int num_shards;
+            std::string metricname;
+            if (!(infile >> num_shards >> metricname) || num_shards <= 0)
+                throw Exception(ManifestPath() + " is not a shard manifest");
+            metric = ParseMetric(metricname);
+            bounds.assign(1, 0);
+            for (int s = 0; s < num_shards; s++)
+            {
+                int begin, end;
+                if (!(infile >> begin >> end) || begin != bounds.back() || end <= begin)
+                    throw Exception(ManifestPath() + " has a malformed shard " + std::to_string(s));
+                bounds.emplace_back(end);
+            }
+        }
+    };
+
+    // Builds shard s of manifest over the vector file datafilename: writes the slice as the shard's vector file and
+    // indexes it. Only the slice is read, so every host can build the shards it serves.
+    inline void BuildShard(const ShardManifest &manifest, int s, std::string datafilename, int M, int ef_construction, int threads, TreeLayout tree_layout = TreeLayout::BALANCED)
+    {
+        DataLoader storage;
+        storage.metric = manifest.metric;
+        storage.LoadData(datafilename, manifest.bounds[s], manifest.bounds[s + 1] - manifest.bounds[s]);
+        if (storage.data_nb != manifest.bounds[s + 1] - manifest.bounds[s])
+            throw Exception(datafilename + " holds fewer points than the manifest");
+
+        std::string datapath = manifest.DataPath(s);
+        CheckPath(datapath);
+        BufferedWriter datafile(datapath);
+        datafile.write(&storage.data_nb, sizeof(int));
+        datafile.write(&storage.Dim, sizeof(int));
+        datafile.write(storage.data_points.data(), (size_t)storage.data_nb * storage.Dim * sizeof(float));
+        datafile.close();
+
+        std::cout << "building shard " << s << ": ids [" << manifest.bounds[s] << ", " << manifest.bounds[s + 1] << ")" << std::endl;
+        iRangeGraph_Build<float> index(&storage, M, ef_construction, tree_layout);
+        index.max_threads = threads;
+        index.buildandsave(manifest.IndexPath(s));
+    }
+
+    // Coordinator over the shards of a manifest. A query is sent only to the shards overlapping [QL, QR], each shard
+    // runs TopDown_nodeentries_search on its local range, and the partial top-k lists are merged. All shard searchers
+    // live in this process here; each stands in for the searcher of one host, and SearchShard is the call a remote
+    // shard would serve.
+    class iRangeGraph_Sharded_Search
+    {
+    public:
+        struct Shard
+        {
+            int begin, end;
+            DataLoader storage;
+            std::unique_ptr<iRangeGraph_Search<float>> index;
+        };
+
+        // queries, query ranges and groundtruth, in global ids
+        DataLoader *storage;
+        ShardManifest manifest;
+        std::vector<std::unique_ptr<Shard>> shards;
+
+        size_t metric_distance_computations{0};
+        size_t metric_hops{0};
+        // shard searches issued, i.e. fan-out summed over queries
+        size_t metric_shard_queries{0};
+
+        iRangeGraph_Sharded_Search(std::string manifestprefix, DataLoader *store, int M) : storage(store)
+        {
+            manifest.Load(manifestprefix);
+            if (manifest.metric != storage->metric)
+                throw Exception(manifest.ManifestPath() + " was built with metric " + MetricName(manifest.metric) + " but " + MetricName(storage->metric) + " was requested");
+            for (int s = 0; s < manifest.shards(); s++)
+            {
+                std::unique_ptr<Shard> shard(new Shard());
+                shard->begin = manifest.bounds[s];
+                shard->end = manifest.bounds[s + 1];
+                shard->storage.metric = manifest.metric;
+                shard->index.reset(new iRangeGraph_Search<float>(manifest.DataPath(s), manifest.IndexPath(s), &shard->storage, M));
+                if (shard->index->max_elements_ != shard->end - shard->begin)
+                    throw Exception(manifest.DataPath(s) + " does not match the shard bounds in the manifest");
+                shards.emplace_back(std::move(shard));
+            }
+        }
+
+        // Answers the part of [QL, QR] that falls into shard s, with global ids
+        std::priority_queue<PFI> SearchShard(SearchContext &ctx, RangeCover &cover, int s, const void *query_data, int ef, int query_k, int QL, int QR, int edge_limit) const
+        {
+            const Shard &shard = *shards[s];
+            shard.index->tree->range_cover(std::max(QL, shard.begin) - shard.begin, std::min(QR, shard.end - 1) - shard.begin, cover);
+            std::priority_queue<PFI> local = shard.index->TopDown_nodeentries_search(ctx, cover, query_data, ef, query_k, edge_limit);
+            std::priority_queue<PFI> result;
+            while (local.size())
+            {
+                result.emplace(local.top().first, local.top().second + shard.begin);
+                local.pop();
+            }
+            return result;
+        }
+
+        // Like iRangeGraph_Search::search_batch, with one task per (query, overlapping shard) pair, so a wide query
+        // keeps as many threads busy as it touches shards
+        std::vector<std::priority_queue<PFI>> search_batch(const VectorSet &queries, const std::vector<std::pair<int, int>> &ranges, int ef, int query_k, int edge_limit, int threads)
+        {
+            if (queries.size() != ranges.size())
+                throw Exception("number of query ranges does not match number of queries");
+            std::vector<std::pair<int, int>> tasks;
+            std::vector<int> task_offsets(1, 0);
+            for (int i = 0; i < queries.size(); i++)
+            {
+                std::pair<int, int> overlap = manifest.Overlapping(ranges[i].first, ranges[i].second);
+                for (int s = overlap.first; s < overlap.second; s++)
+                    tasks.emplace_back(i, s);
+                task_offsets.emplace_back(tasks.size());
+            }
+
+            std::vector<std::priority_queue<PFI>> partial(tasks.size());
+            std::vector<std::priority_queue<PFI>> results(queries.size());
+            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            size_t distance_computations = 0, hops = 0;
+
+#pragma omp parallel num_threads(threads) reduction(+ : distance_computations, hops)
+            {
+                // one context per shard, created when this thread first searches it
+                std::vector<std::unique_ptr<SearchContext>> ctx(shards.size());
+                RangeCover cover;
+#pragma omp for schedule(dynamic, 1)
+                for (int t = 0; t < tasks.size(); t++)
+                {
+                    int i = tasks[t].first, s = tasks[t].second;
+                    if (ctx[s] == nullptr)
+                        ctx[s].reset(new SearchContext(shards[s]->index->visited_list_pool_.get(), seed + omp_get_thread_num() * shards.size() + s));
+                    partial[t] = SearchShard(*ctx[s], cover, s, queries[i], ef, query_k, ranges[i].first, ranges[i].second, edge_limit);
+                }
+
+#pragma omp for schedule(dynamic, 64)
+                for (int i = 0; i < queries.size(); i++)
+                {
+                    std::priority_queue<PFI> &merged = results[i];
+                    for (int t = task_offsets[i]; t < task_offsets[i + 1]; t++)
+                    {
+                        for (; partial[t].size(); partial[t].pop())
+                        {
+                            merged.emplace(partial[t].top());
+                            if (merged.size() > query_k)
+                                merged.pop();
+                        }
+                    }
+                }
+
+                for (auto &c : ctx)
+                {
+                    if (c == nullptr)
+                        continue;
+                    distance_computations += c->metric_distance_computations;
+                    hops += c->metric_hops;
+                }
+            }
+
+            metric_distance_computations += distance_computations;
+            metric_hops += hops;
+            metric_shard_queries += tasks.size();
+            return results;
+        }
+
+        // Same sweep and result files as iRangeGraph_Search::search; also reports the average shard fan-out
+        void search(std::vector<int> &SearchEF, std::string saveprefix, int edge_limit, int threads = 1)
+        {
+            for (auto range : storage->query_range)
+            {
+                int suffix = range.first;
+                std::vector<std::vector<int>> &gt = storage->groundtruth[suffix];
+                std::vector<std::pair<int, int>> ranges(range.second.begin(), range.second.begin() + storage->query_nb);
+                std::string savepath = saveprefix + std::to_string(suffix) + ".csv";
+                CheckPath(savepath);
+                std::ofstream outfile(savepath);
+                if (!outfile.is_open())
+                    throw Exception("cannot open " + savepath);
+
+                std::cout << "suffix = " << suffix << std::endl;
+                for (auto ef : SearchEF)
+                {
+                    int tp = 0;
+
+                    metric_hops = 0;
+                    metric_distance_computations = 0;
+                    metric_shard_queries = 0;
+
+                    timeval t1, t2;
+                    gettimeofday(&t1, NULL);
+                    std::vector<std::priority_queue<PFI>> results = search_batch(storage->query_points, ranges, ef, storage->query_K, edge_limit, threads);
+                    gettimeofday(&t2, NULL);
+                    float searchtime = GetTime(t1, t2);
+
+                    for (int i = 0; i < storage->query_nb; i++)
+                    {
+                        std::priority_queue<PFI> &res = results[i];
+                        std::map<int, int> record;
+                        while (res.size())
+                        {
+                            auto x = res.top().second;
+                            res.pop();
+                            if (record.count(x))
+                                throw Exception("repetitive search results");
+                            record[x] = 1;
+                            if (std::find(gt[i].begin(), gt[i].end(), x) != gt[i].end())
+                                tp++;
+                        }
+                    }
+
+                    float recall = 1.0 * tp / storage->query_nb / storage->query_K;
+                    float qps = storage->query_nb / searchtime;
+                    float dco = metric_distance_computations * 1.0 / storage->query_nb;
+                    float hop = metric_hops * 1.0 / storage->query_nb;
+                    float fanout = metric_shard_queries * 1.0 / storage->query_nb;
+                    if (ef == SearchEF.front())
+                        std::cout << "shards per query: " << fanout << std::endl;
+                    outfile << ef << "," << recall << "," << qps << "," << dco << "," << hop << std::endl;
+                }
+                outfile.close();
+            }
+        }
+    };
+}
@@ -4,6 +4,24 @@
 #include <cstring>
 #include <stdint.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
 
 
 namespace memory
@@ -35,7 +53,7 @@ namespace memory
             madvise(ptr, sz, MADV_HUGEPAGE);
             return ptr;
         }
-        void deallocate(T *, int) { free(ptr); }
+        void deallocate(T *p, int) { free(p); }
         template <typename U>
         struct rebind
         {
@@ -45,6 +63,209 @@ namespace memory
     };
 
 
+    // Pages backing a large allocation. TRANSPARENT asks for transparent huge pages with madvise; HUGE_2MB and HUGE_1GB
+    // map hugetlbfs pages, which have to be reserved in /proc/sys/vm/nr_hugepages (or the 1 GB pool) beforehand.
+    enum class PageSize
+    {
+        SMALL,
+        TRANSPARENT,
+        HUGE_2MB,
+        HUGE_1GB
+    };
+
+    // Placement of a large allocation across NUMA nodes. LOCAL leaves it to first touch, INTERLEAVE spreads its pages
+    // round-robin over all nodes, REPLICATE keeps one copy per node for threads pinned to that node.
+    enum class NumaPolicy
+    {
+        LOCAL,
+        INTERLEAVE,
+        REPLICATE
+    };
+
+    struct Placement
+    {
+        PageSize pages{PageSize::SMALL};
+        NumaPolicy numa{NumaPolicy::LOCAL};
+    };
+
+    // An anonymous mapping; bytes is the mapped length, rounded up to whole pages
+    struct PageBuffer
+    {
+        char *ptr{nullptr};
+        size_t bytes{0};
+    };
+
+    // Parses a sysfs list such as "0-23,48-71"
+    inline std::vector<int> parse_cpulist(const std::string &list)
+    {
+        std::vector<int> ids;
+        size_t pos = 0;
+        while (pos < list.size())
+        {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos)
+                end = list.size();
+            std::string item = list.substr(pos, end - pos);
+            size_t dash = item.find('-');
+            if (!item.empty() && item[0] >= '0' && item[0] <= '9')
+            {
+                int first = std::stoi(item);
+                int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+                for (int i = first; i <= last; i++)
+                    ids.push_back(i);
+            }
+            pos = end + 1;
+        }
+        return ids;
+    }
+
+    inline std::string read_sysfs(const std::string &path)
+    {
+        std::ifstream infile(path);
+        std::string line;
+        std::getline(infile, line);
+        return line;
+    }
+
+    // Online NUMA nodes, {0} on machines without NUMA information
+    inline const std::vector<int> &numa_nodes()
+    {
+        static const std::vector<int> nodes = []
+        {
+            std::vector<int> online = parse_cpulist(read_sysfs("/sys/devices/system/node/online"));
+            return online.empty() ? std::vector<int>{0} : online;
+        }();
+        return nodes;
+    }
+
+    inline std::vector<int> numa_node_cpus(int node)
+    {
+        return parse_cpulist(read_sysfs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"));
+    }
+
+    // Replica slot of the calling thread, set by NodePin; 0 for threads that were not pinned
+    inline int &current_node()
+    {
+        static thread_local int node = 0;
+        return node;
+    }
+
+    // Binds [p, p + bytes) to node, or interleaves it over all nodes when node < 0. Issued through the raw system
+    // call so that no libnuma is needed; failure (e.g. a kernel without NUMA) leaves the default policy in place.
+    inline bool bind_pages(void *p, size_t bytes, int node)
+    {
+        std::vector<unsigned long> mask(numa_nodes().back() / 64 + 1, 0);
+        int mode = MPOL_BIND;
+        if (node < 0)
+        {
+            mode = MPOL_INTERLEAVE;
+            for (int n : numa_nodes())
+                mask[n / 64] |= 1UL << (n % 64);
+        }
+        else
+        {
+            if (node / 64 >= (int)mask.size())
+                return false;
+            mask[node / 64] |= 1UL << (node % 64);
+        }
+        return syscall(SYS_mbind, p, bytes, mode, mask.data(), mask.size() * 64 + 1, 0) == 0;
+    }
+
+    // Maps nbytes of zeroed memory placed by numa; REPLICATE binds the pages to numa_nodes()[slot]. Unavailable
+    // hugetlbfs pages fall back to transparent huge pages. ptr is nullptr when out of memory.
+    inline PageBuffer alloc_pages(size_t nbytes, PageSize pages, NumaPolicy numa = NumaPolicy::LOCAL, int slot = 0)
+    {
+        PageBuffer buffer;
+        const size_t huge = 1 << 21;
+        if (pages == PageSize::HUGE_2MB || pages == PageSize::HUGE_1GB)
+        {
+            size_t page = pages == PageSize::HUGE_1GB ? (1UL << 30) : huge;
+            size_t bytes = (nbytes + page - 1) / page * page;
+            int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (pages == PageSize::HUGE_1GB ? MAP_HUGE_1GB : MAP_HUGE_2MB);
+            void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if (p != MAP_FAILED)
+            {
+                if (numa != NumaPolicy::LOCAL)
+                    bind_pages(p, bytes, numa == NumaPolicy::INTERLEAVE ? -1 : numa_nodes()[slot]);
+                buffer.ptr = (char *)p;
+                buffer.bytes = bytes;
+                return buffer;
+            }
+            std::cout << "cannot map " << bytes / (1 << 20) << " MB of " << (pages == PageSize::HUGE_1GB ? "1 GB" : "2 MB") << " huge pages, using transparent huge pages" << std::endl;
+            pages = PageSize::TRANSPARENT;
+        }
+
+        // over-map by one huge page so the region can be trimmed to a 2 MB aligned start
+        size_t bytes = (nbytes + huge - 1) / huge * huge;
+        void *p = mmap(nullptr, bytes + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return buffer;
+        char *begin = (char *)(((uintptr_t)p + huge - 1) / huge * huge);
+        if (begin != (char *)p)
+            munmap(p, begin - (char *)p);
+        if (begin + bytes != (char *)p + bytes + huge)
+            munmap(begin + bytes, (char *)p + bytes + huge - (begin + bytes));
+        if (pages == PageSize::TRANSPARENT)
+            madvise(begin, bytes, MADV_HUGEPAGE);
+        if (numa != NumaPolicy::LOCAL)
+            bind_pages(begin, bytes, numa == NumaPolicy::INTERLEAVE ? -1 : numa_nodes()[slot]);
+        buffer.ptr = begin;
+        buffer.bytes = bytes;
+        return buffer;
+    }
+
+    inline void free_pages(PageBuffer &buffer)
+    {
+        if (buffer.ptr != nullptr)
+            munmap(buffer.ptr, buffer.bytes);
+        buffer.ptr = nullptr;
+        buffer.bytes = 0;
+    }
+
+    // Pins the calling thread to the CPUs of NUMA node numa_nodes()[slot] and makes slot its current_node() for the
+    // lifetime of the object; the previous affinity is restored afterwards. slot < 0 pins nothing.
+    class NodePin
+    {
+    public:
+        explicit NodePin(int slot)
+        {
+            if (slot < 0)
+                return;
+            std::vector<int> cpus = numa_node_cpus(numa_nodes()[slot]);
+            if (cpus.empty() || sched_getaffinity(0, sizeof(saved_), &saved_) != 0)
+                return;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : cpus)
+            {
+                if (cpu < CPU_SETSIZE)
+                    CPU_SET(cpu, &set);
+            }
+            if (sched_setaffinity(0, sizeof(set), &set) != 0)
+                return;
+            pinned_ = true;
+            previous_node_ = current_node();
+            current_node() = slot;
+        }
+
+        ~NodePin()
+        {
+            if (!pinned_)
+                return;
+            sched_setaffinity(0, sizeof(saved_), &saved_);
+            current_node() = previous_node_;
+        }
+
+        NodePin(const NodePin &) = delete;
+        NodePin &operator=(const NodePin &) = delete;
+
+    private:
+        cpu_set_t saved_;
+        bool pinned_{false};
+        int previous_node_{0};
+    };
+
+
     inline void prefetch_L1(const void *address)
     {
 #if defined(__SSE2__)
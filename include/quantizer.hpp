@@ -0,0 +1,103 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace quantizer
+{
+    // 8-bit scalar quantization with a per-dimension [min, max] range: value = vmin + code * scale
+    struct SQ8Quantizer
+    {
+        size_t dim{0};
+        std::vector<float> vmin;
+        std::vector<float> scale;
+
+        void train(const float *data, size_t n, size_t d)
+        {
+            begin_training(d);
+            observe(data, n);
+            finish_training();
+        }
+
+        // Streaming form of train for data read in chunks: observe every vector once between begin and finish
+        void begin_training(size_t d)
+        {
+            dim = d;
+            vmin.assign(dim, std::numeric_limits<float>::max());
+            vmax_.assign(dim, std::numeric_limits<float>::lowest());
+        }
+
+        void observe(const float *data, size_t n)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                const float *vec = data + i * dim;
+                for (size_t j = 0; j < dim; j++)
+                {
+                    vmin[j] = std::min(vmin[j], vec[j]);
+                    vmax_[j] = std::max(vmax_[j], vec[j]);
+                }
+            }
+        }
+
+        void finish_training()
+        {
+            scale.resize(dim);
+            for (size_t j = 0; j < dim; j++)
+                scale[j] = vmax_[j] > vmin[j] ? (vmax_[j] - vmin[j]) / 255.0f : 1.0f;
+            std::vector<float>().swap(vmax_);
+        }
+
+        void encode(const float *vec, uint8_t *code) const
+        {
+            for (size_t j = 0; j < dim; j++)
+            {
+                float x = (vec[j] - vmin[j]) / scale[j] + 0.5f;
+                code[j] = (uint8_t)std::min(255.0f, std::max(0.0f, x));
+            }
+        }
+
+    private:
+        std::vector<float> vmax_;
+    };
+
+    // Asymmetric distance between a float32 query and an SQ8 code; param points to the SQ8Quantizer
+    static float
+    SQ8L2Sqr(const void *pVect1v, const void *pVect2v, const void *param)
+    {
+        const SQ8Quantizer *sq = (const SQ8Quantizer *)param;
+        const float *query = (const float *)pVect1v;
+        const uint8_t *code = (const uint8_t *)pVect2v;
+        const float *vmin = sq->vmin.data();
+        const float *scale = sq->scale.data();
+        size_t qty = sq->dim;
+
+        float res = 0;
+        for (size_t i = 0; i < qty; i++)
+        {
+            float t = query[i] - (vmin[i] + code[i] * scale[i]);
+            res += t * t;
+        }
+        return res;
+    }
+
+    // Inner-product counterpart of SQ8L2Sqr: 1 - <query, decoded vector>, as in hnswlib::InnerProductSpace
+    static float
+    SQ8InnerProductDistance(const void *pVect1v, const void *pVect2v, const void *param)
+    {
+        const SQ8Quantizer *sq = (const SQ8Quantizer *)param;
+        const float *query = (const float *)pVect1v;
+        const uint8_t *code = (const uint8_t *)pVect2v;
+        const float *vmin = sq->vmin.data();
+        const float *scale = sq->scale.data();
+        size_t qty = sq->dim;
+
+        float res = 0;
+        for (size_t i = 0; i < qty; i++)
+            res += query[i] * (vmin[i] + code[i] * scale[i]);
+        return 1.0f - res;
+    }
+}
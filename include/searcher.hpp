@@ -60,16 +60,26 @@ namespace searcher
     };
 
 
+    // Bounded array of the best candidates sorted by distance; cur_ is the closest one not yet expanded.
+    // Visited tracking is left to the caller, so the pool is O(capacity) and can be reused across queries.
     struct LinearPool
     {
     public:
-        int nb, size_ = 0, cur_ = 0, capacity_;
+        int size_ = 0, cur_ = 0, capacity_;
         std::vector<Candidiate<float>,memory::align_alloc<Candidiate<float>>> data_;
-        Bitset<uint64_t> vis;
         constexpr static int kMask = 2147483647;
 
-        LinearPool(int n, int capacity)
-            : nb(n), capacity_(capacity), data_(capacity_ + 1), vis(n) {}
+        explicit LinearPool(int capacity)
+            : capacity_(capacity), data_(capacity_ + 1) {}
+
+        void reset(int capacity)
+        {
+            capacity_ = capacity;
+            if (data_.size() < capacity_ + 1)
+                data_.resize(capacity_ + 1);
+            size_ = 0;
+            cur_ = 0;
+        }
 
         bool insert(int u, float dist)
         {
@@ -108,6 +118,11 @@ namespace searcher
         int get_size() const { return size_; }
 
         int id(int i) const { return get_id(data_[i].id); }
+
+        float dist(int i) const { return data_[i].distance; }
+
+        // id of the candidate the next pop() returns; requires has_next()
+        int next_id() const { return get_id(data_[cur_].id); }
         
     private:
         int find_bsearch(float dist)
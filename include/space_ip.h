@@ -1,5 +1,6 @@
 #pragma once
 #include "hnswlib.h"
+#include "half.hpp"
 
 namespace hnswlib {
 
@@ -339,14 +340,260 @@ InnerProductDistanceSIMD4ExtResiduals(const void *pVect1v, const void *pVect2v,
 }
 #endif
 
+// Fixed-dimension counterparts of the kernels above, see L2SqrDimAVX512 in space_l2.h. DIM must be a multiple of 32.
+#if defined(USE_AVX512)
+template <size_t DIM>
+static float
+InnerProductDistanceDimAVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    static_assert(DIM % 32 == 0, "DIM must be a multiple of 32");
+    const float *pVect1 = (const float *) pVect1v;
+    const float *pVect2 = (const float *) pVect2v;
+
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    for (size_t i = 0; i < DIM; i += 32) {
+        sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(pVect1 + i), _mm512_loadu_ps(pVect2 + i), sum0);
+        sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(pVect1 + i + 16), _mm512_loadu_ps(pVect2 + i + 16), sum1);
+    }
+    return 1.0f - _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+}
+#endif
+
+#if defined(USE_AVX)
+template <size_t DIM>
+static float
+InnerProductDistanceDimAVX(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    static_assert(DIM % 32 == 0, "DIM must be a multiple of 32");
+    const float *pVect1 = (const float *) pVect1v;
+    const float *pVect2 = (const float *) pVect2v;
+
+    __m256 sum[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+    for (size_t i = 0; i < DIM; i += 32) {
+        for (size_t j = 0; j < 4; j++) {
+            __m256 v1 = _mm256_loadu_ps(pVect1 + i + 8 * j);
+            __m256 v2 = _mm256_loadu_ps(pVect2 + i + 8 * j);
+#if defined(__FMA__)
+            sum[j] = _mm256_fmadd_ps(v1, v2, sum[j]);
+#else
+            sum[j] = _mm256_add_ps(sum[j], _mm256_mul_ps(v1, v2));
+#endif
+        }
+    }
+    __m256 total = _mm256_add_ps(_mm256_add_ps(sum[0], sum[1]), _mm256_add_ps(sum[2], sum[3]));
+    __m128 sumh = _mm_add_ps(_mm256_castps256_ps128(total), _mm256_extractf128_ps(total, 1));
+    __m128 tmp1 = _mm_add_ps(sumh, _mm_movehl_ps(sumh, sumh));
+    __m128 tmp2 = _mm_add_ps(tmp1, _mm_movehdup_ps(tmp1));
+    return 1.0f - _mm_cvtss_f32(tmp2);
+}
+#endif
+
+template <size_t DIM>
+static DISTFUNC<float>
+InnerProductDistanceDimKernel() {
+#if defined(USE_AVX512)
+    if (AVX512Capable())
+        return InnerProductDistanceDimAVX512<DIM>;
+#endif
+#if defined(USE_AVX)
+    if (AVXCapable())
+        return InnerProductDistanceDimAVX<DIM>;
+#endif
+    return nullptr;
+}
+
+static DISTFUNC<float>
+InnerProductDistanceDimSpecialized(size_t dim) {
+    switch (dim) {
+    case 96: return InnerProductDistanceDimKernel<96>();
+    case 128: return InnerProductDistanceDimKernel<128>();
+    case 384: return InnerProductDistanceDimKernel<384>();
+    case 768: return InnerProductDistanceDimKernel<768>();
+    case 960: return InnerProductDistanceDimKernel<960>();
+    }
+    return nullptr;
+}
+
+// Batched counterparts of InnerProductDistance, see L2SqrBatch4AVX512 in space_l2.h
+#if defined(USE_AVX512)
+static void
+InnerProductDistanceBatch4AVX512(const void *query, const void *const *vecs, const void *qty_ptr, float *out) {
+    const float *q = (const float *) query;
+    const float *v0 = (const float *) vecs[0];
+    const float *v1 = (const float *) vecs[1];
+    const float *v2 = (const float *) vecs[2];
+    const float *v3 = (const float *) vecs[3];
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps(), s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= qty; i += 16) {
+        __m512 vq = _mm512_loadu_ps(q + i);
+        s0 = _mm512_fmadd_ps(vq, _mm512_loadu_ps(v0 + i), s0);
+        s1 = _mm512_fmadd_ps(vq, _mm512_loadu_ps(v1 + i), s1);
+        s2 = _mm512_fmadd_ps(vq, _mm512_loadu_ps(v2 + i), s2);
+        s3 = _mm512_fmadd_ps(vq, _mm512_loadu_ps(v3 + i), s3);
+    }
+    if (i < qty) {
+        __mmask16 mask = (__mmask16) ((1u << (qty - i)) - 1);
+        __m512 vq = _mm512_maskz_loadu_ps(mask, q + i);
+        s0 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(mask, v0 + i), s0);
+        s1 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(mask, v1 + i), s1);
+        s2 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(mask, v2 + i), s2);
+        s3 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(mask, v3 + i), s3);
+    }
+    out[0] = 1.0f - _mm512_reduce_add_ps(s0);
+    out[1] = 1.0f - _mm512_reduce_add_ps(s1);
+    out[2] = 1.0f - _mm512_reduce_add_ps(s2);
+    out[3] = 1.0f - _mm512_reduce_add_ps(s3);
+}
+#endif
+
+#if defined(USE_AVX)
+static void
+InnerProductDistanceBatch4AVX(const void *query, const void *const *vecs, const void *qty_ptr, float *out) {
+    const float *q = (const float *) query;
+    const float *v[4] = {(const float *) vecs[0], (const float *) vecs[1], (const float *) vecs[2], (const float *) vecs[3]};
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m256 s[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+    size_t i = 0;
+    for (; i + 8 <= qty; i += 8) {
+        __m256 vq = _mm256_loadu_ps(q + i);
+        for (int j = 0; j < 4; j++) {
+#if defined(__FMA__)
+            s[j] = _mm256_fmadd_ps(vq, _mm256_loadu_ps(v[j] + i), s[j]);
+#else
+            s[j] = _mm256_add_ps(s[j], _mm256_mul_ps(vq, _mm256_loadu_ps(v[j] + i)));
+#endif
+        }
+    }
+    for (int j = 0; j < 4; j++) {
+        float res = HorizontalSumAVX(s[j]);
+        for (size_t k = i; k < qty; k++)
+            res += q[k] * v[j][k];
+        out[j] = 1.0f - res;
+    }
+}
+#endif
+
+// Float32 query against an FP16 or BF16 vector, widened and accumulated in float32 as in L2SqrFP16
+static float
+InnerProductDistanceFP16(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    float res = 0;
+    for (size_t i = 0; i < qty; i++)
+        res += pVect1[i] * half::fp16_to_float(pVect2[i]);
+    return 1.0f - res;
+}
+
+static float
+InnerProductDistanceBF16(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    float res = 0;
+    for (size_t i = 0; i < qty; i++)
+        res += pVect1[i] * half::bf16_to_float(pVect2[i]);
+    return 1.0f - res;
+}
+
+#if defined(USE_AVX512)
+static float
+InnerProductDistanceFP16AVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= qty; i += 16) {
+        __m512 v2 = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *) (pVect2 + i)));
+        sum = _mm512_fmadd_ps(_mm512_loadu_ps(pVect1 + i), v2, sum);
+    }
+    size_t left = qty - i;
+    return InnerProductDistanceFP16(pVect1 + i, pVect2 + i, &left) - _mm512_reduce_add_ps(sum);
+}
+
+static float
+InnerProductDistanceBF16AVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= qty; i += 16) {
+        __m512i wide = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *) (pVect2 + i)));
+        __m512 v2 = _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16));
+        sum = _mm512_fmadd_ps(_mm512_loadu_ps(pVect1 + i), v2, sum);
+    }
+    size_t left = qty - i;
+    return InnerProductDistanceBF16(pVect1 + i, pVect2 + i, &left) - _mm512_reduce_add_ps(sum);
+}
+#endif
+
+#if defined(USE_AVX) && defined(__F16C__) && defined(__AVX2__)
+static float
+InnerProductDistanceFP16AVX(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= qty; i += 8) {
+        __m256 v2 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (pVect2 + i)));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(pVect1 + i), v2));
+    }
+    size_t left = qty - i;
+    return InnerProductDistanceFP16(pVect1 + i, pVect2 + i, &left) - HorizontalSumAVX(sum);
+}
+
+static float
+InnerProductDistanceBF16AVX(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= qty; i += 8) {
+        __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (pVect2 + i)));
+        __m256 v2 = _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(pVect1 + i), v2));
+    }
+    size_t left = qty - i;
+    return InnerProductDistanceBF16(pVect1 + i, pVect2 + i, &left) - HorizontalSumAVX(sum);
+}
+#endif
+
 class InnerProductSpace : public SpaceInterface<float> {
     DISTFUNC<float> fstdistfunc_;
+    DISTFUNC4<float> batch4func_{nullptr};
+    DISTFUNC<float> fp16func_{InnerProductDistanceFP16};
+    DISTFUNC<float> bf16func_{InnerProductDistanceBF16};
     size_t data_size_;
     size_t dim_;
 
  public:
     InnerProductSpace(size_t dim) {
         fstdistfunc_ = InnerProductDistance;
+#if defined(USE_AVX512)
+        if (AVX512Capable()) {
+            fp16func_ = InnerProductDistanceFP16AVX512;
+            bf16func_ = InnerProductDistanceBF16AVX512;
+        }
+#endif
+#if defined(USE_AVX) && defined(__F16C__) && defined(__AVX2__)
+        if (fp16func_ == InnerProductDistanceFP16 && AVXCapable()) {
+            fp16func_ = InnerProductDistanceFP16AVX;
+            bf16func_ = InnerProductDistanceBF16AVX;
+        }
+#endif
 #if defined(USE_AVX) || defined(USE_SSE) || defined(USE_AVX512)
     #if defined(USE_AVX512)
         if (AVX512Capable()) {
@@ -377,6 +624,17 @@ class InnerProductSpace : public SpaceInterface<float> {
             fstdistfunc_ = InnerProductDistanceSIMD16ExtResiduals;
         else if (dim > 4)
             fstdistfunc_ = InnerProductDistanceSIMD4ExtResiduals;
+#endif
+        if (DISTFUNC<float> specialized = InnerProductDistanceDimSpecialized(dim))
+            fstdistfunc_ = specialized;
+#if defined(USE_AVX512)
+        if (AVX512Capable())
+            batch4func_ = InnerProductDistanceBatch4AVX512;
+        else if (AVXCapable())
+            batch4func_ = InnerProductDistanceBatch4AVX;
+#elif defined(USE_AVX)
+        if (AVXCapable())
+            batch4func_ = InnerProductDistanceBatch4AVX;
 #endif
         dim_ = dim;
         data_size_ = dim * sizeof(float);
@@ -394,6 +652,18 @@ class InnerProductSpace : public SpaceInterface<float> {
         return &dim_;
     }
 
+    DISTFUNC4<float> get_dist_func_batch4() {
+        return batch4func_;
+    }
+
+    DISTFUNC<float> get_dist_func_fp16() {
+        return fp16func_;
+    }
+
+    DISTFUNC<float> get_dist_func_bf16() {
+        return bf16func_;
+    }
+
 ~InnerProductSpace() {}
 };
 
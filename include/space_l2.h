@@ -1,5 +1,6 @@
 #pragma once
 #include "hnswlib.h"
+#include "half.hpp"
 
 namespace hnswlib {
 
@@ -41,8 +42,7 @@ L2SqrSIMD16ExtAVX512(const void *pVect1v, const void *pVect2v, const void *qty_p
         v2 = _mm512_loadu_ps(pVect2);
         pVect2 += 16;
         diff = _mm512_sub_ps(v1, v2);
-        // sum = _mm512_fmadd_ps(diff, diff, sum);
-        sum = _mm512_add_ps(sum, _mm512_mul_ps(diff, diff));
+        sum = _mm512_fmadd_ps(diff, diff, sum);
     }
 
     auto sumh =
@@ -209,14 +209,285 @@ L2SqrSIMD4ExtResiduals(const void *pVect1v, const void *pVect2v, const void *qty
 }
 #endif
 
+// Kernels for a dimension fixed at compile time: the loop is fully unrolled, the running sums are split to hide
+// the FMA latency and the size argument is ignored. DIM must be a multiple of 32.
+#if defined(USE_AVX512)
+template <size_t DIM>
+static float
+L2SqrDimAVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    static_assert(DIM % 32 == 0, "DIM must be a multiple of 32");
+    const float *pVect1 = (const float *) pVect1v;
+    const float *pVect2 = (const float *) pVect2v;
+
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    for (size_t i = 0; i < DIM; i += 32) {
+        __m512 diff0 = _mm512_sub_ps(_mm512_loadu_ps(pVect1 + i), _mm512_loadu_ps(pVect2 + i));
+        __m512 diff1 = _mm512_sub_ps(_mm512_loadu_ps(pVect1 + i + 16), _mm512_loadu_ps(pVect2 + i + 16));
+        sum0 = _mm512_fmadd_ps(diff0, diff0, sum0);
+        sum1 = _mm512_fmadd_ps(diff1, diff1, sum1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+}
+#endif
+
+#if defined(USE_AVX)
+template <size_t DIM>
+static float
+L2SqrDimAVX(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    static_assert(DIM % 32 == 0, "DIM must be a multiple of 32");
+    const float *pVect1 = (const float *) pVect1v;
+    const float *pVect2 = (const float *) pVect2v;
+
+    __m256 sum[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+    for (size_t i = 0; i < DIM; i += 32) {
+        for (size_t j = 0; j < 4; j++) {
+            __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(pVect1 + i + 8 * j), _mm256_loadu_ps(pVect2 + i + 8 * j));
+#if defined(__FMA__)
+            sum[j] = _mm256_fmadd_ps(diff, diff, sum[j]);
+#else
+            sum[j] = _mm256_add_ps(sum[j], _mm256_mul_ps(diff, diff));
+#endif
+        }
+    }
+    __m256 total = _mm256_add_ps(_mm256_add_ps(sum[0], sum[1]), _mm256_add_ps(sum[2], sum[3]));
+    __m128 sumh = _mm_add_ps(_mm256_castps256_ps128(total), _mm256_extractf128_ps(total, 1));
+    __m128 tmp1 = _mm_add_ps(sumh, _mm_movehl_ps(sumh, sumh));
+    __m128 tmp2 = _mm_add_ps(tmp1, _mm_movehdup_ps(tmp1));
+    return _mm_cvtss_f32(tmp2);
+}
+#endif
+
+template <size_t DIM>
+static DISTFUNC<float>
+L2SqrDimKernel() {
+#if defined(USE_AVX512)
+    if (AVX512Capable())
+        return L2SqrDimAVX512<DIM>;
+#endif
+#if defined(USE_AVX)
+    if (AVXCapable())
+        return L2SqrDimAVX<DIM>;
+#endif
+    return nullptr;
+}
+
+// Unrolled kernel for the embedding sizes we serve most, nullptr for any other dimension
+static DISTFUNC<float>
+L2SqrDimSpecialized(size_t dim) {
+    switch (dim) {
+    case 96: return L2SqrDimKernel<96>();
+    case 128: return L2SqrDimKernel<128>();
+    case 384: return L2SqrDimKernel<384>();
+    case 768: return L2SqrDimKernel<768>();
+    case 960: return L2SqrDimKernel<960>();
+    }
+    return nullptr;
+}
+
+// Four distances against one query in a single pass: each query block is loaded once and four independent FMA
+// chains are in flight, which lets a whole selected neighbor list be scored block by block.
+#if defined(USE_AVX512)
+static void
+L2SqrBatch4AVX512(const void *query, const void *const *vecs, const void *qty_ptr, float *out) {
+    const float *q = (const float *) query;
+    const float *v0 = (const float *) vecs[0];
+    const float *v1 = (const float *) vecs[1];
+    const float *v2 = (const float *) vecs[2];
+    const float *v3 = (const float *) vecs[3];
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps(), s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= qty; i += 16) {
+        __m512 vq = _mm512_loadu_ps(q + i);
+        __m512 d0 = _mm512_sub_ps(vq, _mm512_loadu_ps(v0 + i));
+        __m512 d1 = _mm512_sub_ps(vq, _mm512_loadu_ps(v1 + i));
+        __m512 d2 = _mm512_sub_ps(vq, _mm512_loadu_ps(v2 + i));
+        __m512 d3 = _mm512_sub_ps(vq, _mm512_loadu_ps(v3 + i));
+        s0 = _mm512_fmadd_ps(d0, d0, s0);
+        s1 = _mm512_fmadd_ps(d1, d1, s1);
+        s2 = _mm512_fmadd_ps(d2, d2, s2);
+        s3 = _mm512_fmadd_ps(d3, d3, s3);
+    }
+    if (i < qty) {
+        __mmask16 mask = (__mmask16) ((1u << (qty - i)) - 1);
+        __m512 vq = _mm512_maskz_loadu_ps(mask, q + i);
+        __m512 d0 = _mm512_sub_ps(vq, _mm512_maskz_loadu_ps(mask, v0 + i));
+        __m512 d1 = _mm512_sub_ps(vq, _mm512_maskz_loadu_ps(mask, v1 + i));
+        __m512 d2 = _mm512_sub_ps(vq, _mm512_maskz_loadu_ps(mask, v2 + i));
+        __m512 d3 = _mm512_sub_ps(vq, _mm512_maskz_loadu_ps(mask, v3 + i));
+        s0 = _mm512_fmadd_ps(d0, d0, s0);
+        s1 = _mm512_fmadd_ps(d1, d1, s1);
+        s2 = _mm512_fmadd_ps(d2, d2, s2);
+        s3 = _mm512_fmadd_ps(d3, d3, s3);
+    }
+    out[0] = _mm512_reduce_add_ps(s0);
+    out[1] = _mm512_reduce_add_ps(s1);
+    out[2] = _mm512_reduce_add_ps(s2);
+    out[3] = _mm512_reduce_add_ps(s3);
+}
+#endif
+
+#if defined(USE_AVX)
+static void
+L2SqrBatch4AVX(const void *query, const void *const *vecs, const void *qty_ptr, float *out) {
+    const float *q = (const float *) query;
+    const float *v[4] = {(const float *) vecs[0], (const float *) vecs[1], (const float *) vecs[2], (const float *) vecs[3]};
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m256 s[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+    size_t i = 0;
+    for (; i + 8 <= qty; i += 8) {
+        __m256 vq = _mm256_loadu_ps(q + i);
+        for (int j = 0; j < 4; j++) {
+            __m256 diff = _mm256_sub_ps(vq, _mm256_loadu_ps(v[j] + i));
+#if defined(__FMA__)
+            s[j] = _mm256_fmadd_ps(diff, diff, s[j]);
+#else
+            s[j] = _mm256_add_ps(s[j], _mm256_mul_ps(diff, diff));
+#endif
+        }
+    }
+    for (int j = 0; j < 4; j++) {
+        float res = HorizontalSumAVX(s[j]);
+        for (size_t k = i; k < qty; k++) {
+            float t = q[k] - v[j][k];
+            res += t * t;
+        }
+        out[j] = res;
+    }
+}
+#endif
+
+// Mixed precision: a float32 query against a vector stored as binary16 (FP16) or bfloat16 (BF16). Elements are
+// widened to float32 and accumulated in float32, so only the stored vector loses precision; widening bfloat16 is a
+// 16-bit shift. The loops stop at qty, so rows may be padded.
+static float
+L2SqrFP16(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    float res = 0;
+    for (size_t i = 0; i < qty; i++) {
+        float t = pVect1[i] - half::fp16_to_float(pVect2[i]);
+        res += t * t;
+    }
+    return res;
+}
+
+static float
+L2SqrBF16(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    float res = 0;
+    for (size_t i = 0; i < qty; i++) {
+        float t = pVect1[i] - half::bf16_to_float(pVect2[i]);
+        res += t * t;
+    }
+    return res;
+}
+
+#if defined(USE_AVX512)
+static float
+L2SqrFP16AVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= qty; i += 16) {
+        __m512 v2 = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *) (pVect2 + i)));
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(pVect1 + i), v2);
+        sum = _mm512_fmadd_ps(diff, diff, sum);
+    }
+    size_t left = qty - i;
+    return _mm512_reduce_add_ps(sum) + L2SqrFP16(pVect1 + i, pVect2 + i, &left);
+}
+
+static float
+L2SqrBF16AVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= qty; i += 16) {
+        __m512i wide = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *) (pVect2 + i)));
+        __m512 v2 = _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16));
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(pVect1 + i), v2);
+        sum = _mm512_fmadd_ps(diff, diff, sum);
+    }
+    size_t left = qty - i;
+    return _mm512_reduce_add_ps(sum) + L2SqrBF16(pVect1 + i, pVect2 + i, &left);
+}
+#endif
+
+#if defined(USE_AVX) && defined(__F16C__) && defined(__AVX2__)
+static float
+L2SqrFP16AVX(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= qty; i += 8) {
+        __m256 v2 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (pVect2 + i)));
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(pVect1 + i), v2);
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+    }
+    size_t left = qty - i;
+    return HorizontalSumAVX(sum) + L2SqrFP16(pVect1 + i, pVect2 + i, &left);
+}
+
+static float
+L2SqrBF16AVX(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const float *pVect1 = (const float *) pVect1v;
+    const uint16_t *pVect2 = (const uint16_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= qty; i += 8) {
+        __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (pVect2 + i)));
+        __m256 v2 = _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(pVect1 + i), v2);
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+    }
+    size_t left = qty - i;
+    return HorizontalSumAVX(sum) + L2SqrBF16(pVect1 + i, pVect2 + i, &left);
+}
+#endif
+
 class L2Space : public SpaceInterface<float> {
     DISTFUNC<float> fstdistfunc_;
+    DISTFUNC4<float> batch4func_{nullptr};
+    DISTFUNC<float> fp16func_{L2SqrFP16};
+    DISTFUNC<float> bf16func_{L2SqrBF16};
     size_t data_size_;
     size_t dim_;
 
  public:
     L2Space(size_t dim) {
         fstdistfunc_ = L2Sqr;
+#if defined(USE_AVX512)
+        if (AVX512Capable()) {
+            fp16func_ = L2SqrFP16AVX512;
+            bf16func_ = L2SqrBF16AVX512;
+        }
+#endif
+#if defined(USE_AVX) && defined(__F16C__) && defined(__AVX2__)
+        if (fp16func_ == L2SqrFP16 && AVXCapable()) {
+            fp16func_ = L2SqrFP16AVX;
+            bf16func_ = L2SqrBF16AVX;
+        }
+#endif
 #if defined(USE_SSE) || defined(USE_AVX) || defined(USE_AVX512)
     #if defined(USE_AVX512)
         if (AVX512Capable())
@@ -236,6 +507,17 @@ class L2Space : public SpaceInterface<float> {
             fstdistfunc_ = L2SqrSIMD16ExtResiduals;
         else if (dim > 4)
             fstdistfunc_ = L2SqrSIMD4ExtResiduals;
+#endif
+        if (DISTFUNC<float> specialized = L2SqrDimSpecialized(dim))
+            fstdistfunc_ = specialized;
+#if defined(USE_AVX512)
+        if (AVX512Capable())
+            batch4func_ = L2SqrBatch4AVX512;
+        else if (AVXCapable())
+            batch4func_ = L2SqrBatch4AVX;
+#elif defined(USE_AVX)
+        if (AVXCapable())
+            batch4func_ = L2SqrBatch4AVX;
 #endif
         dim_ = dim;
         data_size_ = dim * sizeof(float);
@@ -253,6 +535,18 @@ class L2Space : public SpaceInterface<float> {
         return &dim_;
     }
 
+    DISTFUNC4<float> get_dist_func_batch4() {
+        return batch4func_;
+    }
+
+    DISTFUNC<float> get_dist_func_fp16() {
+        return fp16func_;
+    }
+
+    DISTFUNC<float> get_dist_func_bf16() {
+        return bf16func_;
+    }
+
     ~L2Space() {}
 };
 
@@ -0,0 +1,331 @@
+#pragma once
+
+// Hot-path instrumentation of the searchers and the build, switched at compile time (cmake -DIRG_STATS=ON, and
+// -DIRG_STATS_PERF=ON for hardware counters). When IRG_STATS is 0 every IRG_STATS_* macro expands to nothing, so the
+// default build carries no counters, timers or thread-local lookups.
+#ifndef IRG_STATS
+#define IRG_STATS 0
+#endif
+#ifndef IRG_STATS_PERF
+#define IRG_STATS_PERF 0
+#endif
+
+#if IRG_STATS
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if IRG_STATS_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace iRangeGraph
+{
+    namespace stats
+    {
+        enum Phase
+        {
+            SEED,
+            SELECT_EDGE,
+            DISTANCE,
+            QUEUE,
+            RERANK,
+            BUILD_SEARCH,
+            BUILD_PRUNE,
+            BUILD_REVERSE,
+            PHASE_COUNT
+        };
+        // phases before FIRST_BUILD_PHASE belong to search, the others to construction
+        constexpr int FIRST_BUILD_PHASE = BUILD_SEARCH;
+        const char *const PHASE_NAMES[PHASE_COUNT] = {"seed", "select_edge", "distance", "queue", "rerank", "build_search", "build_prune", "build_reverse"};
+
+        enum Counter
+        {
+            QUERIES,
+            NEIGHBORS_SCANNED,
+            OUT_OF_RANGE,
+            ALREADY_VISITED,
+            QUEUE_INSERTS,
+            BUILD_POINTS,
+            BUILD_DISTANCES,
+            DISK_READS,
+            COUNTER_COUNT
+        };
+        const char *const COUNTER_NAMES[COUNTER_COUNT] = {"queries", "neighbors_scanned", "out_of_range", "already_visited", "queue_inserts", "build_points", "build_distances", "disk_reads"};
+
+        enum PerfEvent
+        {
+            CYCLES,
+            INSTRUCTIONS,
+            L1D_READ_MISSES,
+            LLC_MISSES,
+            PERF_COUNT
+        };
+        const char *const PERF_NAMES[PERF_COUNT] = {"cycles", "instructions", "l1d_read_misses", "llc_misses"};
+
+        struct ThreadStats
+        {
+            uint64_t counters[COUNTER_COUNT]{};
+            uint64_t phase_ticks[PHASE_COUNT]{};
+            uint64_t phase_calls[PHASE_COUNT]{};
+            uint64_t perf[PERF_COUNT]{};
+            bool perf_available{false};
+        };
+
+        // Every thread adds into its own ThreadStats without synchronization; Snapshot sums them. Blocks live as long
+        // as the registry, so counts of pool threads that have exited are kept. Reset and Snapshot should be called
+        // while no search or build is running.
+        class Registry
+        {
+        public:
+            static Registry &Get()
+            {
+                static Registry registry;
+                return registry;
+            }
+
+            ThreadStats *Register()
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                threads_.emplace_back(new ThreadStats());
+                return threads_.back().get();
+            }
+
+            ThreadStats Snapshot()
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ThreadStats total;
+                for (auto &t : threads_)
+                {
+                    for (int i = 0; i < COUNTER_COUNT; i++)
+                        total.counters[i] += t->counters[i];
+                    for (int i = 0; i < PHASE_COUNT; i++)
+                    {
+                        total.phase_ticks[i] += t->phase_ticks[i];
+                        total.phase_calls[i] += t->phase_calls[i];
+                    }
+                    for (int i = 0; i < PERF_COUNT; i++)
+                        total.perf[i] += t->perf[i];
+                    total.perf_available |= t->perf_available;
+                }
+                return total;
+            }
+
+            void Reset()
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto &t : threads_)
+                {
+                    bool perf_available = t->perf_available;
+                    *t = ThreadStats();
+                    t->perf_available = perf_available;
+                }
+            }
+
+        private:
+            std::mutex mutex_;
+            std::vector<std::unique_ptr<ThreadStats>> threads_;
+        };
+
+        inline ThreadStats &Local()
+        {
+            static thread_local ThreadStats *local = Registry::Get().Register();
+            return *local;
+        }
+
+        // TSC ticks on x86, nanoseconds elsewhere
+        inline uint64_t Ticks()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+#else
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+        }
+
+        class PhaseTimer
+        {
+        public:
+            explicit PhaseTimer(Phase phase) : phase_(phase), begin_(Ticks()) {}
+            ~PhaseTimer()
+            {
+                ThreadStats &local = Local();
+                local.phase_ticks[phase_] += Ticks() - begin_;
+                local.phase_calls[phase_]++;
+            }
+
+        private:
+            Phase phase_;
+            uint64_t begin_;
+        };
+
+#if IRG_STATS_PERF
+        // One perf_event_open group per thread, user space only. It is opened on first use and stays disabled when the
+        // kernel refuses it (perf_event_paranoid, containers), in which case no hardware counters are reported.
+        class PerfGroup
+        {
+        public:
+            static PerfGroup &Local()
+            {
+                static thread_local PerfGroup group;
+                return group;
+            }
+
+            bool read(uint64_t *values)
+            {
+                if (leader_ < 0)
+                    return false;
+                struct
+                {
+                    uint64_t nr;
+                    uint64_t values[PERF_COUNT];
+                } data;
+                if (::read(leader_, &data, sizeof(data)) != sizeof(data))
+                    return false;
+                for (int i = 0; i < PERF_COUNT; i++)
+                    values[i] = data.values[i];
+                return true;
+            }
+
+            ~PerfGroup()
+            {
+                for (int fd : fds_)
+                    close(fd);
+            }
+
+        private:
+            int leader_{-1};
+            std::vector<int> fds_;
+
+            PerfGroup()
+            {
+                const uint64_t configs[PERF_COUNT][2] = {
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}};
+                for (int i = 0; i < PERF_COUNT; i++)
+                {
+                    perf_event_attr attr{};
+                    attr.size = sizeof(attr);
+                    attr.type = configs[i][0];
+                    attr.config = configs[i][1];
+                    attr.disabled = i == 0;
+                    attr.exclude_kernel = 1;
+                    attr.exclude_hv = 1;
+                    attr.read_format = PERF_FORMAT_GROUP;
+                    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds_[0], 0);
+                    if (fd < 0)
+                    {
+                        for (int open_fd : fds_)
+                            close(open_fd);
+                        fds_.clear();
+                        return;
+                    }
+                    fds_.push_back(fd);
+                }
+                leader_ = fds_[0];
+                ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            }
+        };
+
+        // Adds the hardware events of a scope (one query) to the thread's counters
+        class PerfScope
+        {
+        public:
+            PerfScope() { ok_ = PerfGroup::Local().read(begin_); }
+            ~PerfScope()
+            {
+                uint64_t end[PERF_COUNT];
+                if (!ok_ || !PerfGroup::Local().read(end))
+                    return;
+                ThreadStats &local = Local();
+                local.perf_available = true;
+                for (int i = 0; i < PERF_COUNT; i++)
+                    local.perf[i] += end[i] - begin_[i];
+            }
+
+        private:
+            bool ok_{false};
+            uint64_t begin_[PERF_COUNT];
+        };
+#endif
+
+        inline void Print(std::ostream &os)
+        {
+            ThreadStats total = Registry::Get().Snapshot();
+            uint64_t queries = total.counters[QUERIES];
+            os << "stats:";
+            for (int i = 0; i < COUNTER_COUNT; i++)
+            {
+                if (total.counters[i])
+                    os << " " << COUNTER_NAMES[i] << "=" << total.counters[i];
+            }
+            os << std::endl;
+
+            uint64_t group_ticks[2] = {0, 0};
+            for (int i = 0; i < PHASE_COUNT; i++)
+                group_ticks[i >= FIRST_BUILD_PHASE] += total.phase_ticks[i];
+            for (int i = 0; i < PHASE_COUNT; i++)
+            {
+                if (total.phase_calls[i] == 0)
+                    continue;
+                uint64_t group = group_ticks[i >= FIRST_BUILD_PHASE];
+                os << "  phase " << std::left << std::setw(14) << PHASE_NAMES[i] << std::right
+                   << " calls=" << total.phase_calls[i]
+                   << " ticks/call=" << total.phase_ticks[i] / total.phase_calls[i]
+                   << " share=" << std::fixed << std::setprecision(1) << 100.0 * total.phase_ticks[i] / group << "%" << std::defaultfloat;
+                if (i < FIRST_BUILD_PHASE && queries)
+                    os << " ticks/query=" << total.phase_ticks[i] / queries;
+                os << std::endl;
+            }
+
+            if (total.perf_available)
+            {
+                os << "  perf";
+                for (int i = 0; i < PERF_COUNT; i++)
+                {
+                    os << " " << PERF_NAMES[i] << "=" << total.perf[i];
+                    if (queries)
+                        os << " (" << total.perf[i] / queries << "/query)";
+                }
+                os << std::endl;
+            }
+#if IRG_STATS_PERF
+            else
+                os << "  perf counters unavailable" << std::endl;
+#endif
+        }
+    }
+}
+
+#define IRG_STATS_CONCAT_(a, b) a##b
+#define IRG_STATS_CONCAT(a, b) IRG_STATS_CONCAT_(a, b)
+#define IRG_STATS_ADD(counter, n) (iRangeGraph::stats::Local().counters[iRangeGraph::stats::counter] += (n))
+#define IRG_STATS_PHASE(phase) iRangeGraph::stats::PhaseTimer IRG_STATS_CONCAT(irg_stats_phase_, __LINE__)(iRangeGraph::stats::phase)
+#define IRG_STATS_RESET() iRangeGraph::stats::Registry::Get().Reset()
+#define IRG_STATS_PRINT(os) iRangeGraph::stats::Print(os)
+#if IRG_STATS_PERF
+#define IRG_STATS_PERF_SCOPE() iRangeGraph::stats::PerfScope IRG_STATS_CONCAT(irg_stats_perf_, __LINE__)
+#else
+#define IRG_STATS_PERF_SCOPE() ((void)0)
+#endif
+
+#else
+
+#define IRG_STATS_ADD(counter, n) ((void)0)
+#define IRG_STATS_PHASE(phase) ((void)0)
+#define IRG_STATS_RESET() ((void)0)
+#define IRG_STATS_PRINT(os) ((void)0)
+#define IRG_STATS_PERF_SCOPE() ((void)0)
+
+#endif
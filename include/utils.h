@@ -1,13 +1,26 @@
 #pragma once
 
 #include "space_l2.h"
+#include "space_ip.h"
+#include "stats.h"
+#include "memory.hpp"
+#include "searcher.hpp"
+#include "half.hpp"
 #include <filesystem>
 #include <string>
 #include <cstring>
+#include <cmath>
 #include <vector>
 #include <fstream>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
 #include <map>
+#include <memory>
+#include <list>
+#include <mutex>
 
 class Exception : public std::runtime_error
 {
@@ -50,13 +63,408 @@ namespace iRangeGraph
     typedef unsigned int tableint;
     typedef unsigned int linklistsizeint;
 
+    // Distance used for construction, groundtruth and search. COSINE normalizes data and query vectors when they are
+    // loaded and then searches by inner product.
+    enum class Metric : uint32_t
+    {
+        L2 = 0,
+        IP = 1,
+        COSINE = 2
+    };
+
+    inline Metric ParseMetric(const std::string &name)
+    {
+        if (name == "l2")
+            return Metric::L2;
+        if (name == "ip")
+            return Metric::IP;
+        if (name == "cosine")
+            return Metric::COSINE;
+        throw Exception("unknown metric " + name + ", expected l2, ip or cosine");
+    }
+
+    inline std::string MetricName(Metric metric)
+    {
+        switch (metric)
+        {
+        case Metric::L2:
+            return "l2";
+        case Metric::IP:
+            return "ip";
+        case Metric::COSINE:
+            return "cosine";
+        }
+        return "unknown";
+    }
+
+    // Element type of the vectors in a .bin file; the header (count and dimension) is the same for all of them,
+    // so the type is given on the command line like the metric. F16 and BF16 are written by the converters with
+    // --dtype and widened to float32 when a file is read into a VectorSet.
+    enum class VectorDtype : uint32_t
+    {
+        F32 = 0,
+        F16 = 1,
+        BF16 = 2
+    };
+
+    inline VectorDtype ParseDtype(const std::string &name)
+    {
+        if (name == "f32")
+            return VectorDtype::F32;
+        if (name == "f16")
+            return VectorDtype::F16;
+        if (name == "bf16")
+            return VectorDtype::BF16;
+        throw Exception("unknown dtype " + name + ", expected f32, f16 or bf16");
+    }
+
+    inline size_t DtypeSize(VectorDtype dtype)
+    {
+        return dtype == VectorDtype::F32 ? sizeof(float) : sizeof(uint16_t);
+    }
+
+    // Widens n elements of type dtype at src to float32
+    inline void DecodeVector(const void *src, VectorDtype dtype, float *dst, size_t n)
+    {
+        if (dtype == VectorDtype::F16)
+            half::fp16_to_float((const uint16_t *)src, dst, n);
+        else if (dtype == VectorDtype::BF16)
+            half::bf16_to_float((const uint16_t *)src, dst, n);
+        else if (src != dst)
+            std::memcpy(dst, src, n * sizeof(float));
+    }
+
+    inline memory::PageSize ParsePageSize(const std::string &name)
+    {
+        if (name == "none")
+            return memory::PageSize::SMALL;
+        if (name == "thp")
+            return memory::PageSize::TRANSPARENT;
+        if (name == "2mb")
+            return memory::PageSize::HUGE_2MB;
+        if (name == "1gb")
+            return memory::PageSize::HUGE_1GB;
+        throw Exception("unknown huge page size " + name + ", expected none, thp, 2mb or 1gb");
+    }
+
+    inline memory::NumaPolicy ParseNumaPolicy(const std::string &name)
+    {
+        if (name == "local")
+            return memory::NumaPolicy::LOCAL;
+        if (name == "interleave")
+            return memory::NumaPolicy::INTERLEAVE;
+        if (name == "replicate")
+            return memory::NumaPolicy::REPLICATE;
+        throw Exception("unknown numa policy " + name + ", expected local, interleave or replicate");
+    }
+
+    inline hnswlib::SpaceInterface<float> *CreateSpace(Metric metric, size_t dim)
+    {
+        if (metric == Metric::L2)
+            return new hnswlib::L2Space(dim);
+        return new hnswlib::InnerProductSpace(dim);
+    }
+
+    inline void NormalizeVector(float *v, size_t dim)
+    {
+        float norm = 0;
+        for (size_t i = 0; i < dim; i++)
+            norm += v[i] * v[i];
+        if (norm == 0)
+            return;
+        norm = 1.0f / std::sqrt(norm);
+        for (size_t i = 0; i < dim; i++)
+            v[i] *= norm;
+    }
+
+    // Collects many small writes in one large buffer and hands them to the file in big chunks
+    class BufferedWriter
+    {
+    public:
+        std::ofstream outfile;
+        std::vector<char> buffer;
+        size_t used{0};
+
+        BufferedWriter(std::string filename, size_t capacity = 64 << 20) : buffer(capacity)
+        {
+            outfile.open(filename, std::ios::out | std::ios::binary);
+            if (!outfile.is_open())
+                throw Exception("cannot open " + filename);
+        }
+
+        ~BufferedWriter()
+        {
+            if (outfile.is_open())
+                close();
+        }
+
+        void write(const void *src, size_t nbytes)
+        {
+            if (used + nbytes > buffer.size())
+                flush();
+            if (nbytes > buffer.size())
+            {
+                outfile.write((const char *)src, nbytes);
+                return;
+            }
+            std::memcpy(buffer.data() + used, src, nbytes);
+            used += nbytes;
+        }
+
+        void flush()
+        {
+            outfile.write(buffer.data(), used);
+            used = 0;
+            if (!outfile)
+                throw Exception("failed to write index file");
+        }
+
+        void close()
+        {
+            flush();
+            outfile.close();
+        }
+    };
+
+    // Sequential counterpart of BufferedWriter
+    class BufferedReader
+    {
+    public:
+        std::ifstream infile;
+        std::vector<char> buffer;
+        size_t pos{0}, filled{0};
+
+        BufferedReader(std::string filename, size_t capacity = 4 << 20) : buffer(capacity)
+        {
+            infile.open(filename, std::ios::in | std::ios::binary);
+            if (!infile.is_open())
+                throw Exception("cannot open " + filename);
+        }
+
+        void read(void *dst, size_t nbytes)
+        {
+            char *p = (char *)dst;
+            while (nbytes > 0)
+            {
+                if (pos == filled)
+                {
+                    infile.read(buffer.data(), buffer.size());
+                    filled = infile.gcount();
+                    pos = 0;
+                    if (filled == 0)
+                        throw Exception("unexpected end of file");
+                }
+                size_t n = std::min(nbytes, filled - pos);
+                std::memcpy(p, buffer.data() + pos, n);
+                pos += n;
+                p += n;
+                nbytes -= n;
+            }
+        }
+    };
+
+    // How SegmentTree splits a node. BALANCED halves the node's own range, so the shape of the whole tree depends on
+    // data_nb. ALIGNED splits the power-of-two id range [0, capacity) and clips every node to the data, so appending
+    // points at the high end only adds nodes and widens the ones on the right spine.
+    enum class TreeLayout : uint32_t
+    {
+        BALANCED = 0,
+        ALIGNED = 1
+    };
+
+    // Index (edge) file: an IndexFileHeader followed by, for every point and every layer, the neighbor count and the
+    // neighbor ids, then (version 3, entries_per_node > 0) the entry points of every tree node in node_id order, again
+    // as a count and the ids. Files written before the header existed start directly with a count and are read as L2;
+    // version 1 headers stop after the metric and describe a balanced tree of unknown size.
+    constexpr uint32_t INDEX_FILE_MAGIC = 0x45475269;
+    constexpr uint32_t INDEX_FILE_VERSION = 3;
+
+    struct IndexFileHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t metric;
+        uint32_t tree_layout;
+        // number of points the index covers; 0 when unknown
+        uint32_t data_nb;
+        // most entry points stored per tree node; 0 when the file has no entry points
+        uint32_t entries_per_node;
+    };
+
+    inline void WriteIndexHeader(BufferedWriter &indexfile, Metric metric, TreeLayout tree_layout, size_t data_nb, size_t entries_per_node = 0)
+    {
+        IndexFileHeader header{INDEX_FILE_MAGIC, INDEX_FILE_VERSION, (uint32_t)metric, (uint32_t)tree_layout, (uint32_t)data_nb, (uint32_t)entries_per_node};
+        indexfile.write(&header, sizeof(header));
+    }
+
+    // Consumes the header of an index file and checks that it was built with the metric the caller searches with
+    inline IndexFileHeader ReadIndexHeader(std::ifstream &edgefile, Metric metric, std::string edgefilename)
+    {
+        IndexFileHeader header{INDEX_FILE_MAGIC, 0, (uint32_t)Metric::L2, (uint32_t)TreeLayout::BALANCED, 0, 0};
+        uint32_t magic;
+        edgefile.read((char *)&magic, sizeof(uint32_t));
+        if (magic == INDEX_FILE_MAGIC)
+        {
+            edgefile.read((char *)&header.version, sizeof(uint32_t) * 2);
+            if (header.version < 1 || header.version > INDEX_FILE_VERSION)
+                throw Exception("unsupported index version in " + edgefilename);
+            if (header.version >= 2)
+                edgefile.read((char *)&header.tree_layout, sizeof(uint32_t) * 2);
+            if (header.version >= 3)
+                edgefile.read((char *)&header.entries_per_node, sizeof(uint32_t));
+        }
+        else
+            edgefile.seekg(0);
+        if ((Metric)header.metric != metric)
+            throw Exception(edgefilename + " was built with metric " + MetricName((Metric)header.metric) + " but " + MetricName(metric) + " was requested");
+        return header;
+    }
+
+    // Fixed-dimension float vectors in one 64-byte aligned buffer, row i at data() + i * dim. Load reads a .bin file
+    // straight into place in parallel chunks instead of allocating and reading one std::vector per point.
+    class VectorSet
+    {
+    public:
+        size_t nb{0}, dim{0};
+
+        VectorSet() {}
+        VectorSet(const VectorSet &) = delete;
+        VectorSet &operator=(const VectorSet &) = delete;
+        VectorSet(VectorSet &&other) noexcept { swap(other); }
+        VectorSet &operator=(VectorSet &&other) noexcept
+        {
+            swap(other);
+            return *this;
+        }
+        ~VectorSet() { free(data_); }
+
+        void swap(VectorSet &other) noexcept
+        {
+            std::swap(nb, other.nb);
+            std::swap(dim, other.dim);
+            std::swap(data_, other.data_);
+        }
+
+        size_t size() const { return nb; }
+        float *data() { return data_; }
+        const float *data() const { return data_; }
+        float *operator[](size_t i) { return data_ + i * dim; }
+        const float *operator[](size_t i) const { return data_ + i * dim; }
+
+        void resize(size_t n, size_t d)
+        {
+            free(data_);
+            data_ = nullptr;
+            nb = n;
+            dim = d;
+            size_t nbytes = (n * d * sizeof(float) + 63) / 64 * 64;
+            if (nbytes == 0)
+                return;
+            data_ = (float *)std::aligned_alloc(64, nbytes);
+            if (data_ == nullptr)
+                throw std::runtime_error("Not enough memory");
+        }
+
+        // .bin format: 4 bytes: number of vectors; 4 bytes: dimension; nb*dim elements of type dtype. Every thread
+        // preads whole rows into their final place (16-bit rows through a staging buffer), so cosine vectors are
+        // normalized while they are still in cache. Only the rows [first, first + count) are read, clipped to the file.
+        void Load(std::string filename, Metric metric = Metric::L2, size_t first = 0, size_t count = SIZE_MAX, VectorDtype dtype = VectorDtype::F32)
+        {
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw Exception("cannot open " + filename);
+            int header[2];
+            struct stat st;
+            if (pread(fd, header, sizeof(header), 0) != sizeof(header) || fstat(fd, &st) != 0 || header[0] < 0 || header[1] <= 0)
+            {
+                close(fd);
+                throw Exception(filename + " is not a vector file");
+            }
+            if (first > (size_t)header[0])
+            {
+                close(fd);
+                throw Exception(filename + " holds fewer than " + std::to_string(first) + " vectors");
+            }
+            resize(std::min(count, header[0] - first), header[1]);
+            size_t row_bytes = dim * DtypeSize(dtype);
+            if ((size_t)st.st_size < sizeof(header) + (first + nb) * row_bytes)
+            {
+                close(fd);
+                throw Exception(filename + " is truncated");
+            }
+            if (dtype != VectorDtype::F32 && (size_t)st.st_size == sizeof(header) + (size_t)header[0] * header[1] * sizeof(float))
+            {
+                close(fd);
+                throw Exception(filename + " holds float32 vectors; drop --dtype or convert it");
+            }
+
+            size_t rows_per_chunk = std::max<size_t>(1, (16 << 20) / row_bytes);
+            long long chunks = (nb + rows_per_chunk - 1) / rows_per_chunk;
+            bool failed = false;
+#pragma omp parallel for schedule(dynamic)
+            for (long long c = 0; c < chunks; c++)
+            {
+                size_t begin = c * rows_per_chunk, end = std::min(nb, begin + rows_per_chunk);
+                size_t left = (end - begin) * row_bytes;
+                static thread_local std::vector<char> staging;
+                if (dtype != VectorDtype::F32)
+                    staging.resize(left);
+                char *dst = dtype == VectorDtype::F32 ? (char *)(*this)[begin] : staging.data();
+                const char *rows = dst;
+                off_t offset = sizeof(header) + (first + begin) * row_bytes;
+                while (left > 0)
+                {
+                    ssize_t n = pread(fd, dst, left, offset);
+                    if (n <= 0)
+                        break;
+                    dst += n;
+                    offset += n;
+                    left -= n;
+                }
+                if (left > 0)
+                {
+#pragma omp atomic write
+                    failed = true;
+                    continue;
+                }
+                DecodeVector(rows, dtype, (*this)[begin], (end - begin) * dim);
+                if (metric == Metric::COSINE)
+                {
+                    for (size_t i = begin; i < end; i++)
+                        NormalizeVector((*this)[i], dim);
+                }
+            }
+            close(fd);
+            if (failed)
+                throw Exception("failed to read " + filename);
+        }
+
+        // Row i becomes the current row order[i]
+        void Permute(const std::vector<int> &order)
+        {
+            VectorSet permuted;
+            permuted.resize(order.size(), dim);
+#pragma omp parallel for
+            for (long long i = 0; i < (long long)order.size(); i++)
+                std::memcpy(permuted[i], (*this)[order[i]], dim * sizeof(float));
+            swap(permuted);
+        }
+
+    private:
+        float *data_{nullptr};
+    };
+
     class DataLoader
     {
     public:
         int Dim, query_nb, query_K;
-        std::vector<std::vector<float>> query_points;
+        VectorSet query_points;
         int data_nb;
-        std::vector<std::vector<float>> data_points;
+        VectorSet data_points;
+        // Set before loading; cosine vectors are normalized as they are read
+        Metric metric{Metric::L2};
+        // Element type of the data file; query files are always float32
+        VectorDtype dtype{VectorDtype::F32};
         std::unordered_map<int, std::vector<std::pair<int, int>>> query_range;
         std::unordered_map<int, std::vector<std::vector<int>>> groundtruth;
 
@@ -66,35 +474,18 @@ namespace iRangeGraph
         // query vector filename format: 4 bytes: query number; 4 bytes: dimension; query_nb*Dim vectors
         void LoadQuery(std::string filename)
         {
-            std::ifstream infile(filename, std::ios::in | std::ios::binary);
-            if (!infile.is_open())
-                throw Exception("cannot open " + filename);
-            infile.read((char *)&query_nb, sizeof(int));
-            infile.read((char *)&Dim, sizeof(int));
-            query_points.resize(query_nb);
-            for (int i = 0; i < query_nb; i++)
-            {
-                query_points[i].resize(Dim);
-                infile.read((char *)query_points[i].data(), Dim * sizeof(float));
-            }
-            infile.close();
+            query_points.Load(filename, metric);
+            query_nb = query_points.size();
+            Dim = query_points.dim;
         }
 
-        // Used only when computing groundtruth and constructing index. Do not use this to load data for search process
-        void LoadData(std::string filename)
+        // Used only when computing groundtruth and constructing index. Do not use this to load data for search process.
+        // first and count select a contiguous slice of the file, e.g., one shard.
+        void LoadData(std::string filename, size_t first = 0, size_t count = SIZE_MAX)
         {
-            std::ifstream infile(filename, std::ios::in | std::ios::binary);
-            if (!infile.is_open())
-                throw Exception("cannot open " + filename);
-            infile.read((char *)&data_nb, sizeof(int));
-            infile.read((char *)&Dim, sizeof(int));
-            data_points.resize(data_nb);
-            for (int i = 0; i < data_nb; i++)
-            {
-                data_points[i].resize(Dim);
-                infile.read((char *)data_points[i].data(), Dim * sizeof(float));
-            }
-            infile.close();
+            data_points.Load(filename, metric, first, count, dtype);
+            data_nb = data_points.size();
+            Dim = data_points.dim;
         }
 
         // By default generation, 0.bin~9.bin denotes 2^0~2^-9 range fractions, 17.bin denotes mixed range fraction.
@@ -143,11 +534,104 @@ namespace iRangeGraph
         }
     };
 
+    // Exact top-k of every query i over the ids ranges[i].first ... ranges[i].second that pass accept(i, pid). Queries
+    // are sorted by range start and taken in tiles of 16; a tile walks the union of its ranges in blocks of about
+    // 256 KB of vectors, so each block is scored against all queries of the tile while it is in cache. Tiles run in
+    // parallel and distances use the space's batched kernel. results[i] lists ids from the farthest to the nearest,
+    // the order in which the groundtruth files store them.
+    template <typename Accept>
+    std::vector<std::vector<int>> ExactRangeTopK(const VectorSet &queries, const VectorSet &data, const std::vector<std::pair<int, int>> &ranges, int k, Metric metric, Accept accept, int threads = omp_get_max_threads())
+    {
+        std::unique_ptr<hnswlib::SpaceInterface<float>> space(CreateSpace(metric, data.dim));
+        hnswlib::DISTFUNC<float> distfunc = space->get_dist_func();
+        hnswlib::DISTFUNC4<float> batchfunc = space->get_dist_func_batch4();
+        void *param = space->get_dist_func_param();
+
+        const int query_tile = 16;
+        const int data_tile = std::max<int>(64, (256 << 10) / (data.dim * sizeof(float)));
+
+        std::vector<int> order(ranges.size());
+        for (int i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&](int a, int b)
+                  { return ranges[a].first < ranges[b].first; });
+
+        std::vector<std::vector<int>> results(ranges.size());
+        int tiles = (ranges.size() + query_tile - 1) / query_tile;
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+        for (int t = 0; t < tiles; t++)
+        {
+            int tile_begin = t * query_tile, tile_end = std::min((int)ranges.size(), tile_begin + query_tile);
+            std::vector<std::priority_queue<PFI>> heaps(tile_end - tile_begin);
+            std::vector<int> ids(data_tile);
+            int lo = data.size(), hi = -1;
+            for (int q = tile_begin; q < tile_end; q++)
+            {
+                lo = std::min(lo, ranges[order[q]].first);
+                hi = std::max(hi, ranges[order[q]].second);
+            }
+
+            for (int block = lo; block <= hi; block += data_tile)
+            {
+                int block_end = std::min(hi, block + data_tile - 1);
+                for (int q = tile_begin; q < tile_end; q++)
+                {
+                    int qid = order[q];
+                    int l = std::max(block, ranges[qid].first), r = std::min(block_end, ranges[qid].second);
+                    int n = 0;
+                    for (int pid = l; pid <= r; pid++)
+                    {
+                        if (accept(qid, pid))
+                            ids[n++] = pid;
+                    }
+
+                    std::priority_queue<PFI> &ans = heaps[q - tile_begin];
+                    auto offer = [&](float dis, int pid)
+                    {
+                        if (ans.size() < k)
+                            ans.emplace(dis, pid);
+                        else if (PFI(dis, pid) < ans.top())
+                        {
+                            ans.emplace(dis, pid);
+                            ans.pop();
+                        }
+                    };
+                    int i = 0;
+                    if (batchfunc != nullptr)
+                    {
+                        float dists[4];
+                        for (; i + 4 <= n; i += 4)
+                        {
+                            const void *vecs[4] = {data[ids[i]], data[ids[i + 1]], data[ids[i + 2]], data[ids[i + 3]]};
+                            batchfunc(queries[qid], vecs, param, dists);
+                            for (int j = 0; j < 4; j++)
+                                offer(dists[j], ids[i + j]);
+                        }
+                    }
+                    for (; i < n; i++)
+                        offer(distfunc(queries[qid], data[ids[i]], param), ids[i]);
+                }
+            }
+
+            for (int q = tile_begin; q < tile_end; q++)
+            {
+                std::priority_queue<PFI> &ans = heaps[q - tile_begin];
+                std::vector<int> &res = results[order[q]];
+                while (ans.size())
+                {
+                    res.push_back(ans.top().second);
+                    ans.pop();
+                }
+            }
+        }
+        return results;
+    }
+
     class QueryGenerator
     {
     public:
         int data_nb, query_nb;
-        hnswlib::L2Space *space;
+        hnswlib::SpaceInterface<float> *space;
 
         QueryGenerator(int data_num, int query_num) : data_nb(data_num), query_nb(query_num) {}
         ~QueryGenerator() {}
@@ -220,16 +704,15 @@ namespace iRangeGraph
             outfile.close();
         }
 
-        float dis_compute(std::vector<float> &v1, std::vector<float> &v2)
+        float dis_compute(const float *v1, const float *v2)
         {
             hnswlib::DISTFUNC<float> fstdistfunc_ = space->get_dist_func();
-            float dis = fstdistfunc_((char *)v1.data(), (char *)v2.data(), space->get_dist_func_param());
+            float dis = fstdistfunc_(v1, v2, space->get_dist_func_param());
             return dis;
         }
 
-        void GenerateGroundtruth(std::string saveprefix, DataLoader &storage)
+        void GenerateGroundtruth(std::string saveprefix, DataLoader &storage, int threads = omp_get_max_threads())
         {
-            space = new hnswlib::L2Space(storage.Dim);
             for (auto t : storage.query_range)
             {
                 int suffix = t.first;
@@ -239,30 +722,50 @@ namespace iRangeGraph
                 if (!outfile.is_open())
                     throw Exception("cannot open " + savepath);
                 std::cout << "generating for " << t.first << std::endl;
-                for (int i = 0; i < query_nb; i++)
-                {
-                    auto rp = t.second[i];
-                    int ql = rp.first, qr = rp.second;
-                    std::priority_queue<std::pair<float, int>> ans;
-                    for (int j = ql; j <= qr; j++)
-                    {
-                        float dis = dis_compute(storage.query_points[i], storage.data_points[j]);
-                        ans.emplace(dis, j);
-                        if (ans.size() > storage.query_K)
-                            ans.pop();
-                    }
-                    while (ans.size())
-                    {
-                        auto id = ans.top().second;
-                        ans.pop();
-                        outfile.write((char *)&id, sizeof(int));
-                    }
-                }
+                auto results = ExactRangeTopK(storage.query_points, storage.data_points, t.second, storage.query_K, storage.metric, [](int, int)
+                                              { return true; }, threads);
+                for (auto &ids : results)
+                    outfile.write((char *)ids.data(), ids.size() * sizeof(int));
                 outfile.close();
             }
         }
     };
 
+    // Per-call search state: visited list, RNG and counters. Keeping one context per thread lets a single
+    // loaded index serve concurrent queries without sharing any mutable state.
+    class SearchContext
+    {
+    public:
+        hnswlib::VisitedListPool *pool{nullptr};
+        hnswlib::VisitedList *visited{nullptr};
+        std::default_random_engine e;
+
+        size_t metric_distance_computations{0};
+        size_t metric_hops{0};
+        // points marked visited, and tree layers whose links SelectEdge walked
+        size_t metric_visited{0};
+        size_t metric_layers{0};
+        // reads issued to fetch re-ranking vectors from disk
+        size_t metric_disk_reads{0};
+
+        // Distances of the neighbors selected by one expansion, kept across queries to avoid an allocation per search
+        std::vector<float> dists;
+        // Candidate pool of the LINEAR_POOL engine, reset to each query's ef
+        searcher::LinearPool linear_pool{0};
+
+        // To fix the starting points across runs, pass a fixed seed, e.g., seed = 0
+        SearchContext(hnswlib::VisitedListPool *visited_pool, unsigned seed = std::chrono::system_clock::now().time_since_epoch().count())
+            : pool(visited_pool), visited(visited_pool->getFreeVisitedList()), e(seed) {}
+
+        ~SearchContext()
+        {
+            pool->releaseVisitedList(visited);
+        }
+
+        SearchContext(const SearchContext &) = delete;
+        SearchContext &operator=(const SearchContext &) = delete;
+    };
+
     class TreeNode
     {
     public:
@@ -273,6 +776,122 @@ namespace iRangeGraph
         TreeNode(int l, int r, int d) : lbound(l), rbound(r), depth(d) {}
     };
 
+    // Entry points of the tree nodes, chosen at build time among each node's own points: those of node u are
+    // ids[offsets[u->node_id]] up to ids[offsets[u->node_id + 1]]. Nodes without any are seeded at random.
+    class NodeEntries
+    {
+    public:
+        std::vector<size_t> offsets{0};
+        std::vector<int> ids;
+
+        bool empty() const { return ids.empty(); }
+        const int *begin(const TreeNode *u) const { return ids.data() + offsets[u->node_id]; }
+        const int *end(const TreeNode *u) const { return ids.data() + offsets[u->node_id + 1]; }
+
+        void Assign(const std::vector<std::vector<int>> &per_node)
+        {
+            offsets.assign(1, 0);
+            ids.clear();
+            for (auto &entries : per_node)
+            {
+                ids.insert(ids.end(), entries.begin(), entries.end());
+                offsets.emplace_back(ids.size());
+            }
+        }
+
+        size_t MaxPerNode() const
+        {
+            size_t most = 0;
+            for (size_t node = 0; node + 1 < offsets.size(); node++)
+                most = std::max(most, offsets[node + 1] - offsets[node]);
+            return most;
+        }
+
+        // Writer is a BufferedWriter or an std::ostream
+        template <typename Writer>
+        void Write(Writer &file) const
+        {
+            for (size_t node = 0; node + 1 < offsets.size(); node++)
+            {
+                int count = offsets[node + 1] - offsets[node];
+                file.write((const char *)&count, sizeof(int));
+                file.write((const char *)(ids.data() + offsets[node]), count * sizeof(int));
+            }
+        }
+
+        void Read(std::istream &file, size_t nodes, size_t data_nb, std::string filename)
+        {
+            offsets.assign(1, 0);
+            ids.clear();
+            for (size_t node = 0; node < nodes; node++)
+            {
+                int count = 0;
+                file.read((char *)&count, sizeof(int));
+                if (!file || count < 0)
+                    throw Exception(filename + " has a truncated entry point section");
+                ids.resize(offsets.back() + count);
+                file.read((char *)(ids.data() + offsets.back()), count * sizeof(int));
+                offsets.emplace_back(ids.size());
+            }
+            if (!file)
+                throw Exception(filename + " has a truncated entry point section");
+            for (int id : ids)
+            {
+                if (id < 0 || id >= data_nb)
+                    throw Exception(filename + " has an entry point outside the data");
+            }
+        }
+    };
+
+    // Canonical cover of a query range [ql, qr] and, for every covering node, the layers whose edges a point below it
+    // uses during search: each ancestor where the overlap with the range shrinks on the way down, then the covering
+    // node itself. All points under one covering node share this list, so it is built once per query and a hop only
+    // costs a binary search over the (at most 2 * depth) covering nodes.
+    class RangeCover
+    {
+    public:
+        int ql{0}, qr{-1};
+        // sorted by lbound
+        std::vector<TreeNode *> nodes;
+        std::vector<int> layer_offsets{0};
+        std::vector<int> layers;
+        // shrinking ancestors on the current root path while the cover is collected
+        std::vector<int> path;
+
+        void clear()
+        {
+            nodes.clear();
+            layer_offsets.assign(1, 0);
+            layers.clear();
+            path.clear();
+        }
+
+        // Index of the covering node holding pid, which must lie inside [ql, qr]
+        int find(int pid) const
+        {
+            int lo = 0, hi = nodes.size() - 1;
+            while (lo < hi)
+            {
+                int mid = (lo + hi + 1) >> 1;
+                if (nodes[mid]->lbound <= pid)
+                    lo = mid;
+                else
+                    hi = mid - 1;
+            }
+            return lo;
+        }
+
+        const int *layers_begin(int i) const
+        {
+            return layers.data() + layer_offsets[i];
+        }
+
+        const int *layers_end(int i) const
+        {
+            return layers.data() + layer_offsets[i + 1];
+        }
+    };
+
     class SegmentTree
     {
     public:
@@ -280,22 +899,49 @@ namespace iRangeGraph
         TreeNode *root{nullptr};
         int max_depth{-1};
         std::vector<TreeNode *> treenodes;
+        TreeLayout layout{TreeLayout::BALANCED};
+        // ALIGNED: the smallest power of ways_ not below data_nb; a node at depth d spans capacity / ways_^d ids
+        size_t capacity{0};
 
-        SegmentTree(int data_nb)
+        SegmentTree(int data_nb, TreeLayout tree_layout = TreeLayout::BALANCED) : layout(tree_layout)
         {
             root = new TreeNode(0, data_nb - 1, 0);
+            if (layout == TreeLayout::ALIGNED)
+                capacity = AlignedCapacity(data_nb, ways_);
+        }
+
+        static size_t AlignedCapacity(size_t data_nb, int ways)
+        {
+            size_t capacity = 1;
+            while (capacity < data_nb)
+                capacity *= ways;
+            return capacity;
         }
 
         void BuildTree(TreeNode *u)
         {
             if (u == nullptr)
                 throw Exception("Tree node is a nullptr");
+            u->node_id = treenodes.size();
             treenodes.emplace_back(u);
             max_depth = std::max(max_depth, u->depth);
             int L = u->lbound, R = u->rbound;
             size_t Len = R - L + 1;
             if (L == R)
                 return;
+            if (layout == TreeLayout::ALIGNED)
+            {
+                size_t span = capacity;
+                for (int d = 0; d <= u->depth; d++)
+                    span /= ways_;
+                for (size_t l = L; l <= (size_t)R; l += span)
+                {
+                    TreeNode *childnode = new TreeNode(l, std::min(l + span - 1, (size_t)R), u->depth + 1);
+                    u->childs.emplace_back(childnode);
+                    BuildTree(childnode);
+                }
+                return;
+            }
             int gap = (R - L + 1) / ways_;
             int res = (R - L + 1) % ways_;
 
@@ -315,25 +961,103 @@ namespace iRangeGraph
             }
         }
 
-        std::vector<TreeNode *> range_filter(TreeNode *u, int ql, int qr)
+        std::vector<TreeNode *> range_filter(TreeNode *u, int ql, int qr) const
         {
+            RangeCover cover;
+            cover.ql = ql;
+            cover.qr = qr;
+            if (ql <= qr)
+                collect_cover(u, cover);
+            return cover.nodes;
+        }
+
+        // Fills cover for [ql, qr], reusing its buffers
+        void range_cover(int ql, int qr, RangeCover &cover) const
+        {
+            cover.clear();
+            cover.ql = ql;
+            cover.qr = qr;
+            if (ql <= qr)
+                collect_cover(root, cover);
+        }
+
+    private:
+        void collect_cover(TreeNode *u, RangeCover &cover) const
+        {
+            int ql = cover.ql, qr = cover.qr;
             if (u->lbound >= ql && u->rbound <= qr)
-                return {u};
-            std::vector<TreeNode *> res;
-            if (u->lbound > qr)
-                return res;
-            if (u->rbound < ql)
-                return res;
+            {
+                cover.nodes.emplace_back(u);
+                cover.layers.insert(cover.layers.end(), cover.path.begin(), cover.path.end());
+                cover.layers.emplace_back(u->depth);
+                cover.layer_offsets.emplace_back(cover.layers.size());
+                return;
+            }
+            int overlap = std::min(u->rbound, qr) - std::max(u->lbound, ql) + 1;
             for (auto child : u->childs)
             {
-                auto t = range_filter(child, ql, qr);
-                while (t.size())
+                if (child->rbound < ql || child->lbound > qr)
+                    continue;
+                bool shrink = std::min(child->rbound, qr) - std::max(child->lbound, ql) + 1 != overlap;
+                if (shrink)
+                    cover.path.emplace_back(u->depth);
+                collect_cover(child, cover);
+                if (shrink)
+                    cover.path.pop_back();
+            }
+        }
+    };
+
+    // LRU cache of range covers keyed by [ql, qr], shared by all search threads. A cover holds the covering nodes
+    // and the layers SelectEdge walks for each of them, so a hit skips the tree descent; entry points are read per
+    // covering node and need no caching. A returned cover stays valid after its eviction.
+    class RangeCoverCache
+    {
+    public:
+        size_t hits{0}, misses{0};
+
+        RangeCoverCache(const SegmentTree *segment_tree, size_t capacity) : tree(segment_tree), capacity_(capacity)
+        {
+            if (capacity_ == 0)
+                throw Exception("range cover cache capacity should be positive");
+        }
+
+        std::shared_ptr<const RangeCover> Get(int ql, int qr)
+        {
+            uint64_t key = ((uint64_t)(uint32_t)ql << 32) | (uint32_t)qr;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = index_.find(key);
+                if (it != index_.end())
                 {
-                    res.emplace_back(t.back());
-                    t.pop_back();
+                    hits++;
+                    entries_.splice(entries_.begin(), entries_, it->second);
+                    return it->second->second;
                 }
+                misses++;
+            }
+            // collected outside the lock; two threads missing on one range both collect it and the second insert is dropped
+            std::shared_ptr<RangeCover> cover = std::make_shared<RangeCover>();
+            tree->range_cover(ql, qr, *cover);
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (index_.count(key))
+                return cover;
+            entries_.emplace_front(key, cover);
+            index_[key] = entries_.begin();
+            if (entries_.size() > capacity_)
+            {
+                index_.erase(entries_.back().first);
+                entries_.pop_back();
             }
-            return res;
+            return cover;
         }
+
+    private:
+        const SegmentTree *tree;
+        size_t capacity_;
+        std::mutex mutex_;
+        // most recently used first
+        std::list<std::pair<uint64_t, std::shared_ptr<const RangeCover>>> entries_;
+        std::unordered_map<uint64_t, std::list<std::pair<uint64_t, std::shared_ptr<const RangeCover>>>::iterator> index_;
     };
 }
\ No newline at end of file
@@ -1,9 +1,16 @@
 #include "utils.h"
+#include <numeric>
 
 namespace iRangeGraph_multi
 {
     typedef std::pair<float, int> PFI;
 
+    // File of the index that buildindex_multi builds over the points sorted by attribute aid
+    inline std::string MultiIndexPath(const std::string &index_prefix, int aid)
+    {
+        return index_prefix + "attr" + std::to_string(aid) + ".bin";
+    }
+
     struct TwoRangeQuery
     {
         int l1, r1, l2, r2;
@@ -13,15 +20,19 @@ namespace iRangeGraph_multi
     {
     public:
         int Dim, query_nb, query_K;
-        std::vector<std::vector<float>> query_points;
+        iRangeGraph::VectorSet query_points;
         int data_nb;
-        std::vector<std::vector<float>> data_points;
+        iRangeGraph::VectorSet data_points;
         std::vector<int> original_id;
+        // Set before loading; cosine vectors are normalized as they are read
+        iRangeGraph::Metric metric{iRangeGraph::Metric::L2};
 
         int attr_nb{0};
         std::vector<std::vector<int>> attributes;
+        // Attribute the ids were sorted by in Sort_by_Attr, -1 before sorting
+        int sorted_attr{-1};
 
-        hnswlib::L2Space *space;
+        hnswlib::SpaceInterface<float> *space;
 
         struct Attr_Constraint
         {
@@ -31,50 +42,30 @@ namespace iRangeGraph_multi
         std::unordered_map<std::string, std::vector<Attr_Constraint>> query_range;
         std::unordered_map<std::string, std::vector<std::vector<int>>> ground_truth;
 
-        std::unordered_map<std::string, std::vector<std::pair<int, int>>> mapped_queryrange;
-
         DataLoader() {}
         ~DataLoader() {}
 
-        float dis_compute(std::vector<float> &v1, std::vector<float> &v2)
+        float dis_compute(const float *v1, const float *v2)
         {
             hnswlib::DISTFUNC<float> fstdistfunc_ = space->get_dist_func();
-            float dis = fstdistfunc_((char *)v1.data(), (char *)v2.data(), space->get_dist_func_param());
+            float dis = fstdistfunc_(v1, v2, space->get_dist_func_param());
             return dis;
         }
 
         void LoadQuery(std::string filename)
         {
-            std::ifstream infile(filename, std::ios::in | std::ios::binary);
-            if (!infile.is_open())
-                throw Exception("cannot open " + filename);
-            infile.read((char *)&query_nb, sizeof(int));
-            infile.read((char *)&Dim, sizeof(int));
-            query_points.resize(query_nb);
-            for (int i = 0; i < query_nb; i++)
-            {
-                query_points[i].resize(Dim);
-                infile.read((char *)query_points[i].data(), Dim * sizeof(float));
-            }
-            space = new hnswlib::L2Space(Dim);
-            infile.close();
+            query_points.Load(filename, metric);
+            query_nb = query_points.size();
+            Dim = query_points.dim;
+            space = iRangeGraph::CreateSpace(metric, Dim);
         }
 
         void LoadData(std::string filename)
         {
-            std::ifstream infile(filename, std::ios::in | std::ios::binary);
-            if (!infile.is_open())
-                throw Exception("cannot open " + filename);
-            infile.read((char *)&data_nb, sizeof(int));
-            infile.read((char *)&Dim, sizeof(int));
-            data_points.resize(data_nb);
-            for (int i = 0; i < data_nb; i++)
-            {
-                data_points[i].resize(Dim);
-                infile.read((char *)data_points[i].data(), Dim * sizeof(float));
-            }
+            data_points.Load(filename, metric);
+            data_nb = data_points.size();
+            Dim = data_points.dim;
             attributes.resize(data_nb);
-            infile.close();
         }
 
         void LoadAttribute(std::string filename)
@@ -160,7 +151,8 @@ namespace iRangeGraph_multi
             infile.close();
         }
 
-        void Generate_Groundtruth(std::string saveprefix)
+        // Points of the unsorted data that satisfy every attribute constraint of a query; missing results are -1
+        void Generate_Groundtruth(std::string saveprefix, int threads = omp_get_max_threads())
         {
             for (auto t : query_range)
             {
@@ -172,34 +164,23 @@ namespace iRangeGraph_multi
                 {
                     throw Exception("cannot open " + savepath);
                 }
-                for (int i = 0; i < query_nb; i++)
+                std::vector<Attr_Constraint> &constraints = t.second;
+                std::vector<std::pair<int, int>> ranges(query_nb, {0, data_nb - 1});
+                auto accept = [&](int qid, int pid)
                 {
-                    auto constraints = t.second[i];
-                    std::priority_queue<std::pair<float, int>> ans;
-                    for (int pid = 0; pid < data_nb; pid++)
+                    for (int j = 0; j < attr_nb; j++)
                     {
-                        bool flag = true;
-                        for (int j = 0; j < attr_nb; j++)
-                        {
-                            int ql = constraints.attr_constraints[j].first, qr = constraints.attr_constraints[j].second;
-                            if (attributes[pid][j] < ql || attributes[pid][j] > qr)
-                                flag = false;
-                        }
-                        if (!flag)
-                            continue;
-                        float dis = dis_compute(query_points[i], data_points[pid]);
-                        ans.emplace(dis, pid);
-                        if (ans.size() > query_K)
-                            ans.pop();
-                    }
-                    while (ans.size() < query_K)
-                        ans.emplace(0, -1);
-                    while (ans.size())
-                    {
-                        auto id = ans.top().second;
-                        ans.pop();
-                        outfile.write((char *)&id, sizeof(int));
+                        const std::pair<int, int> &bound = constraints[qid].attr_constraints[j];
+                        if (attributes[pid][j] < bound.first || attributes[pid][j] > bound.second)
+                            return false;
                     }
+                    return true;
+                };
+                auto results = iRangeGraph::ExactRangeTopK(query_points, data_points, ranges, query_K, metric, accept, threads);
+                for (auto &ids : results)
+                {
+                    ids.resize(query_K, -1);
+                    outfile.write((char *)ids.data(), query_K * sizeof(int));
                 }
                 outfile.close();
             }
@@ -226,6 +207,8 @@ namespace iRangeGraph_multi
             }
         }
 
+        // May be called again with another attribute: data_points is re-permuted from the current order, and
+        // original_id always describes the latest sort
         void Sort_by_Attr(int aid)
         {
             if (aid >= attr_nb)
@@ -236,29 +219,20 @@ namespace iRangeGraph_multi
                 p.push_back({attributes[i][aid], i});
             }
             sort(p.begin(), p.end());
-            std::vector<std::vector<float>> vec_tmp;
-            vec_tmp.resize(data_nb);
+            std::vector<int> order(data_nb);
+            // position[id]: where point id currently is in data_points
+            std::vector<int> position(data_nb);
+            std::iota(position.begin(), position.end(), 0);
+            for (int i = 0; i < (int)original_id.size(); i++)
+                position[original_id[i]] = i;
             original_id.resize(data_nb);
-
             for (int i = 0; i < data_nb; i++)
             {
-                int pid = p[i].second;
-                original_id[i] = pid;
-                vec_tmp[i] = data_points[pid];
-            }
-            std::swap(data_points, vec_tmp);
-            for (auto t : query_range)
-            {
-                std::string domain = t.first;
-                for (int qid = 0; qid < query_nb; qid++)
-                {
-                    int ql = t.second[qid].attr_constraints[aid].first;
-                    int qr = t.second[qid].attr_constraints[aid].second;
-                    int l_bound = std::lower_bound(p.begin(), p.end(), std::make_pair(ql, -1)) - p.begin();
-                    int r_bound = std::upper_bound(p.begin(), p.end(), std::make_pair(qr, data_nb)) - p.begin() - 1;
-                    mapped_queryrange[domain].emplace_back(l_bound, r_bound);
-                }
+                original_id[i] = p[i].second;
+                order[i] = position[p[i].second];
             }
+            data_points.Permute(order);
+            sorted_attr = aid;
             std::cout << "sorted data points by " << aid << "th attribute" << std::endl;
         }
     };
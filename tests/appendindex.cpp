@@ -0,0 +1,57 @@
+#include "construction.h"
+
+std::unordered_map<std::string, std::string> paths;
+
+int M;
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
+int ef_construction;
+int threads;
+int entries = 4;
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--data_path")
+            paths["data_vector"] = argv[i + 1];
+        if (arg == "--index_file")
+            paths["index"] = argv[i + 1];
+        if (arg == "--new_index_file")
+            paths["index_save"] = argv[i + 1];
+        if (arg == "--M")
+            M = std::stoi(argv[i + 1]);
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
+        if (arg == "--ef_construction")
+            ef_construction = std::stoi(argv[i + 1]);
+        if (arg == "--threads")
+            threads = std::stoi(argv[i + 1]);
+        if (arg == "--entries")
+            entries = std::stoi(argv[i + 1]);
+    }
+
+    if (paths["data_vector"] == "")
+        throw Exception("data path is empty");
+    if (paths["index"] == "")
+        throw Exception("index path is empty");
+    // the updated index replaces the old one unless another path is given
+    if (paths["index_save"] == "")
+        paths["index_save"] = paths["index"];
+    if (M <= 0)
+        throw Exception("M should be a positive integer");
+    if (ef_construction <= 0)
+        throw Exception("ef_construction should be a positive integer");
+    if (threads <= 0)
+        throw Exception("threads should be a positive integer");
+    if (entries < 0)
+        throw Exception("entries should be a non-negative integer");
+
+    iRangeGraph::DataLoader storage;
+    storage.metric = metric;
+    storage.LoadData(paths["data_vector"]);
+    iRangeGraph::iRangeGraph_Build<float> index(&storage, M, ef_construction, iRangeGraph::TreeLayout::ALIGNED);
+    index.max_threads = threads;
+    index.entries_per_node = entries;
+    index.appendandsave(paths["index"], paths["index_save"]);
+}
@@ -0,0 +1,397 @@
+#include <chrono>
+#include <sstream>
+#include <omp.h>
+#include "iRG_search.h"
+
+// Latency percentiles and per-query counters of the single-attribute searcher, one row per range fraction, ef and
+// cache mode, written as CSV or JSON so that runs of different index variants and thread counts can be compared.
+
+std::unordered_map<std::string, std::string> paths;
+
+const int query_K = 10;
+int M;
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
+int threads = 1;
+bool generate = false;
+bool sq8 = false;
+iRangeGraph::VectorDtype dtype = iRangeGraph::VectorDtype::F32;
+iRangeGraph::VectorStorage vector_storage = iRangeGraph::VectorStorage::FP32;
+bool compact_links = false;
+bool linear_pool = false;
+bool random_entries = false;
+int patience = 0;
+int scan_threshold = 0;
+memory::Placement placement;
+int reorder_block = 0;
+int cover_cache = 0;
+int evict_mb = 64;
+std::string cache_mode = "warm";
+std::string format;
+std::string label;
+std::vector<int> SearchEF = {10, 20, 40, 80, 160, 320, 640};
+
+struct QueryStats
+{
+    double latency_us;
+    size_t dco, hops, visited, layers, disk_reads;
+};
+
+struct Distribution
+{
+    double mean{0};
+    std::vector<double> sorted;
+
+    explicit Distribution(std::vector<double> values) : sorted(std::move(values))
+    {
+        std::sort(sorted.begin(), sorted.end());
+        for (double v : sorted)
+            mean += v;
+        if (!sorted.empty())
+            mean /= sorted.size();
+    }
+
+    // nearest-rank percentile
+    double percentile(double p) const
+    {
+        if (sorted.empty())
+            return 0;
+        long rank = (long)std::ceil(p / 100 * sorted.size()) - 1;
+        rank = std::min(std::max(rank, 0L), (long)sorted.size() - 1);
+        return sorted[rank];
+    }
+};
+
+template <typename Field>
+Distribution Collect(const std::vector<QueryStats> &stats, Field field)
+{
+    std::vector<double> values;
+    values.reserve(stats.size());
+    for (const QueryStats &s : stats)
+        values.push_back(field(s));
+    return Distribution(values);
+}
+
+// Streams over a buffer larger than the last-level cache so that the next query starts with cold CPU caches
+class CacheEvictor
+{
+public:
+    std::vector<char> buffer;
+    size_t sink{0};
+
+    explicit CacheEvictor(size_t nbytes) : buffer(nbytes, 1) {}
+
+    void evict()
+    {
+        for (size_t i = 0; i < buffer.size(); i += 64)
+        {
+            sink += buffer[i];
+            buffer[i] = (char)sink;
+        }
+    }
+};
+
+std::vector<int> ParseIntList(const std::string &text)
+{
+    std::vector<int> values;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        values.push_back(std::stoi(item));
+    if (values.empty())
+        throw Exception("empty list " + text);
+    return values;
+}
+
+std::string JsonString(const std::string &s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+// Runs every query once and times it on its own; cold evicts the CPU caches before each query and runs on one thread
+std::vector<QueryStats> RunQueries(iRangeGraph::iRangeGraph_Search<float> &index, iRangeGraph::DataLoader &storage, const std::vector<std::pair<int, int>> &ranges, int ef, bool cold, CacheEvictor *evictor, std::vector<std::priority_queue<iRangeGraph::PFI>> &results, double &wall_seconds)
+{
+    std::vector<QueryStats> stats(storage.query_nb);
+    results.assign(storage.query_nb, std::priority_queue<iRangeGraph::PFI>());
+    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+    double busy_seconds = 0;
+    auto wall_begin = std::chrono::steady_clock::now();
+
+#pragma omp parallel num_threads(cold ? 1 : threads) reduction(+ : busy_seconds)
+    {
+        memory::NodePin pin(index.ReplicaSlot(omp_get_thread_num()));
+        iRangeGraph::SearchContext ctx(index.visited_list_pool_.get(), seed + omp_get_thread_num());
+        iRangeGraph::RangeCover scratch;
+        std::shared_ptr<const iRangeGraph::RangeCover> hold;
+#pragma omp for schedule(dynamic, 1)
+        for (int i = 0; i < storage.query_nb; i++)
+        {
+            if (cold)
+                evictor->evict();
+            size_t dco = ctx.metric_distance_computations, hops = ctx.metric_hops;
+            size_t visited = ctx.metric_visited, layers = ctx.metric_layers, disk_reads = ctx.metric_disk_reads;
+            auto t1 = std::chrono::steady_clock::now();
+            const iRangeGraph::RangeCover &cover = index.Cover(ranges[i].first, ranges[i].second, scratch, hold);
+            results[i] = index.TopDown_nodeentries_search(ctx, cover, storage.query_points[i], ef, query_K, M);
+            auto t2 = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(t2 - t1).count();
+            busy_seconds += seconds;
+            stats[i] = {seconds * 1e6, ctx.metric_distance_computations - dco, ctx.metric_hops - hops, ctx.metric_visited - visited, ctx.metric_layers - layers, ctx.metric_disk_reads - disk_reads};
+        }
+    }
+
+    wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+    // evictions are excluded from the throughput of a cold run
+    if (cold)
+        wall_seconds = busy_seconds;
+    return stats;
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--data_path")
+            paths["data_vector"] = argv[i + 1];
+        if (arg == "--query_path")
+            paths["query_vector"] = argv[i + 1];
+        if (arg == "--range_saveprefix")
+            paths["range_saveprefix"] = argv[i + 1];
+        if (arg == "--groundtruth_saveprefix")
+            paths["groundtruth_saveprefix"] = argv[i + 1];
+        if (arg == "--index_file")
+            paths["index"] = argv[i + 1];
+        if (arg == "--flat_index_file")
+            paths["flat_index"] = argv[i + 1];
+        if (arg == "--output")
+            paths["output"] = argv[i + 1];
+        if (arg == "--format")
+            format = argv[i + 1];
+        if (arg == "--label")
+            label = argv[i + 1];
+        if (arg == "--M")
+            M = std::stoi(argv[i + 1]);
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
+        if (arg == "--threads")
+            threads = std::stoi(argv[i + 1]);
+        if (arg == "--ef")
+            SearchEF = ParseIntList(argv[i + 1]);
+        if (arg == "--cache")
+            cache_mode = argv[i + 1];
+        if (arg == "--evict_mb")
+            evict_mb = std::stoi(argv[i + 1]);
+        if (arg == "--generate")
+            generate = true;
+        if (arg == "--sq8")
+            sq8 = true;
+        if (arg == "--dtype")
+            dtype = iRangeGraph::ParseDtype(argv[i + 1]);
+        if (arg == "--vector_storage")
+            vector_storage = iRangeGraph::ParseVectorStorage(argv[i + 1]);
+        if (arg == "--disk_vectors")
+            paths["disk_vectors"] = argv[i + 1];
+        if (arg == "--compact_links")
+            compact_links = true;
+        if (arg == "--linear_pool")
+            linear_pool = true;
+        if (arg == "--random_entries")
+            random_entries = true;
+        if (arg == "--patience")
+            patience = std::stoi(argv[i + 1]);
+        if (arg == "--scan_threshold")
+            scan_threshold = std::stoi(argv[i + 1]);
+        if (arg == "--huge_pages")
+            placement.pages = iRangeGraph::ParsePageSize(argv[i + 1]);
+        if (arg == "--numa")
+            placement.numa = iRangeGraph::ParseNumaPolicy(argv[i + 1]);
+        if (arg == "--reorder_block")
+            reorder_block = std::stoi(argv[i + 1]);
+        if (arg == "--cover_cache")
+            cover_cache = std::stoi(argv[i + 1]);
+    }
+
+    if (paths["data_vector"] == "" && (paths["flat_index"] == "" || generate))
+        throw Exception("data path is empty");
+    if (paths["query_vector"] == "")
+        throw Exception("query path is empty");
+    if (paths["range_saveprefix"] == "")
+        throw Exception("range saveprefix is empty");
+    if (paths["groundtruth_saveprefix"] == "")
+        throw Exception("groundtruth saveprefix is empty");
+    if (paths["index"] == "" && paths["flat_index"] == "")
+        throw Exception("index path is empty");
+    if (paths["flat_index"] == "" && M <= 0)
+        throw Exception("M should be a positive integer");
+    if (paths["output"] == "")
+        throw Exception("output path is empty");
+    if (format == "")
+        format = paths["output"].size() >= 5 && paths["output"].substr(paths["output"].size() - 5) == ".json" ? "json" : "csv";
+    if (format != "csv" && format != "json")
+        throw Exception("format should be csv or json");
+    if (cache_mode != "warm" && cache_mode != "cold" && cache_mode != "both")
+        throw Exception("cache should be warm, cold or both");
+    if (threads <= 0)
+        throw Exception("threads should be a positive integer");
+    if (vector_storage != iRangeGraph::VectorStorage::FP32 && (sq8 || paths["disk_vectors"] != "" || paths["flat_index"] != ""))
+        throw Exception("--vector_storage cannot be combined with --sq8, --disk_vectors or a flat index file");
+    if (evict_mb <= 0)
+        throw Exception("evict_mb should be a positive integer");
+    if (cover_cache < 0)
+        throw Exception("cover_cache should be a non-negative integer");
+
+    iRangeGraph::DataLoader storage;
+    storage.metric = metric;
+    storage.dtype = dtype;
+    storage.query_K = query_K;
+    storage.LoadQuery(paths["query_vector"]);
+    if (generate)
+    {
+        storage.LoadData(paths["data_vector"]);
+        iRangeGraph::QueryGenerator generator(storage.data_nb, storage.query_nb);
+        generator.GenerateRange(paths["range_saveprefix"]);
+        storage.LoadQueryRange(paths["range_saveprefix"]);
+        generator.GenerateGroundtruth(paths["groundtruth_saveprefix"], storage);
+        storage.data_points = iRangeGraph::VectorSet();
+    }
+    else
+        storage.LoadQueryRange(paths["range_saveprefix"]);
+    storage.LoadGroundtruth(paths["groundtruth_saveprefix"]);
+
+    std::unique_ptr<iRangeGraph::iRangeGraph_Search<float>> index_ptr;
+    if (paths["flat_index"] != "")
+        index_ptr.reset(new iRangeGraph::iRangeGraph_Search<float>(paths["flat_index"], &storage));
+    else if (paths["disk_vectors"] != "")
+        index_ptr.reset(new iRangeGraph::iRangeGraph_Search<float>(paths["disk_vectors"], paths["index"], &storage, M, iRangeGraph::VectorStorage::SQ8_DISK, compact_links ? iRangeGraph::LinkStorage::COMPACT : iRangeGraph::LinkStorage::DENSE, placement));
+    else
+        index_ptr.reset(new iRangeGraph::iRangeGraph_Search<float>(paths["data_vector"], paths["index"], &storage, M, sq8 ? iRangeGraph::VectorStorage::SQ8 : vector_storage, compact_links ? iRangeGraph::LinkStorage::COMPACT : iRangeGraph::LinkStorage::DENSE, placement));
+    iRangeGraph::iRangeGraph_Search<float> &index = *index_ptr;
+    if (reorder_block > 0)
+        index.ReorderBlocks(reorder_block, threads);
+    if (M <= 0)
+        M = index.M_out;
+    index.use_node_entries = !random_entries;
+    if (linear_pool)
+        index.search_engine = iRangeGraph::SearchEngine::LINEAR_POOL;
+    index.patience = patience;
+    index.scan_threshold = scan_threshold;
+    if (cover_cache > 0)
+        index.EnableCoverCache(cover_cache);
+
+    std::vector<std::string> modes;
+    if (cache_mode != "cold")
+        modes.push_back("warm");
+    if (cache_mode != "warm")
+        modes.push_back("cold");
+    std::unique_ptr<CacheEvictor> evictor;
+    if (cache_mode != "warm")
+        evictor.reset(new CacheEvictor((size_t)evict_mb << 20));
+
+    CheckPath(paths["output"]);
+    std::ofstream outfile(paths["output"]);
+    if (!outfile.is_open())
+        throw Exception("cannot open " + paths["output"]);
+    const std::vector<std::string> columns = {"label", "threads", "cache", "fraction", "ef", "queries", "recall", "qps", "lat_mean_us", "lat_p50_us", "lat_p95_us", "lat_p99_us", "lat_p999_us", "dco_mean", "dco_p50", "dco_p99", "hops_mean", "hops_p50", "hops_p99", "visited_mean", "visited_p99", "layers_mean", "layers_p99", "disk_reads_mean", "disk_reads_p99"};
+    if (format == "csv")
+    {
+        for (int c = 0; c < columns.size(); c++)
+            outfile << (c ? "," : "") << columns[c];
+        outfile << std::endl;
+    }
+    else
+        outfile << "[";
+    bool first_row = true;
+
+    std::vector<int> suffixes;
+    for (auto &t : storage.query_range)
+        suffixes.push_back(t.first);
+    std::sort(suffixes.begin(), suffixes.end());
+
+    for (int suffix : suffixes)
+    {
+        std::vector<std::pair<int, int>> &ranges = storage.query_range[suffix];
+        std::vector<std::vector<int>> &gt = storage.groundtruth[suffix];
+        std::cout << "suffix = " << suffix << std::endl;
+        for (const std::string &mode : modes)
+        {
+            bool cold = mode == "cold";
+            for (int ef : SearchEF)
+            {
+                std::vector<std::priority_queue<iRangeGraph::PFI>> results;
+                double wall_seconds;
+                // a warm run is measured on its second pass over the queries
+                if (!cold)
+                    RunQueries(index, storage, ranges, ef, false, nullptr, results, wall_seconds);
+                IRG_STATS_RESET();
+                std::vector<QueryStats> stats = RunQueries(index, storage, ranges, ef, cold, evictor.get(), results, wall_seconds);
+
+                int tp = 0;
+                for (int i = 0; i < storage.query_nb; i++)
+                {
+                    while (results[i].size())
+                    {
+                        int x = results[i].top().second;
+                        results[i].pop();
+                        if (std::find(gt[i].begin(), gt[i].end(), x) != gt[i].end())
+                            tp++;
+                    }
+                }
+
+                Distribution latency = Collect(stats, [](const QueryStats &s)
+                                               { return s.latency_us; });
+                Distribution dco = Collect(stats, [](const QueryStats &s)
+                                           { return (double)s.dco; });
+                Distribution hops = Collect(stats, [](const QueryStats &s)
+                                            { return (double)s.hops; });
+                Distribution visited = Collect(stats, [](const QueryStats &s)
+                                               { return (double)s.visited; });
+                Distribution layers = Collect(stats, [](const QueryStats &s)
+                                              { return (double)s.layers; });
+                Distribution disk_reads = Collect(stats, [](const QueryStats &s)
+                                                  { return (double)s.disk_reads; });
+
+                std::vector<std::string> values = {format == "json" ? JsonString(label) : label, std::to_string(cold ? 1 : threads), format == "json" ? JsonString(mode) : mode, std::to_string(suffix), std::to_string(ef), std::to_string(storage.query_nb)};
+                for (double v : {1.0 * tp / storage.query_nb / query_K, storage.query_nb / wall_seconds,
+                                 latency.mean, latency.percentile(50), latency.percentile(95), latency.percentile(99), latency.percentile(99.9),
+                                 dco.mean, dco.percentile(50), dco.percentile(99),
+                                 hops.mean, hops.percentile(50), hops.percentile(99),
+                                 visited.mean, visited.percentile(99), layers.mean, layers.percentile(99), disk_reads.mean, disk_reads.percentile(99)})
+                {
+                    std::ostringstream ss;
+                    ss << v;
+                    values.push_back(ss.str());
+                }
+
+                if (format == "csv")
+                {
+                    for (int c = 0; c < values.size(); c++)
+                        outfile << (c ? "," : "") << values[c];
+                    outfile << std::endl;
+                }
+                else
+                {
+                    outfile << (first_row ? "\n" : ",\n") << "  {";
+                    for (int c = 0; c < values.size(); c++)
+                        outfile << (c ? ", " : "") << "\"" << columns[c] << "\": " << values[c];
+                    outfile << "}";
+                }
+                first_row = false;
+#if IRG_STATS
+                std::cout << "suffix " << suffix << " ef " << ef << " " << mode << std::endl;
+#endif
+                IRG_STATS_PRINT(std::cout);
+            }
+        }
+    }
+    if (format == "json")
+        outfile << "\n]" << std::endl;
+    outfile.close();
+    std::cout << "benchmark results saved to " << paths["output"] << std::endl;
+}
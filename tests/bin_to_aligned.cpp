@@ -0,0 +1,27 @@
+#include "disk_vectors.h"
+
+std::unordered_map<std::string, std::string> paths;
+
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--data_path")
+            paths["data_vector"] = argv[i + 1];
+        if (arg == "--aligned_path")
+            paths["aligned"] = argv[i + 1];
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
+    }
+
+    if (paths["data_vector"] == "")
+        throw Exception("data path is empty");
+    if (paths["aligned"] == "")
+        throw Exception("aligned path is empty");
+
+    iRangeGraph::DiskVectors::Write(paths["data_vector"], paths["aligned"], metric);
+    std::cout << "save aligned vector file done" << std::endl;
+}
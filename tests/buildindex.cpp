@@ -3,8 +3,12 @@
 std::unordered_map<std::string, std::string> paths;
 
 int M;
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
 int ef_construction;
 int threads;
+int entries = 4;
+bool aligned_tree = false;
+iRangeGraph::VectorDtype dtype = iRangeGraph::VectorDtype::F32;
 
 int main(int argc, char **argv)
 {
@@ -17,10 +21,18 @@ int main(int argc, char **argv)
             paths["index_save"] = argv[i + 1];
         if (arg == "--M")
             M = std::stoi(argv[i + 1]);
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
         if (arg == "--ef_construction")
             ef_construction = std::stoi(argv[i + 1]);
         if (arg == "--threads")
             threads = std::stoi(argv[i + 1]);
+        if (arg == "--aligned_tree")
+            aligned_tree = true;
+        if (arg == "--entries")
+            entries = std::stoi(argv[i + 1]);
+        if (arg == "--dtype")
+            dtype = iRangeGraph::ParseDtype(argv[i + 1]);
     }
 
     if (paths["data_vector"] == "")
@@ -33,10 +45,15 @@ int main(int argc, char **argv)
         throw Exception("ef_construction should be a positive integer");
     if (threads <= 0)
         throw Exception("threads should be a positive integer");
+    if (entries < 0)
+        throw Exception("entries should be a non-negative integer");
 
     iRangeGraph::DataLoader storage;
+    storage.metric = metric;
+    storage.dtype = dtype;
     storage.LoadData(paths["data_vector"]);
-    iRangeGraph::iRangeGraph_Build<float> index(&storage, M, ef_construction);
+    iRangeGraph::iRangeGraph_Build<float> index(&storage, M, ef_construction, aligned_tree ? iRangeGraph::TreeLayout::ALIGNED : iRangeGraph::TreeLayout::BALANCED);
     index.max_threads = threads;
+    index.entries_per_node = entries;
     index.buildandsave(paths["index_save"]);
 }
\ No newline at end of file
@@ -0,0 +1,76 @@
+#include "construction.h"
+#include "utils_multi.h"
+
+std::unordered_map<std::string, std::string> paths;
+
+int M;
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
+int ef_construction;
+int threads;
+int entries = 4;
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--data_path")
+            paths["data_vector"] = argv[i + 1];
+        if (arg == "--attribute1")
+            paths["attribute1"] = argv[i + 1];
+        if (arg == "--attribute2")
+            paths["attribute2"] = argv[i + 1];
+        if (arg == "--index_prefix")
+            paths["index_prefix"] = argv[i + 1];
+        if (arg == "--M")
+            M = std::stoi(argv[i + 1]);
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
+        if (arg == "--ef_construction")
+            ef_construction = std::stoi(argv[i + 1]);
+        if (arg == "--threads")
+            threads = std::stoi(argv[i + 1]);
+        if (arg == "--entries")
+            entries = std::stoi(argv[i + 1]);
+    }
+
+    if (paths["data_vector"] == "")
+        throw Exception("data path is empty");
+    if (paths["attribute1"] == "" || paths["attribute2"] == "")
+        throw Exception("attribute path is empty");
+    if (paths["index_prefix"] == "")
+        throw Exception("index prefix is empty");
+    if (M <= 0)
+        throw Exception("M should be a positive integer");
+    if (ef_construction <= 0)
+        throw Exception("ef_construction should be a positive integer");
+    if (threads <= 0)
+        throw Exception("threads should be a positive integer");
+    if (entries < 0)
+        throw Exception("entries should be a non-negative integer");
+
+    iRangeGraph_multi::DataLoader storage;
+    storage.metric = metric;
+    storage.LoadData(paths["data_vector"]);
+    // the order of load in attribute values should not be switched
+    storage.LoadAttribute(paths["attribute1"]);
+    storage.LoadAttribute(paths["attribute2"]);
+
+    // One index per attribute over the points sorted by it; the searcher re-sorts the same way when loading
+    for (int aid = 0; aid < storage.attr_nb; aid++)
+    {
+        storage.Sort_by_Attr(aid);
+        iRangeGraph::DataLoader sorted;
+        sorted.metric = metric;
+        sorted.data_nb = storage.data_nb;
+        sorted.Dim = storage.Dim;
+        sorted.data_points.swap(storage.data_points);
+        {
+            iRangeGraph::iRangeGraph_Build<float> index(&sorted, M, ef_construction);
+            index.max_threads = threads;
+            index.entries_per_node = entries;
+            index.buildandsave(iRangeGraph_multi::MultiIndexPath(paths["index_prefix"], aid));
+        }
+        storage.data_points.swap(sorted.data_points);
+    }
+}
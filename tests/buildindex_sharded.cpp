@@ -0,0 +1,71 @@
+#include "iRG_sharded.h"
+
+std::unordered_map<std::string, std::string> paths;
+
+int M;
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
+int ef_construction;
+int threads;
+int num_shards;
+// build only this shard, e.g., on the host that serves it; -1 builds all of them
+int shard = -1;
+bool aligned_tree = false;
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--data_path")
+            paths["data_vector"] = argv[i + 1];
+        if (arg == "--index_prefix")
+            paths["index_prefix"] = argv[i + 1];
+        if (arg == "--shards")
+            num_shards = std::stoi(argv[i + 1]);
+        if (arg == "--shard")
+            shard = std::stoi(argv[i + 1]);
+        if (arg == "--M")
+            M = std::stoi(argv[i + 1]);
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
+        if (arg == "--ef_construction")
+            ef_construction = std::stoi(argv[i + 1]);
+        if (arg == "--threads")
+            threads = std::stoi(argv[i + 1]);
+        if (arg == "--aligned_tree")
+            aligned_tree = true;
+    }
+
+    if (paths["data_vector"] == "")
+        throw Exception("data path is empty");
+    if (paths["index_prefix"] == "")
+        throw Exception("index prefix is empty");
+    if (M <= 0)
+        throw Exception("M should be a positive integer");
+    if (ef_construction <= 0)
+        throw Exception("ef_construction should be a positive integer");
+    if (threads <= 0)
+        throw Exception("threads should be a positive integer");
+    if (shard < -1 || shard >= num_shards)
+        throw Exception("shard should be between 0 and shards - 1");
+
+    std::ifstream datafile(paths["data_vector"], std::ios::in | std::ios::binary);
+    if (!datafile.is_open())
+        throw Exception("cannot open " + paths["data_vector"]);
+    int data_nb;
+    datafile.read((char *)&data_nb, sizeof(int));
+    datafile.close();
+
+    iRangeGraph::ShardManifest manifest;
+    manifest.prefix = paths["index_prefix"];
+    manifest.metric = metric;
+    manifest.Split(data_nb, num_shards);
+    manifest.Save();
+
+    iRangeGraph::TreeLayout tree_layout = aligned_tree ? iRangeGraph::TreeLayout::ALIGNED : iRangeGraph::TreeLayout::BALANCED;
+    for (int s = 0; s < num_shards; s++)
+    {
+        if (shard == -1 || shard == s)
+            iRangeGraph::BuildShard(manifest, s, paths["data_vector"], M, ef_construction, threads, tree_layout);
+    }
+}
@@ -8,6 +8,7 @@
 std::unordered_map<std::string, std::string> paths;
 
 int M;
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
 int ef_construction;
 
 // Global atomic to store peak thread count
@@ -24,6 +25,8 @@ int main(int argc, char **argv)
             paths["index_save"] = argv[i + 1];
         if (arg == "--M")
             M = std::stoi(argv[i + 1]);
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
         if (arg == "--ef_construction")
             ef_construction = std::stoi(argv[i + 1]);
     }
@@ -42,6 +45,7 @@ int main(int argc, char **argv)
 
     // Load data BEFORE starting timer (exclude from timing)
     iRangeGraph::DataLoader storage;
+    storage.metric = metric;
     storage.LoadData(paths["data_vector"]);
 
     // Monitor thread count
@@ -2,6 +2,8 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <cstdint>
+#include "half.hpp"
 
 // Read fvecs format
 std::vector<std::vector<float>> read_fvecs(const std::string& filename) {
@@ -23,7 +25,7 @@ std::vector<std::vector<float>> read_fvecs(const std::string& filename) {
 }
 
 // Write .bin format (iRangeGraph format - unsorted, just format conversion)
-void write_bin(const std::string& filename, const std::vector<std::vector<float>>& data) {
+void write_bin(const std::string& filename, const std::vector<std::vector<float>>& data, const std::string& dtype) {
     std::ofstream file(filename, std::ios::binary);
     if (!file) {
         std::cerr << "Error: Unable to open file " << filename << " for writing\n";
@@ -36,28 +38,43 @@ void write_bin(const std::string& filename, const std::vector<std::vector<float>
     file.write(reinterpret_cast<const char*>(&num_points), sizeof(int));
     file.write(reinterpret_cast<const char*>(&dim), sizeof(int));
     
+    // f16/bf16 keep the same header with 16-bit elements; readers are told the type with --dtype
+    std::vector<uint16_t> row(dim);
     for (const auto& vec : data) {
-        file.write(reinterpret_cast<const char*>(vec.data()), dim * sizeof(float));
+        if (dtype == "f32") {
+            file.write(reinterpret_cast<const char*>(vec.data()), dim * sizeof(float));
+            continue;
+        }
+        if (dtype == "f16")
+            half::float_to_fp16(vec.data(), row.data(), dim);
+        else
+            half::float_to_bf16(vec.data(), row.data(), dim);
+        file.write(reinterpret_cast<const char*>(row.data()), dim * sizeof(uint16_t));
     }
     
     file.close();
 }
 
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <input.fvecs> <output.bin>\n";
+    if (argc != 3 && argc != 4) {
+        std::cerr << "Usage: " << argv[0] << " <input.fvecs> <output.bin> [f32|f16|bf16]\n";
         std::cerr << "  Converts .fvecs to .bin format (no sorting)\n";
         return 1;
     }
 
     std::string input_fvecs = argv[1];
     std::string output_bin = argv[2];
+    std::string dtype = argc > 3 ? argv[3] : "f32";
+    if (dtype != "f32" && dtype != "f16" && dtype != "bf16") {
+        std::cerr << "Error: unknown dtype " << dtype << ", expected f32, f16 or bf16\n";
+        return 1;
+    }
 
     std::cout << "Reading vectors from " << input_fvecs << "...\n";
     std::vector<std::vector<float>> vectors = read_fvecs(input_fvecs);
     
     std::cout << "Writing vectors to " << output_bin << "...\n";
-    write_bin(output_bin, vectors);
+    write_bin(output_bin, vectors, dtype);
     
     std::cout << "Conversion completed successfully!\n";
     std::cout << "  Vectors: " << vectors.size() << "\n";
@@ -3,6 +3,8 @@
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <cstdint>
+#include "half.hpp"
 
 // Read fvecs format
 std::vector<std::vector<float>> read_fvecs(const std::string& filename) {
@@ -42,7 +44,7 @@ std::vector<int> read_attributes_csv(const std::string& filename) {
 }
 
 // Write .bin format (iRangeGraph format)
-void write_bin(const std::string& filename, const std::vector<std::vector<float>>& data) {
+void write_bin(const std::string& filename, const std::vector<std::vector<float>>& data, const std::string& dtype) {
     std::ofstream file(filename, std::ios::binary);
     if (!file) {
         std::cerr << "Error: Unable to open file " << filename << " for writing\n";
@@ -55,16 +57,26 @@ void write_bin(const std::string& filename, const std::vector<std::vector<float>
     file.write(reinterpret_cast<const char*>(&num_points), sizeof(int));
     file.write(reinterpret_cast<const char*>(&dim), sizeof(int));
     
+    // f16/bf16 keep the same header with 16-bit elements; readers are told the type with --dtype
+    std::vector<uint16_t> row(dim);
     for (const auto& vec : data) {
-        file.write(reinterpret_cast<const char*>(vec.data()), dim * sizeof(float));
+        if (dtype == "f32") {
+            file.write(reinterpret_cast<const char*>(vec.data()), dim * sizeof(float));
+            continue;
+        }
+        if (dtype == "f16")
+            half::float_to_fp16(vec.data(), row.data(), dim);
+        else
+            half::float_to_bf16(vec.data(), row.data(), dim);
+        file.write(reinterpret_cast<const char*>(row.data()), dim * sizeof(uint16_t));
     }
     
     file.close();
 }
 
 int main(int argc, char** argv) {
-    if (argc != 4) {
-        std::cerr << "Usage: " << argv[0] << " <input.fvecs> <attributes.csv> <output.bin>\n";
+    if (argc != 4 && argc != 5) {
+        std::cerr << "Usage: " << argv[0] << " <input.fvecs> <attributes.csv> <output.bin> [f32|f16|bf16]\n";
         std::cerr << "  Converts .fvecs to .bin format and sorts by attributes\n";
         return 1;
     }
@@ -72,6 +84,11 @@ int main(int argc, char** argv) {
     std::string input_fvecs = argv[1];
     std::string input_attributes = argv[2];
     std::string output_bin = argv[3];
+    std::string dtype = argc > 4 ? argv[4] : "f32";
+    if (dtype != "f32" && dtype != "f16" && dtype != "bf16") {
+        std::cerr << "Error: unknown dtype " << dtype << ", expected f32, f16 or bf16\n";
+        return 1;
+    }
 
     std::cout << "Reading vectors from " << input_fvecs << "...\n";
     std::vector<std::vector<float>> vectors = read_fvecs(input_fvecs);
@@ -106,7 +123,7 @@ int main(int argc, char** argv) {
     }
     
     std::cout << "Writing sorted vectors to " << output_bin << "...\n";
-    write_bin(output_bin, sorted_vectors);
+    write_bin(output_bin, sorted_vectors, dtype);
     
     // Save the mapping: sorted_index -> original_index
     // This allows translating IDs from sorted space back to original space
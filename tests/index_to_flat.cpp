@@ -0,0 +1,39 @@
+#include "iRG_search.h"
+
+std::unordered_map<std::string, std::string> paths;
+
+int M;
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--data_path")
+            paths["data_vector"] = argv[i + 1];
+        if (arg == "--index_file")
+            paths["index"] = argv[i + 1];
+        if (arg == "--flat_index_file")
+            paths["flat_index"] = argv[i + 1];
+        if (arg == "--M")
+            M = std::stoi(argv[i + 1]);
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
+    }
+
+    if (paths["data_vector"] == "")
+        throw Exception("data path is empty");
+    if (paths["index"] == "")
+        throw Exception("index path is empty");
+    if (paths["flat_index"] == "")
+        throw Exception("flat index path is empty");
+    if (M <= 0)
+        throw Exception("M should be a positive integer");
+
+    iRangeGraph::DataLoader storage;
+    storage.metric = metric;
+    iRangeGraph::iRangeGraph_Search<float> index(paths["data_vector"], paths["index"], &storage, M);
+    index.SaveFlatIndex(paths["flat_index"]);
+    std::cout << "save flat index done" << std::endl;
+}
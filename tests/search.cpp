@@ -4,6 +4,13 @@ std::unordered_map<std::string, std::string> paths;
 
 const int query_K = 10;
 int M;
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
+int threads = 1;
+int scan_threshold = 0;
+memory::Placement placement;
+int reorder_block = 0;
+iRangeGraph::VectorDtype dtype = iRangeGraph::VectorDtype::F32;
+iRangeGraph::VectorStorage vector_storage = iRangeGraph::VectorStorage::FP32;
 
 void Generate(iRangeGraph::DataLoader &storage)
 {
@@ -52,12 +59,33 @@ int main(int argc, char **argv)
             paths["result_saveprefix"] = argv[i + 1];
         if (arg == "--M")
             M = std::stoi(argv[i + 1]);
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
+        if (arg == "--threads")
+            threads = std::stoi(argv[i + 1]);
+        if (arg == "--scan_threshold")
+            scan_threshold = std::stoi(argv[i + 1]);
+        if (arg == "--huge_pages")
+            placement.pages = iRangeGraph::ParsePageSize(argv[i + 1]);
+        if (arg == "--numa")
+            placement.numa = iRangeGraph::ParseNumaPolicy(argv[i + 1]);
+        if (arg == "--reorder_block")
+            reorder_block = std::stoi(argv[i + 1]);
+        if (arg == "--dtype")
+            dtype = iRangeGraph::ParseDtype(argv[i + 1]);
+        if (arg == "--vector_storage")
+            vector_storage = iRangeGraph::ParseVectorStorage(argv[i + 1]);
     }
 
-    if (argc != 15)
+    // --threads, --metric, --scan_threshold, --huge_pages, --numa, --reorder_block, --dtype and --vector_storage are optional
+    if (argc < 15 || argc > 31 || argc % 2 == 0)
         throw Exception("please check input parameters");
+    if (threads <= 0)
+        throw Exception("threads should be a positive integer");
 
     iRangeGraph::DataLoader storage;
+    storage.metric = metric;
+    storage.dtype = dtype;
     storage.query_K = query_K;
     storage.LoadQuery(paths["query_vector"]);
     // If it is the first run, Generate shall be called; otherwise, Generate can be skipped
@@ -65,8 +93,11 @@ int main(int argc, char **argv)
     storage.LoadQueryRange(paths["range_saveprefix"]);
     storage.LoadGroundtruth(paths["groundtruth_saveprefix"]);
 
-    iRangeGraph::iRangeGraph_Search<float> index(paths["data_vector"], paths["index"], &storage, M);
+    iRangeGraph::iRangeGraph_Search<float> index(paths["data_vector"], paths["index"], &storage, M, vector_storage, iRangeGraph::LinkStorage::DENSE, placement);
+    if (reorder_block > 0)
+        index.ReorderBlocks(reorder_block, threads);
+    index.scan_threshold = scan_threshold;
     // searchefs can be adjusted
     std::vector<int> SearchEF = {1700, 1400, 1100, 1000, 900, 800, 700, 600, 500, 400, 300, 250, 200, 180, 160, 140, 120, 100, 90, 80, 70, 60, 55, 50, 45, 40, 35, 30, 25, 20, 15, 10};
-    index.search(SearchEF, paths["result_saveprefix"], M);
+    index.search(SearchEF, paths["result_saveprefix"], M, threads);
 }
\ No newline at end of file
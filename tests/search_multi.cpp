@@ -4,6 +4,9 @@ std::unordered_map<std::string, std::string> paths;
 
 const int query_K = 10;
 int M;
+int scan_threshold = 0;
+memory::Placement placement;
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
 
 void Generate(iRangeGraph_multi::DataLoader &storage)
 {
@@ -27,6 +30,8 @@ int main(int argc, char **argv)
             paths["groundtruth_prefix"] = argv[i + 1];
         if (arg == "--index_file")
             paths["index"] = argv[i + 1];
+        if (arg == "--index_prefix")
+            paths["index_prefix"] = argv[i + 1];
         if (arg == "--result_saveprefix")
             paths["result_saveprefix"] = argv[i + 1];
         if (arg == "--attribute1")
@@ -35,12 +40,26 @@ int main(int argc, char **argv)
             paths["attribute2"] = argv[i + 1];
         if (arg == "--M")
             M = std::stoi(argv[i + 1]);
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
+        if (arg == "--scan_threshold")
+            scan_threshold = std::stoi(argv[i + 1]);
+        if (arg == "--huge_pages")
+            placement.pages = iRangeGraph::ParsePageSize(argv[i + 1]);
+        if (arg == "--numa")
+            placement.numa = iRangeGraph::ParseNumaPolicy(argv[i + 1]);
     }
 
-    if (argc != 19)
+    // --metric, --scan_threshold, --huge_pages and --numa are optional
+    if (argc < 19 || argc > 27 || argc % 2 == 0)
         throw Exception("please check input parameters");
+    // --index_file: one index over the points sorted by the first attribute; --index_prefix: the per-attribute
+    // indexes of buildindex_multi
+    if ((paths["index"] == "") == (paths["index_prefix"] == ""))
+        throw Exception("exactly one of --index_file and --index_prefix should be given");
 
     iRangeGraph_multi::DataLoader storage;
+    storage.metric = metric;
     storage.query_K = query_K;
     storage.LoadQuery(paths["query_vector"]);
     storage.LoadData(paths["data_vector"]);
@@ -54,11 +73,22 @@ int main(int argc, char **argv)
 
     storage.LoadRanges(paths["range_prefix"]);
     storage.LoadGroundtruth(paths["groundtruth_prefix"]);
-    storage.Sort_by_Attr(0);
 
-    iRangeGraph_multi::iRangeGraph_Search_Multi<float> index(paths["index"], &storage, M);
-    index.setprob();
     std::vector<int>
         SearchEF = {1400, 700, 400, 300, 250, 200, 180, 160, 140, 120, 100, 90, 80, 70, 60, 55, 50, 45, 40, 35, 30, 25, 20, 15, 10};
+    if (paths["index_prefix"] != "")
+    {
+        iRangeGraph_multi::iRangeGraph_Search_MultiTree<float> index(paths["index_prefix"], &storage, M, placement);
+        index.setprob();
+        index.set_scan_threshold(scan_threshold);
+        index.search(SearchEF, paths["result_saveprefix"], M);
+        return 0;
+    }
+
+    storage.Sort_by_Attr(0);
+
+    iRangeGraph_multi::iRangeGraph_Search_Multi<float> index(paths["index"], &storage, M, placement);
+    index.setprob();
+    index.scan_threshold = scan_threshold;
     index.search(SearchEF, paths["result_saveprefix"], M);
 }
\ No newline at end of file
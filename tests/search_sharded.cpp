@@ -0,0 +1,59 @@
+#include "iRG_sharded.h"
+
+std::unordered_map<std::string, std::string> paths;
+
+const int query_K = 10;
+int M;
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
+int threads = 1;
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--query_path")
+            paths["query_vector"] = argv[i + 1];
+        if (arg == "--range_saveprefix")
+            paths["range_saveprefix"] = argv[i + 1];
+        if (arg == "--groundtruth_saveprefix")
+            paths["groundtruth_saveprefix"] = argv[i + 1];
+        if (arg == "--index_prefix")
+            paths["index_prefix"] = argv[i + 1];
+        if (arg == "--result_saveprefix")
+            paths["result_saveprefix"] = argv[i + 1];
+        if (arg == "--M")
+            M = std::stoi(argv[i + 1]);
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
+        if (arg == "--threads")
+            threads = std::stoi(argv[i + 1]);
+    }
+
+    if (paths["query_vector"] == "")
+        throw Exception("query path is empty");
+    if (paths["range_saveprefix"] == "")
+        throw Exception("range saveprefix is empty");
+    if (paths["groundtruth_saveprefix"] == "")
+        throw Exception("groundtruth saveprefix is empty");
+    if (paths["index_prefix"] == "")
+        throw Exception("index prefix is empty");
+    if (paths["result_saveprefix"] == "")
+        throw Exception("result saveprefix is empty");
+    if (M <= 0)
+        throw Exception("M should be a positive integer");
+    if (threads <= 0)
+        throw Exception("threads should be a positive integer");
+
+    // query ranges and groundtruth are over the global sorted ids, as generated by search or benchmark --generate
+    iRangeGraph::DataLoader storage;
+    storage.metric = metric;
+    storage.query_K = query_K;
+    storage.LoadQuery(paths["query_vector"]);
+    storage.LoadQueryRange(paths["range_saveprefix"]);
+    storage.LoadGroundtruth(paths["groundtruth_saveprefix"]);
+
+    iRangeGraph::iRangeGraph_Sharded_Search index(paths["index_prefix"], &storage, M);
+    std::vector<int> SearchEF = {1700, 1400, 1100, 1000, 900, 800, 700, 600, 500, 400, 300, 250, 200, 180, 160, 140, 120, 100, 90, 80, 70, 60, 55, 50, 45, 40, 35, 30, 25, 20, 15, 10};
+    index.search(SearchEF, paths["result_saveprefix"], M, threads);
+}
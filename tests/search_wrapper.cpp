@@ -11,7 +11,23 @@ std::unordered_map<std::string, std::string> paths;
 
 const int query_K = 10;
 int M;
+iRangeGraph::Metric metric = iRangeGraph::Metric::L2;
 int ef_search;
+int threads = 1;
+bool mmap_populate = false;
+bool sq8 = false;
+iRangeGraph::VectorDtype dtype = iRangeGraph::VectorDtype::F32;
+iRangeGraph::VectorStorage vector_storage = iRangeGraph::VectorStorage::FP32;
+bool compact_links = false;
+bool linear_pool = false;
+float target_recall = 0.95;
+int patience = 0;
+int scan_threshold = 0;
+memory::Placement placement;
+int reorder_block = 0;
+int cover_cache = 0;
+bool group_ranges = false;
+int interleave = 4;
 
 // Global atomic to store peak thread count
 std::atomic<int> peak_threads(1);
@@ -31,10 +47,50 @@ int main(int argc, char **argv)
             paths["groundtruth"] = argv[i + 1];
         if (arg == "--index_file")
             paths["index"] = argv[i + 1];
+        if (arg == "--flat_index_file")
+            paths["flat_index"] = argv[i + 1];
+        if (arg == "--mmap_populate")
+            mmap_populate = true;
+        if (arg == "--sq8")
+            sq8 = true;
+        if (arg == "--dtype")
+            dtype = iRangeGraph::ParseDtype(argv[i + 1]);
+        if (arg == "--vector_storage")
+            vector_storage = iRangeGraph::ParseVectorStorage(argv[i + 1]);
+        if (arg == "--disk_vectors")
+            paths["disk_vectors"] = argv[i + 1];
+        if (arg == "--compact_links")
+            compact_links = true;
+        if (arg == "--linear_pool")
+            linear_pool = true;
+        if (arg == "--ef_calibration")
+            paths["ef_calibration"] = argv[i + 1];
+        if (arg == "--target_recall")
+            target_recall = std::stof(argv[i + 1]);
+        if (arg == "--patience")
+            patience = std::stoi(argv[i + 1]);
+        if (arg == "--scan_threshold")
+            scan_threshold = std::stoi(argv[i + 1]);
         if (arg == "--M")
             M = std::stoi(argv[i + 1]);
+        if (arg == "--metric")
+            metric = iRangeGraph::ParseMetric(argv[i + 1]);
         if (arg == "--ef_search")
             ef_search = std::stoi(argv[i + 1]);
+        if (arg == "--threads")
+            threads = std::stoi(argv[i + 1]);
+        if (arg == "--huge_pages")
+            placement.pages = iRangeGraph::ParsePageSize(argv[i + 1]);
+        if (arg == "--numa")
+            placement.numa = iRangeGraph::ParseNumaPolicy(argv[i + 1]);
+        if (arg == "--reorder_block")
+            reorder_block = std::stoi(argv[i + 1]);
+        if (arg == "--cover_cache")
+            cover_cache = std::stoi(argv[i + 1]);
+        if (arg == "--group_ranges")
+            group_ranges = true;
+        if (arg == "--interleave")
+            interleave = std::stoi(argv[i + 1]);
     }
 
     if (paths["data_vector"] == "")
@@ -45,15 +101,25 @@ int main(int argc, char **argv)
         throw Exception("query ranges file is empty");
     if (paths["groundtruth"] == "")
         throw Exception("groundtruth file is empty");
-    if (paths["index"] == "")
+    if (paths["index"] == "" && paths["flat_index"] == "")
         throw Exception("index path is empty");
-    if (M <= 0)
+    if (paths["flat_index"] == "" && M <= 0)
         throw Exception("M should be a positive integer");
-    if (ef_search <= 0)
+    if (paths["ef_calibration"] == "" && ef_search <= 0)
         throw Exception("ef_search should be a positive integer");
+    if (patience < 0)
+        throw Exception("patience should be a non-negative integer");
+    if (threads <= 0)
+        throw Exception("threads should be a positive integer");
+    if (vector_storage != iRangeGraph::VectorStorage::FP32 && (sq8 || paths["disk_vectors"] != "" || paths["flat_index"] != ""))
+        throw Exception("--vector_storage cannot be combined with --sq8, --disk_vectors or a flat index file");
+    if (cover_cache < 0)
+        throw Exception("cover_cache should be a non-negative integer");
+    if (interleave <= 0)
+        throw Exception("interleave should be a positive integer");
 
-    // Restrict number of threads to 1 for query execution
-    omp_set_num_threads(1);
+    // Restrict number of threads for query execution (1 unless --threads is given)
+    omp_set_num_threads(threads);
 
     // Monitor thread count
     std::atomic<bool> done(false);
@@ -61,6 +127,8 @@ int main(int argc, char **argv)
 
     // Load the index and data
     iRangeGraph::DataLoader storage;
+    storage.metric = metric;
+    storage.dtype = dtype;
     storage.query_K = query_K;
     storage.LoadQuery(paths["query_vector"]);
     
@@ -91,8 +159,39 @@ int main(int argc, char **argv)
     mapping_in.close();
     std::cout << "Loaded ID mapping from " << mapping_file << " (" << num_points << " points)" << std::endl;
 
-    // Load the index
-    iRangeGraph::iRangeGraph_Search<float> index(paths["data_vector"], paths["index"], &storage, M);
+    // Load the index, mapping a flat index file directly when one is given
+    std::unique_ptr<iRangeGraph::iRangeGraph_Search<float>> index_ptr;
+    if (paths["flat_index"] != "")
+        index_ptr.reset(new iRangeGraph::iRangeGraph_Search<float>(paths["flat_index"], &storage, mmap_populate));
+    else if (paths["disk_vectors"] != "")
+        index_ptr.reset(new iRangeGraph::iRangeGraph_Search<float>(paths["disk_vectors"], paths["index"], &storage, M, iRangeGraph::VectorStorage::SQ8_DISK, compact_links ? iRangeGraph::LinkStorage::COMPACT : iRangeGraph::LinkStorage::DENSE, placement));
+    else
+        index_ptr.reset(new iRangeGraph::iRangeGraph_Search<float>(paths["data_vector"], paths["index"], &storage, M, sq8 ? iRangeGraph::VectorStorage::SQ8 : vector_storage, compact_links ? iRangeGraph::LinkStorage::COMPACT : iRangeGraph::LinkStorage::DENSE, placement));
+    iRangeGraph::iRangeGraph_Search<float> &index = *index_ptr;
+    if (reorder_block > 0)
+        index.ReorderBlocks(reorder_block, threads);
+    if (M <= 0)
+        M = index.M_out;
+    if (linear_pool)
+        index.search_engine = iRangeGraph::SearchEngine::LINEAR_POOL;
+    index.patience = patience;
+    index.scan_threshold = scan_threshold;
+    if (cover_cache > 0)
+        index.EnableCoverCache(cover_cache);
+    index.group_ranges = group_ranges;
+    index.interleave_width = interleave;
+
+    // Per-query ef from a search() sweep instead of a single ef_search
+    std::unique_ptr<iRangeGraph::EfPolicy> ef_policy;
+    if (paths["ef_calibration"] != "")
+    {
+        ef_policy.reset(new iRangeGraph::EfPolicy());
+        ef_policy->Calibrate(paths["ef_calibration"], target_recall);
+        std::cout << "ef per range fraction 2^0..2^-9:";
+        for (int ef : ef_policy->ef_by_fraction)
+            std::cout << " " << ef;
+        std::cout << std::endl;
+    }
 
     // Store query results for later recall calculation
     std::vector<std::vector<int>> query_results(storage.query_nb);
@@ -100,26 +199,15 @@ int main(int argc, char **argv)
     // Start timing - measure only query execution, not recall calculation
     auto start_time = std::chrono::high_resolution_clock::now();
 
-    // Execute queries with single ef_search value
+    // Execute queries with single ef_search value, spread over 'threads' cores (edge_limit = M)
+    std::vector<std::priority_queue<iRangeGraph::PFI>> results = index.search_batch(storage.query_points, query_ranges, ef_search, query_K, M, threads, ef_policy.get());
+    if (index.cover_cache != nullptr)
+        std::cout << "range cover cache: " << index.cover_cache->hits << " hits, " << index.cover_cache->misses << " misses" << std::endl;
+
+    // Store results (translate from sorted to original ID space)
     for (int i = 0; i < storage.query_nb; i++)
     {
-        auto range_pair = query_ranges[i];
-        int ql = range_pair.first;
-        int qr = range_pair.second;
-
-        // Perform the search
-        std::vector<iRangeGraph::TreeNode*> filterednodes = index.tree->range_filter(index.tree->root, ql, qr);
-        std::priority_queue<iRangeGraph::PFI> res = index.TopDown_nodeentries_search(
-            filterednodes, 
-            storage.query_points[i].data(), 
-            ef_search,  // Use the ef_search parameter
-            query_K, 
-            ql, 
-            qr, 
-            M  // edge_limit = M
-        );
-
-        // Store results (translate from sorted to original ID space)
+        std::priority_queue<iRangeGraph::PFI> &res = results[i];
         query_results[i].reserve(query_K);
         while (!res.empty())
         {
@@ -161,9 +249,11 @@ int main(int argc, char **argv)
     // Print statistics in the expected format
     std::cout << "Query execution completed." << std::endl;
     std::cout << "Query time (s): " << elapsed.count() << std::endl;
+    std::cout << "Threads: " << threads << std::endl;
     std::cout << "Peak thread count: " << peak_threads.load() << std::endl;
     std::cout << "QPS: " << qps << std::endl;
     std::cout << "Recall: " << recall << std::endl;
+    IRG_STATS_PRINT(std::cout);
     
     // Print memory footprint
     peak_memory_footprint();